@@ -0,0 +1,14 @@
+#ifndef ART_STORE_H
+#define ART_STORE_H
+
+#include "file_list.h"
+#include "types.h"
+
+// Batch album-art export into a content-addressed store: each distinct APIC
+// picture is written once as <store_dir>/<xx>/<hash>.<ext> and a
+// track -> image mapping is printed. With strip set, each track's embedded
+// picture is replaced by an APIC link ("-->" MIME type) to the stored file.
+Status export_album_art(const FileList *files, const char *store_dir,
+                        int strip, int jobs);
+
+#endif // ART_STORE_H
@@ -0,0 +1,24 @@
+#ifndef AUDIO_HASH_H
+#define AUDIO_HASH_H
+
+#include "file_list.h"
+#include "types.h"
+#include <stdint.h>
+#include <sys/types.h>
+
+// Content hash of the MPEG audio payload only: the leading ID3v2 tag and the
+// trailing ID3v1 block are excluded, so retagging a file does not change it
+typedef struct {
+  uint64_t hash;
+  off_t audio_offset;
+  off_t audio_size;
+} AudioHash;
+
+// XXH64 of len bytes at offset of fd, in constant memory
+Status hash_file_range(int fd, off_t offset, off_t len, uint64_t *hash);
+Status hash_audio_payload(const char *filepath, AudioHash *result);
+// Hash every file with jobs worker threads and print a report that groups
+// files with identical audio
+Status hash_audio_batch(const FileList *files, int jobs);
+
+#endif // AUDIO_HASH_H
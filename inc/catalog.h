@@ -0,0 +1,30 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include "file_list.h"
+#include "track_table.h"
+#include "types.h"
+
+// Binary track catalogs, written per shard and merged into one. A catalog is
+// self-describing: a header (magic, version, shard i of N, record and string
+// counts, summary counters), the distinct strings, fixed-size records sorted
+// by path, and an XXH64 of everything before it. All integers are little
+// endian. The same tracks always give the same bytes, so merging the partials
+// of shards 1..N reproduces the catalog of an unsharded scan exactly.
+#define CATALOG_MAGIC "MP3TGCAT"
+#define CATALOG_VERSION 1
+
+// Scan files (already reduced to shard of shards) into a catalog at out_path
+Status write_catalog(const FileList *files, unsigned shard, unsigned shards,
+                     const char *out_path, int jobs);
+// Combine partial catalogs into one at out_path. Tracks listed by several
+// partials are kept once; if their records differ the first partial wins and
+// the conflict is reported. Missing or repeated shards are reported too.
+Status merge_catalogs(char **parts, int count, const char *out_path);
+// Load a catalog (a partial or a merged one) as a track table instead of
+// scanning the files: its paths, in catalog order, go into files, which
+// the table's rows refer to and which must outlive it
+Status load_catalog_tracks(const char *path, FileList *files,
+                           TrackTable *table);
+
+#endif // CATALOG_H
@@ -0,0 +1,16 @@
+#ifndef DIR_WATCH_H
+#define DIR_WATCH_H
+
+#include "types.h"
+
+// --watch: follow a directory tree with inotify and print one record per
+// settled change to stdout, tab separated:
+//   CHANGED  path  artist  album  title  year  bitrate  duration
+//   DELETED  path
+//   OVERFLOW root   (events were lost; the tree is walked again and every
+//                    file in it re-read and reported)
+// A file is re-read once no event has touched it for debounce_ms, so a burst
+// of writes produces one record. Runs until interrupted.
+Status watch_directory(const char *root, int debounce_ms, int jobs);
+
+#endif // DIR_WATCH_H
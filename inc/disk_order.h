@@ -0,0 +1,29 @@
+#ifndef DISK_ORDER_H
+#define DISK_ORDER_H
+
+#include "file_list.h"
+#include "types.h"
+#include <stdint.h>
+
+// Bytes read at each end of a file by the batch modes (ID3v2 header and the
+// trailing-tag probe); reads this close together are not counted as seeks
+#define DISK_ORDER_NEAR (1024 * 1024)
+
+typedef struct {
+  size_t by_extent; // Files placed by the physical address of their data
+  size_t by_inode;  // No extent information: placed by inode number
+  uint64_t seeks_before;
+  uint64_t seeks_after;
+  double travel_before; // Head movement in bytes
+  double travel_after;
+} DiskOrderStats;
+
+// Reorder files for one sweep of the disk. Each file's first and last extent
+// are looked up (FIEMAP, else FIBMAP); files are sorted by device and the
+// physical address of their head in ascending, elevator order, so its head
+// and tail reads follow each other with little travel. Files without extent
+// information are placed by inode number. The seek counts and head travel
+// compare the head-then-tail reads of the old and new orders.
+Status order_by_disk_layout(FileList *files, int jobs, DiskOrderStats *stats);
+
+#endif // DISK_ORDER_H
@@ -0,0 +1,27 @@
+#ifndef FILE_LIST_H
+#define FILE_LIST_H
+
+#include "types.h"
+#include <stddef.h>
+
+// Growable list of input paths for batch modes
+typedef struct {
+  char **paths;
+  size_t count;
+  size_t capacity;
+} FileList;
+
+void file_list_init(FileList *list);
+// Add a path as given, without looking at the filesystem
+Status file_list_push(FileList *list, const char *path);
+// Add a file, or every .mp3 below a directory (recursively)
+Status file_list_add_path(FileList *list, const char *path);
+void file_list_free(FileList *list);
+// Keep only the paths of shard index (1-based) of count. A path's shard is
+// a stable hash of the path as listed, so the same tree splits the same way
+// on every host and run.
+void file_list_shard(FileList *list, unsigned index, unsigned count);
+// Non-zero if the name ends in .mp3 (any case)
+int file_list_is_mp3(const char *name);
+
+#endif // FILE_LIST_H
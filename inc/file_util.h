@@ -0,0 +1,21 @@
+#ifndef FILE_UTIL_H
+#define FILE_UTIL_H
+
+#include "types.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+// write() until everything is out, retrying on EINTR and short writes
+Status write_all(int fd, const void *buf, size_t len);
+// Copy len bytes at offset of in_fd to the current position of out_fd, in
+// the kernel where possible (reflinked on filesystems that share extents).
+// Otherwise a reader thread and the caller overlap through two aligned
+// buffers. The source and destination pages a copy has passed are dropped
+// from the page cache as it goes.
+Status copy_file_bytes(int in_fd, off_t offset, off_t len, int out_fd);
+// Called from the copying thread as a copy advances, with the bytes done
+// and the copy's total
+typedef void (*CopyProgressFn)(off_t done, off_t total, void *ctx);
+void set_copy_progress(CopyProgressFn fn, void *ctx);
+
+#endif // FILE_UTIL_H
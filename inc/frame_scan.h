@@ -0,0 +1,76 @@
+#ifndef FRAME_SCAN_H
+#define FRAME_SCAN_H
+
+#include "file_list.h"
+#include "types.h"
+#include <stdint.h>
+#include <sys/types.h>
+
+// Every MPEG bitrate is a multiple of 8 kbps up to 448: frames are counted
+// per bitrate in slot kbps / 8
+#define SCAN_BITRATE_SLOTS (448 / 8 + 1)
+
+// Counters gathered while walking MPEG frames over a byte range
+typedef struct {
+  off_t start;            // Frame boundary the walk began at
+  off_t end;              // Offset the walk stopped at
+  uint64_t frames;        // Complete frames walked
+  uint64_t crc_checked;   // Protected frames whose CRC-16 was verified
+  uint64_t crc_errors;    // ...of which did not match
+  uint64_t crc_unchecked; // Protected frames of a layer with no CRC support
+  uint64_t garbage_bytes; // Bytes skipped between frames
+  uint64_t sync_losses;   // Places where the next header was not found
+  int truncated;          // Last frame runs past the end of the audio
+  uint64_t frame_bytes;   // Bytes in complete frames
+  double duration;        // Seconds, summed frame by frame
+  int min_bitrate;        // kbps, 0 until a frame is seen
+  int max_bitrate;
+  uint64_t bitrate_frames[SCAN_BITRATE_SLOTS];
+  uint64_t mode_changes; // Frames whose channel mode differs from the last
+  uint64_t rate_changes; // ...or whose sample rate does
+  int first_mode, last_mode; // Of the first and last frame walked, so that
+  int first_rate, last_rate; // ranges can be joined
+} FrameScanStats;
+
+// Whole-file result of a parallel frame scan
+typedef struct {
+  Status status;
+  off_t audio_start;
+  off_t audio_end;
+  FrameScanStats stats;
+  int chunks;  // Byte ranges the file was split into
+  int rewalks; // Ranges re-walked while stitching
+} FrameScanResult;
+
+// A frame boundary and the seconds of audio before it
+typedef struct {
+  off_t offset;
+  double time;
+  int snapped; // Moved back to avoid the bit reservoir
+} FrameBoundary;
+
+// Map times (ascending, seconds of audio) to the nearest frame boundaries of
+// the audio in [start, end). A leading Xing/Info/VBRI header frame is not
+// audio and is skipped; *first and *last receive the boundaries before the
+// first and after the last complete frame. Layer III frames may borrow bits
+// from the frames before them, so a boundary at such a frame moves back to
+// the closest frame that borrows nothing, up to RESERVOIR_LOOKBACK frames.
+#define RESERVOIR_LOOKBACK 16
+Status map_times_to_frames(int fd, off_t start, off_t end, const double *times,
+                           int count, FrameBoundary *out, FrameBoundary *first,
+                           FrameBoundary *last);
+
+// Walk every frame of every file. Files larger than a chunk are split into
+// byte ranges scanned on separate threads and stitched back together.
+Status scan_frames_parallel(const FileList *files, FrameScanResult *results,
+                            int jobs);
+// --scan: exact frame count, duration and bitrate statistics per file
+Status scan_mpeg_files(const FileList *files, int jobs);
+// --verify: per-file integrity summary; fails if any file is damaged
+Status verify_mpeg_files(const FileList *files, int jobs);
+// --profile: bitrate histogram, CBR/VBR, mode and sample-rate changes, junk
+// between frames and the byte layout (ID3v2, audio, trailing tags) per file,
+// from the same single walk as --scan
+Status profile_mpeg_files(const FileList *files, int jobs);
+
+#endif // FRAME_SCAN_H
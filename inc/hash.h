@@ -0,0 +1,22 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// XXH64 (xxHash, 64-bit): fast non-cryptographic content hash. The four
+// independent accumulator lanes keep the CPU pipelines full, so hashing runs
+// well above disk bandwidth.
+typedef struct {
+  uint64_t total_len;
+  uint64_t v[4];
+  unsigned char mem[32];
+  uint32_t mem_size;
+} Xxh64State;
+
+void xxh64_init(Xxh64State *state, uint64_t seed);
+void xxh64_update(Xxh64State *state, const void *data, size_t len);
+uint64_t xxh64_digest(const Xxh64State *state);
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif // HASH_H
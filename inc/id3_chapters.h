@@ -0,0 +1,74 @@
+#ifndef ID3_CHAPTERS_H
+#define ID3_CHAPTERS_H
+
+#include "types.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Chapter frames (ID3v2 Chapter Frame Addendum). CHAP holds an element ID,
+// start/end time in ms and byte offsets, then sub-frames (usually a TIT2
+// title); CTOC lists chapter IDs in play order. Every CHAP and CTOC frame of
+// a tag is kept, as an ID3v2.3 frame, in one block that a tag rewrite writes
+// back unchanged. Frames too large for the reader's memory limits stay in the
+// file instead, and a rewrite copies them from there. The index over the CHAP
+// frames is sorted by start time, and titles are decoded only when asked for.
+typedef struct {
+  uint32_t start_ms;
+  uint32_t end_ms;
+  uint32_t offset; // Of the CHAP frame (header included) in the block...
+  uint32_t size;
+  int in_file; // ...or, for a frame left in the file, of its first bytes in
+               // stubs (a title past them is not shown)
+  char *title; // Decoded on first use
+  int title_loaded;
+} Id3Chapter;
+
+// A whole chapter frame, header included, left in the file it was read from
+typedef struct {
+  off_t offset;
+  uint32_t size;
+} ChapterRef;
+
+typedef struct {
+  unsigned char *block;
+  size_t block_len;
+  size_t block_cap;
+  unsigned char *stubs;
+  size_t stubs_len;
+  size_t stubs_cap;
+  ChapterRef *refs;
+  int ref_count;
+  int ref_capacity;
+  int lost; // A frame could be neither held nor left in the file
+  Id3Chapter *items; // Sorted by start time
+  int count;
+  int capacity;
+} ChapterTable;
+
+// Add a CHAP or CTOC frame body read from a tag of the given major version.
+// Malformed frames are rejected with ERROR_INVALID_FORMAT.
+Status chapter_table_add(ChapterTable *table, const char *frame_id,
+                         const unsigned char *body, uint32_t size,
+                         int major_version);
+// Index a CHAP frame that is not held, from the first prefix_len bytes of its
+// body (ERROR_INVALID_FORMAT if they do not hold its times)
+Status chapter_table_index(ChapterTable *table, const unsigned char *prefix,
+                           uint32_t prefix_len, int major_version);
+// Add a CHAP or CTOC frame of size bytes (header included) that stays at
+// offset in the file. It must be an ID3v2.3 frame as it stands.
+Status chapter_table_add_ref(ChapterTable *table, off_t offset,
+                             uint32_t size);
+void chapter_table_sort(ChapterTable *table);
+// The chapter playing at ms, or -1 (binary search)
+int chapter_at(const ChapterTable *table, uint32_t ms);
+const char *chapter_element_id(const ChapterTable *table, int i);
+// TIT2 of the chapter, or NULL
+const char *chapter_title(ChapterTable *table, int i);
+void chapter_table_free(ChapterTable *table);
+
+// --chapters: list a file's chapters, or with at set ("1:02:03.5" or
+// seconds) only the chapter playing at that time
+Status list_chapters(const char *filepath, const char *at);
+
+#endif // ID3_CHAPTERS_H
@@ -1,10 +1,22 @@
 #ifndef ID3_READER_H
 #define ID3_READER_H
 
+#include "tail_tags.h"
 #include "types.h"
+#include <sys/types.h>
 
 Status read_id3_tags(const char *filepath);
 Status update_id3_tags(const char *filepath, const TagUpdate *update);
 Status delete_id3_tags(const char *filepath);
+// Byte range [start, end) of the audio payload of an open file: everything
+// after the leading ID3v2 tag and before the trailing tag blocks (ID3v1,
+// APEv2, Lyrics3, appended ID3v2)
+void locate_audio_range(int fd, off_t size, off_t *start, off_t *end);
+// Same, with the trailing tags already probed, or NULL to probe them
+void locate_audio_range_tail(int fd, off_t size, const TailTags *tail,
+                             off_t *start, off_t *end);
+// Probe the trailing tags of a file once, for an operation that runs several
+// readers over it (above the leading ID3v2 tag, as locate_audio_range does)
+Status probe_file_tail(const char *filepath, TailTags *tail);
 
 #endif // ID3_READER_H
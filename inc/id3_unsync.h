@@ -0,0 +1,28 @@
+#ifndef ID3_UNSYNC_H
+#define ID3_UNSYNC_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// ID3v2 unsynchronisation puts a 0x00 after every 0xFF in the tag so that no
+// byte pair looks like an MPEG sync word to players that do not know ID3.
+// Decoding drops those bytes again.
+
+// Decode len bytes in place and return the decoded length. *after_ff says
+// the byte before buf was 0xFF, so a body can be decoded chunk by chunk;
+// start it at 0.
+size_t id3v2_resync(unsigned char *buf, size_t len, int *after_ff);
+
+typedef struct {
+  FILE *raw;
+  off_t left; // Encoded bytes not yet taken from raw
+  int after_ff;
+} ResyncSource;
+
+// A read-only stream of the decoded form of the next size bytes of raw.
+// Nothing past them is read, so once the stream is closed exactly
+// size - src->left bytes of raw have been consumed. NULL on failure.
+FILE *open_resync_stream(ResyncSource *src, FILE *raw, off_t size);
+
+#endif // ID3_UNSYNC_H
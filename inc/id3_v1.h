@@ -1,8 +1,10 @@
 #ifndef ID3_V1_H
 #define ID3_V1_H
 
+#include "tail_tags.h"
 #include "types.h"
 #include <stdio.h>
+#include <sys/types.h>
 
 /*
     ID3v1 structure: 128 bytes
@@ -17,7 +19,18 @@
 
 // Function to check if ID3v1 tag exists and read it
 Status read_id3v1_tag(const char *filepath, ID3v1_Tag *tag);
-Status write_id3v1_tag(const char *filepath, const ID3v1_Tag *tag);
+// The tag found by a probe of the file's trailing tags
+Status read_id3v1_from_tail(const TailTags *tail, ID3v1_Tag *tag);
+// Apply update to the ID3v1 tag of the size-byte file open on fd: in place
+// wherever it sits among the trailers, or appended. Meant for the
+// replacement of a SafeWrite, so the tag commits with the rest of the file.
+Status write_id3v1_update(int fd, off_t size, const TagUpdate *update);
 Status remove_id3v1_tag(const char *filepath);
 
+// Buffer-level helpers shared by the file and stream paths
+Status parse_id3v1_tag(const unsigned char buffer[128], ID3v1_Tag *tag);
+void encode_id3v1_tag(const ID3v1_Tag *tag, unsigned char buffer[128]);
+// Apply the fields of an update; had_tag == 0 starts from a blank tag
+void merge_id3v1_update(ID3v1_Tag *tag, const TagUpdate *update, int had_tag);
+
 #endif // ID3_V1_H
@@ -1,7 +1,20 @@
 #ifndef ID3_V2_H
 #define ID3_V2_H
 
+#include "id3_chapters.h"
+#include "safe_write.h"
+#include "tail_tags.h"
 #include "types.h"
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Memory limits of the tag reader. Frames larger than the cap are not held in
+// memory (pictures stay in the file and are copied from there when the tag is
+// rewritten; other frames are truncated), and the frames loaded from one file
+// never total more than the budget.
+#define ID3V2_DEFAULT_FRAME_CAP (1024 * 1024)
+#define ID3V2_DEFAULT_MEM_BUDGET (4 * 1024 * 1024)
 
 // Image metadata
 typedef struct {
@@ -9,9 +22,28 @@ typedef struct {
   uint8_t type;
   char *description;
   uint32_t size;
-  unsigned char *data;
+  unsigned char *data; // NULL if the picture was too large to load...
+  off_t data_offset;   // ...in which case it is still at this file offset
 } ImageMetadata;
 
+// Where the picture bytes of the first APIC frame sit in the file
+typedef struct {
+  off_t offset; // File offset of the first picture byte
+  uint32_t size;
+  char mime_type[64];
+  uint8_t type;
+} ImageLocation;
+
+// ID3v2_Content.text_lost bits (in --fields order): kept fields that the
+// memory limits cut short or skipped, so writing them back would lose text
+#define ID3V2_LOST_TITLE 0x01
+#define ID3V2_LOST_ARTIST 0x02
+#define ID3V2_LOST_ALBUM 0x04
+#define ID3V2_LOST_YEAR 0x08
+#define ID3V2_LOST_GENRE 0x10
+#define ID3V2_LOST_TRACK 0x20
+#define ID3V2_LOST_COMMENT 0x40
+
 // Struct for ID3v2 tag data (simplified for display)
 typedef struct {
   char *title;
@@ -24,12 +56,82 @@ typedef struct {
   char *genre;
   char *track;
   int major_version;
+  unsigned text_lost; // ID3V2_LOST_* fields held short of the file
   ImageMetadata image;
+  ChapterTable chapters;
 } ID3v2_Content;
 
+void set_id3v2_memory_limits(uint32_t frame_cap, size_t mem_budget);
+// With load 0, pictures in seekable files are always left in place, for
+// callers that need the size of a tag but not its picture bytes
+void set_id3v2_picture_loading(int load);
+
 // Function to read ID3v2 tag
 Status read_id3v2_tag(const char *filepath, ID3v2_Content *content);
-Status write_id3v2_tag(const char *filepath, const TagUpdate *update);
+// Same, with the file's trailing tags already probed, for the appended tag
+// of a file without a leading one (NULL probes them)
+Status read_id3v2_tag_tail(const char *filepath, const TailTags *tail,
+                           ID3v2_Content *content);
+// Total bytes (header, body and footer) of the tag starting with header, or
+// 0 when header is not an ID3v2 header
+off_t id3v2_tag_length(const unsigned char header[10]);
+// Parse a tag from a stream whose 10-byte header has already been read;
+// leaves the stream positioned just past the tag
+Status read_id3v2_stream(FILE *fp, const unsigned char header[10],
+                         ID3v2_Content *content);
+// Text of a frame body (encoding byte, then the string), or NULL
+char *decode_id3v2_text(const unsigned char *body, uint32_t size);
+// Gather list for a serialized ID3v2.3 tag: the tag header, frame headers
+// and encoding bytes live in scratch, text values and picture bytes are
+// referenced in place. Chapter frames and a picture that were never loaded
+// are copied from the source file after it, in that order. Sizes are exact
+// before anything is written.
+#define ID3V2_PLAN_MAX_IOV 32
+typedef struct {
+  struct iovec iov[ID3V2_PLAN_MAX_IOV];
+  int iov_count;
+  unsigned char scratch[10 + 8 * 11];
+  size_t scratch_used;
+  size_t total_size; // Tag bytes, header included
+  const ChapterRef *chapter_refs; // Chapter frames still in the source file
+  int chapter_ref_count;
+  int chapters_lost;     // Writing would drop chapters: refused
+  unsigned text_lost;    // ...or cut short text the update keeps
+  off_t deferred_offset; // Picture bytes still in the source file
+  uint32_t deferred_len;
+} Id3v2WritePlan;
+
+// Plan a complete tag: existing content overridden by update. The plan points
+// into both, so they must outlive it.
+void plan_id3v2_tag(Id3v2WritePlan *plan, const ID3v2_Content *content,
+                    const TagUpdate *update);
+// Append an APIC frame, or frames already serialized, to a plan. A deferred
+// picture must be the last thing added.
+void plan_id3v2_image(Id3v2WritePlan *plan, const ImageMetadata *image);
+void plan_id3v2_frames(Id3v2WritePlan *plan, const unsigned char *frames,
+                       size_t len);
+// Serialize the frames of content (no tag header) into one malloc'd buffer;
+// chapter frames and a picture that were never loaded are read from
+// source_fd. ERROR_MEM_ALLOC if chapters or kept text were lost to the
+// memory limits.
+Status serialize_id3v2_frames(const ID3v2_Content *content, int source_fd,
+                              unsigned char **frames, size_t *len);
+// source_fd is the file the content was read from (for frames never loaded).
+// ERROR_MEM_ALLOC, before anything is written, if chapters or text the tag
+// keeps were lost to the reader's memory limits.
+Status write_id3v2_plan(int fd, const Id3v2WritePlan *plan, int source_fd);
+// Rewrite the file's tag from content, overridden by update
+Status write_id3v2_content(const char *filepath, const ID3v2_Content *content,
+                           const TagUpdate *update);
+// Same, into a replacement already begun (for callers that read the tag
+// under the writer lock); the caller commits
+Status write_id3v2_rewrite(SafeWrite *sw, const ID3v2_Content *content,
+                           const TagUpdate *update);
+// Write a planned tag and the original's audio into a replacement already
+// begun; the caller commits
+Status write_id3v2_replace(SafeWrite *sw, const Id3v2WritePlan *plan);
+// Find the embedded picture without loading it
+Status locate_id3v2_image(const char *filepath, ImageLocation *loc);
 Status remove_id3v2_tag(const char *filepath);
 void free_id3v2_content(ID3v2_Content *content);
 
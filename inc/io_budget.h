@@ -0,0 +1,52 @@
+#ifndef IO_BUDGET_H
+#define IO_BUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Process-wide limits on read bytes, write bytes and I/O operations per
+// second, for batch runs that share disks with production traffic. Each
+// limit is a token bucket shared by all worker threads. I/O is charged after
+// it is done: the bucket may go into debt, and the caller sleeps it off
+// outside the lock, so threads queue up behind one another at the limit.
+// The bucket holds at most IO_BURST_MS of credit, which keeps an idle spell
+// from turning into a burst. Without limits every charge is a no-op.
+#define IO_BURST_MS 100
+#define IO_REPORT_INTERVAL 10 // Seconds between status lines on stderr
+
+typedef struct {
+  uint64_t limit;  // Per second, 0 = unlimited
+  uint64_t total;  // Charged so far
+  double level;    // Tokens in the bucket (negative: debt)
+  double rate;     // Measured since the first charge, per second
+} IoBucketState;
+
+typedef struct {
+  IoBucketState read, write, ops;
+  double throttled; // Seconds all threads spent waiting, summed
+  double elapsed;   // Since the first charge
+} IoBudgetStats;
+
+// 0 leaves that kind of I/O unlimited. Call before any worker starts.
+void set_io_limits(uint64_t read_bps, uint64_t write_bps, uint64_t iops);
+int io_budget_active(void);
+// One operation that read or wrote bytes; may sleep
+void io_charge_read(uint64_t bytes);
+void io_charge_write(uint64_t bytes);
+// want, or less so one request stays within IO_BURST_MS of the tighter byte
+// limit (never under 64 KB)
+size_t io_budget_chunk(size_t want);
+// The same for a request that only reads, against the read limit alone
+size_t io_read_chunk(size_t want);
+// A read limit is set: readahead hints would fetch data ahead of the budget
+int io_read_limited(void);
+// Linux idle I/O scheduling class for this process, inherited by the threads
+// it starts afterwards. Returns 0 where that is not available.
+int set_io_idle(void);
+void io_budget_stats(IoBudgetStats *stats);
+// "I/O budget: ..." line with the totals, throughput, bucket levels and
+// time spent throttled
+void print_io_budget(FILE *out);
+
+#endif // IO_BUDGET_H
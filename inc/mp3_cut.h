@@ -0,0 +1,16 @@
+#ifndef MP3_CUT_H
+#define MP3_CUT_H
+
+#include "types.h"
+
+// Lossless cutting at frame boundaries. Times are seconds ("95.5") or
+// [h:]m:ss[.fff]; each is moved to the nearest frame boundary. Every output
+// gets a fresh ID3v2 tag built from the source's, and the audio frames are
+// copied unchanged (copy_file_range, so reflinked where the filesystem can).
+
+// --cut "start-end" (end may be left out): writes <name>_cut.mp3
+Status cut_mp3(const char *filepath, const char *range);
+// --split-at "t1,t2,...": writes <name>_01.mp3 ... with track numbers i/N
+Status split_mp3(const char *filepath, const char *points);
+
+#endif // MP3_CUT_H
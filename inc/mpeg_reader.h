@@ -1,7 +1,9 @@
 #ifndef MPEG_READER_H
 #define MPEG_READER_H
 
+#include "tail_tags.h"
 #include "types.h"
+#include <sys/types.h>
 
 typedef struct {
   char version[10]; // e.g., "MPEG 1"
@@ -10,10 +12,30 @@ typedef struct {
   int sample_rate;  // Hz
   char mode[16];    // e.g., "Joint Stereo"
   double duration;  // Seconds
-  long filesize;    // Bytes
+  off_t filesize;   // Bytes
 } MpegInfo;
 
+// Decoded 4-byte MPEG audio frame header
+typedef struct {
+  int version;      // Raw version bits: 3 = MPEG 1, 2 = MPEG 2, 0 = MPEG 2.5
+  int layer;        // 1, 2 or 3
+  int protected;    // A CRC-16 follows the header
+  int bitrate;      // kbps
+  int sample_rate;  // Hz
+  int padding;      // Padding slot present
+  int channel_mode; // 0 Stereo, 1 Joint, 2 Dual, 3 Single
+  int mode_ext;     // Joint stereo mode extension
+  int frame_size;   // Bytes, header included
+  int samples;      // PCM samples per channel in this frame
+} MpegFrameHeader;
+
+// Decode the header at h (4 bytes); returns 0 if it is not a valid header
+int parse_frame_header(const unsigned char *h, MpegFrameHeader *hdr);
+
 // Function to read MPEG header and calculate info
 Status read_mpeg_info(const char *filepath, MpegInfo *info);
+// Same, with the file's trailing tags already probed (NULL probes them)
+Status read_mpeg_info_tail(const char *filepath, const TailTags *tail,
+                           MpegInfo *info);
 
 #endif // MPEG_READER_H
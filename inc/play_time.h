@@ -0,0 +1,12 @@
+#ifndef PLAY_TIME_H
+#define PLAY_TIME_H
+
+#include <stddef.h>
+
+// Seconds from "95.5" or "[h:]m:ss[.fff]"; *end receives the first unused
+// character. Returns 0 if s does not start with a time.
+int parse_play_time(const char *s, const char **end, double *seconds);
+// "m:ss.fff", or "h:mm:ss.fff" from an hour on
+void format_play_time(double seconds, char *buf, size_t size);
+
+#endif // PLAY_TIME_H
@@ -0,0 +1,39 @@
+#ifndef SAFE_WRITE_H
+#define SAFE_WRITE_H
+
+#include "types.h"
+#include <limits.h>
+#include <sys/types.h>
+#include <time.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+// A rewrite of one file by replacement. begin opens and flock()s the
+// original and records its size and mtime; the caller reads it and writes
+// the new contents to tmp_fd, a private mkstemp() file in the same
+// directory; commit swaps the new file in atomically, unless the original
+// was changed in the meantime (ERROR_CONFLICT).
+typedef struct {
+  const char *path;
+  int fd;     // Original, read-only; holds the lock
+  int tmp_fd; // Replacement
+  char tmp_path[PATH_MAX];
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+} SafeWrite;
+
+// Wait for other writers' locks (default), or fail with ERROR_FILE_BUSY
+void set_write_lock_wait(int wait);
+// Take the exclusive writer lock on an open file (for in-place writers)
+Status safe_write_lock(int fd);
+
+Status safe_write_begin(SafeWrite *sw, const char *path);
+Status safe_write_commit(SafeWrite *sw);
+// Drop the replacement and release the lock
+void safe_write_abort(SafeWrite *sw);
+
+#endif // SAFE_WRITE_H
@@ -0,0 +1,35 @@
+#ifndef STRING_POOL_H
+#define STRING_POOL_H
+
+#include "types.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Interned strings: each distinct string is stored once in an arena and
+// identified by a dense integer code, so repeated artists, albums and genres
+// cost 4 bytes per use. Code 0 is always the empty string.
+typedef struct {
+  uint32_t hash;
+  uint32_t code; // Code + 1, 0 = free slot
+} StringSlot;
+
+typedef struct {
+  char *arena;
+  size_t arena_used;
+  size_t arena_cap;
+  uint32_t *offsets; // Code -> arena offset
+  uint32_t count;
+  uint32_t capacity;
+  StringSlot *slots; // Open-addressing index over the codes
+  size_t slot_mask;
+} StringPool;
+
+Status string_pool_init(StringPool *pool);
+// Code of s, adding it if it is new; NULL interns as the empty string
+Status string_pool_intern(StringPool *pool, const char *s, uint32_t *code);
+// Code of s if it has been interned; returns 0 otherwise
+int string_pool_find(const StringPool *pool, const char *s, uint32_t *code);
+const char *string_pool_get(const StringPool *pool, uint32_t code);
+void string_pool_free(StringPool *pool);
+
+#endif // STRING_POOL_H
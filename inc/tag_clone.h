@@ -0,0 +1,19 @@
+#ifndef TAG_CLONE_H
+#define TAG_CLONE_H
+
+#include "file_list.h"
+#include "types.h"
+
+// Fields copied by --copy-tags-from unless --fields says otherwise
+#define CLONE_DEFAULT_FIELDS "artist,album,year,genre,art"
+
+// Copy the selected fields ("title,artist,album,year,genre,track,comment,art")
+// of the source's tag to every target. The source is parsed once and its
+// frames are serialized once into a shared read-only buffer; each target's
+// new tag is that buffer plus the target's own remaining frames, written in
+// one writev() on jobs threads. Selected fields missing from the source are
+// removed from the targets.
+Status copy_tags_from(const char *source, const char *fields,
+                      const FileList *targets, int jobs);
+
+#endif // TAG_CLONE_H
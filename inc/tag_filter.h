@@ -0,0 +1,13 @@
+#ifndef TAG_FILTER_H
+#define TAG_FILTER_H
+
+#include "types.h"
+#include <stdio.h>
+
+// Streaming retag: copy an MP3 from in to out in one pass, replacing the
+// leading ID3v2 tag with a freshly serialized one and rewriting (or appending)
+// the trailing ID3v1 block. Audio is passed through in constant memory.
+// Must be called before any other I/O has been done on in.
+Status filter_id3_tags(FILE *in, FILE *out, const TagUpdate *update);
+
+#endif // TAG_FILTER_H
@@ -0,0 +1,39 @@
+#ifndef TAIL_TAGS_H
+#define TAIL_TAGS_H
+
+#include "types.h"
+#include <sys/types.h>
+
+// Tag blocks that can follow the audio, in any order and combination:
+//   ID3v1     128 bytes, "TAG"
+//   APEv2     found by its 32-byte "APETAGEX" footer (header optional)
+//   Lyrics3   v2 ("LYRICS200" with a 6-digit size) or v1 ("LYRICSEND")
+//   ID3v2     appended v2.4 tag, found by its "3DI" footer
+#define TAIL_PROBE_SIZE (64 * 1024) // Bytes read from the end of the file
+#define TAIL_MAX_BLOCKS 8
+
+typedef enum { TAIL_ID3V1, TAIL_APEV2, TAIL_LYRICS3, TAIL_ID3V2 } TailTagType;
+
+typedef struct {
+  TailTagType type;
+  off_t offset;
+  off_t size;
+} TailBlock;
+
+typedef struct {
+  TailBlock blocks[TAIL_MAX_BLOCKS]; // Last block in the file first
+  int count;
+  off_t audio_end;       // Offset of the first trailing block (or file size)
+  int v1_index;          // Block holding the ID3v1 tag, -1 if none
+  unsigned char v1[128]; // Its bytes
+} TailTags;
+
+// Find and measure every trailing tag with a single read of the last
+// TAIL_PROBE_SIZE bytes. floor is the end of the leading ID3v2 tag; nothing
+// before it is taken for a trailer. Blocks whose footer lies in the window
+// are measured even if they extend before it.
+Status probe_tail_tags(int fd, off_t size, off_t floor, TailTags *tail);
+// The last block of the given type, or NULL
+const TailBlock *find_tail_block(const TailTags *tail, TailTagType type);
+
+#endif // TAIL_TAGS_H
@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+#include <stdint.h>
+
+// Lightweight tracer for the hot paths, compiled in with `make TRACE=1`
+// (-DMP3TAG_TRACE) and switched on at run time with --trace FILE. Each thread
+// records into its own ring of TRACE_RING_EVENTS events (the oldest are
+// overwritten, nothing is locked), and at exit all rings are written out as
+// Chrome trace-event JSON for a timeline viewer (chrome://tracing, Perfetto).
+// Without the define every probe compiles to nothing.
+#define TRACE_RING_EVENTS (1 << 16)
+#define TRACE_DETAIL_SIZE 32 // Bytes of detail kept (the end of long paths)
+
+#ifdef MP3TAG_TRACE
+
+// Start recording; the trace is written to out_path when the program exits
+Status trace_start(const char *out_path);
+// Clock for spans, or 0 when not recording
+uint64_t trace_now(void);
+// A span from start (a trace_now() value) to now, and a point in time.
+// detail (a path or frame ID, may be NULL) and value are shown as arguments.
+void trace_span(const char *name, uint64_t start, const char *detail,
+                int64_t value);
+void trace_mark(const char *name, const char *detail, int64_t value);
+
+#define TRACE_BEGIN(var) uint64_t var = trace_now()
+#define TRACE_END(var, name, detail, value)                                   \
+  trace_span(name, var, detail, (int64_t)(value))
+#define TRACE_MARK(name, detail, value)                                       \
+  trace_mark(name, detail, (int64_t)(value))
+
+#else
+
+#define TRACE_BEGIN(var) ((void)0)
+#define TRACE_END(var, name, detail, value) ((void)0)
+#define TRACE_MARK(name, detail, value) ((void)0)
+
+#endif // MP3TAG_TRACE
+
+#endif // TRACE_H
@@ -0,0 +1,19 @@
+#ifndef TRACK_QUERY_H
+#define TRACK_QUERY_H
+
+#include "file_list.h"
+#include "types.h"
+
+// --where / --group-by over the scanned files, or with catalog set over the
+// tracks of that catalog (files is not read).
+//   where:    clauses joined by "and", each "<field><op><value>" with op one
+//             of = != < <= > >= ~ (case-insensitive substring), e.g.
+//             "artist=Queen and bitrate<128". NULL matches every track.
+//   group_by: field to group the matching tracks by, or NULL to list them.
+//   distinct: with group_by, only report groups in which this field takes
+//             more than one value (e.g. albums with inconsistent years).
+Status query_tracks(const FileList *files, const char *catalog,
+                    const char *where, const char *group_by,
+                    const char *distinct, int jobs);
+
+#endif // TRACK_QUERY_H
@@ -0,0 +1,56 @@
+#ifndef TRACK_TABLE_H
+#define TRACK_TABLE_H
+
+#include "file_list.h"
+#include "string_pool.h"
+#include "types.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Queryable fields. Text fields come from the ID3v2 tag, or the ID3v1 tag
+// when the ID3v2 frame is missing; the rest from the MPEG header.
+typedef enum {
+  FIELD_TITLE,
+  FIELD_ARTIST,
+  FIELD_ALBUM,
+  FIELD_YEAR,
+  FIELD_GENRE,
+  FIELD_TRACK,
+  FIELD_COMMENT,
+  FIELD_TEXT_COUNT, // Fields above are interned text columns
+  FIELD_TAG = FIELD_TEXT_COUNT, // 0 none, 1 ID3v1 only, else ID3v2 major
+  FIELD_BITRATE,                // kbps
+  FIELD_SAMPLE_RATE,            // Hz
+  FIELD_DURATION,               // Seconds
+  FIELD_SIZE,                   // File bytes
+  FIELD_COUNT
+} TrackField;
+
+// Scan results stored column by column: one array per field, indexed by row,
+// with text fields as codes into a shared string pool. A million tracks take
+// about 45 MB plus the distinct strings.
+typedef struct {
+  const FileList *files; // Row i is files->paths[i]
+  size_t rows;
+  StringPool strings;
+  uint32_t *text[FIELD_TEXT_COUNT];
+  uint8_t *tag;
+  uint16_t *bitrate;
+  uint16_t *sample_rate;
+  float *duration;
+  int64_t *size;
+} TrackTable;
+
+// Empty columns for one row per file, for loaders other than the scan
+Status track_table_init(TrackTable *table, const FileList *files);
+// Read the tags and MPEG header of every file on up to jobs threads
+Status track_table_load(TrackTable *table, const FileList *files, int jobs);
+void track_table_free(TrackTable *table);
+
+// Field by name (e.g. "artist", "bitrate"); -1 if unknown
+int track_field_lookup(const char *name);
+const char *track_field_name(int field);
+// Numeric value of a non-text field
+double track_field_number(const TrackTable *table, int field, size_t row);
+
+#endif // TRACK_TABLE_H
@@ -9,7 +9,9 @@ typedef enum {
   ERROR_INVALID_FORMAT,
   ERROR_MEM_ALLOC,
   ERROR_TAG_NOT_FOUND,
-  ERROR_WRITE_FAILED
+  ERROR_WRITE_FAILED,
+  ERROR_FILE_BUSY, // Locked by another writer (non-blocking mode)
+  ERROR_CONFLICT   // Changed by someone else between read and commit
 } Status;
 
 typedef struct {
@@ -0,0 +1,11 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+
+// Call fn(i, ctx) for every i in [0, count) on up to jobs threads. Items are
+// handed out in order; runs inline if no thread can be started.
+void run_parallel(size_t count, int jobs, void (*fn)(size_t i, void *ctx),
+                  void *ctx);
+
+#endif // WORKER_POOL_H
@@ -0,0 +1,21 @@
+#ifndef WRITE_COST_H
+#define WRITE_COST_H
+
+#include "file_list.h"
+#include "types.h"
+
+// --plan: what a tag update (or, with delete_tags, -d) would do to every
+// file, without writing anything. Each file's tags are parsed the way the
+// writer parses them, with pictures left unread, and the new tag is planned
+// with the writer's own code, so the byte counts are exact. Strategies:
+//   rewrite-grow / rewrite-shrink / rewrite  the new ID3v2 tag is larger,
+//     smaller or the same size; the file is rebuilt from a temporary copy
+//   truncate  -d: only the audio between the tags is copied
+//   none      -d on a file without tags
+// The ID3v1 tag is written in place, or appended when there is none.
+#define WRITE_COST_HEAVIEST 5 // Largest jobs listed in the summary
+
+Status plan_tag_writes(const FileList *files, const TagUpdate *update,
+                       int delete_tags, int jobs);
+
+#endif // WRITE_COST_H
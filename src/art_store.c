@@ -0,0 +1,188 @@
+#include "../inc/art_store.h"
+#include "../inc/audio_hash.h"
+#include "../inc/file_util.h"
+#include "../inc/id3_v2.h"
+#include "../inc/safe_write.h"
+#include "../inc/worker_pool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef enum { ART_NONE, ART_STORED, ART_DUPLICATE, ART_FAILED } ArtOutcome;
+
+typedef struct {
+  ArtOutcome outcome;
+  uint32_t size;
+  char path[1100]; // Stored image
+} ArtResult;
+
+typedef struct {
+  const FileList *files;
+  const char *store_dir;
+  int strip;
+  ArtResult *results;
+} ArtBatch;
+
+static const char *image_extension(const char *mime) {
+  if (strstr(mime, "jpeg") || strstr(mime, "jpg") || strcmp(mime, "JPG") == 0)
+    return "jpg";
+  if (strstr(mime, "png") || strcmp(mime, "PNG") == 0)
+    return "png";
+  if (strstr(mime, "gif") || strcmp(mime, "GIF") == 0)
+    return "gif";
+  return "bin";
+}
+
+// Publish the image under its final name. The bytes go to a private temp file
+// first and are linked into place, so concurrent writers of the same image
+// never expose a partial file and exactly one of them wins.
+static ArtOutcome store_image(int fd, const ImageLocation *loc,
+                              const char *final_path, const char *dir) {
+  struct stat st;
+  if (stat(final_path, &st) == 0)
+    return (uint32_t)st.st_size == loc->size ? ART_DUPLICATE : ART_FAILED;
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    return ART_FAILED;
+  char tmp_path[1100];
+  snprintf(tmp_path, sizeof(tmp_path), "%s/.tmp-XXXXXX", dir);
+  int out = mkstemp(tmp_path);
+  if (out < 0)
+    return ART_FAILED;
+  Status status = copy_file_bytes(fd, loc->offset, loc->size, out);
+  close(out);
+
+  ArtOutcome outcome = ART_FAILED;
+  if (status == SUCCESS) {
+    chmod(tmp_path, 0644);
+    if (link(tmp_path, final_path) == 0)
+      outcome = ART_STORED;
+    else if (errno == EEXIST)
+      outcome = ART_DUPLICATE;
+  }
+  unlink(tmp_path);
+  return outcome;
+}
+
+// Replace the embedded picture with a link to the stored copy
+static Status strip_image(const char *filepath, const char *stored_path) {
+  SafeWrite sw;
+  Status status = safe_write_begin(&sw, filepath);
+  if (status != SUCCESS)
+    return status;
+  ID3v2_Content content;
+  memset(&content, 0, sizeof(ID3v2_Content));
+  status = read_id3v2_tag(filepath, &content);
+  if (status == SUCCESS) {
+    free(content.image.mime_type);
+    free(content.image.data);
+    content.image.mime_type = strdup("-->");
+    content.image.data = (unsigned char *)strdup(stored_path);
+    content.image.size = (uint32_t)strlen(stored_path);
+
+    TagUpdate none;
+    memset(&none, 0, sizeof(TagUpdate));
+    if (content.image.mime_type && content.image.data)
+      status = write_id3v2_rewrite(&sw, &content, &none);
+    else
+      status = ERROR_MEM_ALLOC;
+  }
+  free_id3v2_content(&content);
+  if (status != SUCCESS) {
+    safe_write_abort(&sw);
+    return status;
+  }
+  return safe_write_commit(&sw);
+}
+
+static void export_one(size_t i, void *ctx) {
+  ArtBatch *batch = (ArtBatch *)ctx;
+  ArtResult *result = &batch->results[i];
+  const char *filepath = batch->files->paths[i];
+
+  ImageLocation loc;
+  memset(&loc, 0, sizeof(ImageLocation));
+  if (locate_id3v2_image(filepath, &loc) != SUCCESS || loc.size == 0 ||
+      strcmp(loc.mime_type, "-->") == 0) {
+    result->outcome = ART_NONE;
+    return;
+  }
+  result->size = loc.size;
+  result->outcome = ART_FAILED;
+
+  int fd = open(filepath, O_RDONLY);
+  if (fd < 0)
+    return;
+  uint64_t hash;
+  // Hashed where it lies in the file
+  if (hash_file_range(fd, loc.offset, loc.size, &hash) == SUCCESS) {
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s/%02x", batch->store_dir,
+             (unsigned)(hash >> 56));
+    snprintf(result->path, sizeof(result->path), "%s/%016llx.%s", dir,
+             (unsigned long long)hash, image_extension(loc.mime_type));
+    result->outcome = store_image(fd, &loc, result->path, dir);
+  }
+  close(fd);
+
+  if (batch->strip && result->outcome != ART_FAILED &&
+      strip_image(filepath, result->path) != SUCCESS)
+    result->outcome = ART_FAILED;
+}
+
+Status export_album_art(const FileList *files, const char *store_dir,
+                        int strip, int jobs) {
+  if (!files || !store_dir)
+    return ERROR_INVALID_FORMAT;
+  if (mkdir(store_dir, 0755) != 0 && errno != EEXIST) {
+    printf("Error: Could not create art store '%s'\n", store_dir);
+    return ERROR_FILE_OPEN;
+  }
+
+  ArtBatch batch;
+  batch.files = files;
+  batch.store_dir = store_dir;
+  batch.strip = strip;
+  batch.results = (ArtResult *)calloc(files->count, sizeof(ArtResult));
+  if (!batch.results)
+    return ERROR_MEM_ALLOC;
+  run_parallel(files->count, jobs, export_one, &batch);
+
+  // Track -> image mapping, tab separated
+  size_t stored = 0, duplicates = 0, failed = 0;
+  double stored_bytes = 0, saved_bytes = 0;
+  for (size_t i = 0; i < files->count; i++) {
+    const ArtResult *r = &batch.results[i];
+    switch (r->outcome) {
+    case ART_NONE:
+      printf("%s\t-\n", files->paths[i]);
+      break;
+    case ART_FAILED:
+      printf("%s\terror\n", files->paths[i]);
+      failed++;
+      break;
+    case ART_STORED:
+      stored++;
+      stored_bytes += r->size;
+      printf("%s\t%s\n", files->paths[i], r->path);
+      break;
+    case ART_DUPLICATE:
+      duplicates++;
+      saved_bytes += r->size;
+      printf("%s\t%s\n", files->paths[i], r->path);
+      break;
+    }
+  }
+  printf("------------------------------------------------------------\n");
+  printf("Tracks: %zu  New images: %zu (%.2f MB)  Already stored: %zu "
+         "(%.2f MB deduplicated)  Errors: %zu%s\n",
+         files->count, stored, stored_bytes / (1024 * 1024), duplicates,
+         saved_bytes / (1024 * 1024), failed,
+         strip ? "  Embedded art replaced by links" : "");
+  free(batch.results);
+  return failed ? ERROR_WRITE_FAILED : SUCCESS;
+}
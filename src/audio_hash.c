@@ -0,0 +1,198 @@
+#include "../inc/audio_hash.h"
+#include "../inc/hash.h"
+#include "../inc/id3_reader.h"
+#include "../inc/io_budget.h"
+#include "../inc/trace.h"
+#include "../inc/worker_pool.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#define HASH_WINDOW (4 * 1024 * 1024) // Bytes mapped at a time
+#define HASH_READ_BUF (1024 * 1024)  // Fallback read() buffer
+
+static Status hash_with_read(int fd, off_t offset, off_t end,
+                             Xxh64State *state) {
+  unsigned char *buf = (unsigned char *)malloc(HASH_READ_BUF);
+  if (!buf)
+    return ERROR_MEM_ALLOC;
+  while (offset < end) {
+    size_t chunk = (size_t)(end - offset);
+    if (chunk > HASH_READ_BUF)
+      chunk = HASH_READ_BUF;
+    chunk = io_read_chunk(chunk);
+    ssize_t n = pread(fd, buf, chunk, offset);
+    if (n <= 0) {
+      free(buf);
+      return ERROR_INVALID_FORMAT;
+    }
+    io_charge_read((uint64_t)n);
+    xxh64_update(state, buf, (size_t)n);
+    offset += n;
+  }
+  free(buf);
+  return SUCCESS;
+}
+
+Status hash_file_range(int fd, off_t offset, off_t len, uint64_t *hash) {
+  Xxh64State state;
+  xxh64_init(&state, 0);
+  off_t end = offset + len;
+
+#ifndef _WIN32
+  // One bounded window is mapped at a time, so memory use does not grow with
+  // the file, and the next window is requested while this one is hashed.
+  // Under a read limit windows shrink to what the budget allows per step and
+  // nothing is read ahead, so the disk never sees a burst.
+  long page = sysconf(_SC_PAGESIZE);
+  int limited = io_read_limited();
+  while (offset < end) {
+    off_t map_start = offset - offset % page;
+    size_t map_len = (size_t)(end - map_start);
+    if (map_len > HASH_WINDOW)
+      map_len = HASH_WINDOW;
+    map_len = io_read_chunk(map_len);
+    unsigned char *map = (unsigned char *)mmap(NULL, map_len, PROT_READ,
+                                               MAP_PRIVATE, fd, map_start);
+    if (map == MAP_FAILED)
+      break; // Finish with read() from here
+    off_t next = map_start + (off_t)map_len;
+    if (next < end && !limited)
+      posix_fadvise(fd, next, end - next > HASH_WINDOW ? HASH_WINDOW : end - next,
+                    POSIX_FADV_WILLNEED);
+    xxh64_update(&state, map + (offset - map_start),
+                 map_len - (size_t)(offset - map_start));
+    io_charge_read(map_len - (size_t)(offset - map_start));
+    munmap(map, map_len);
+    offset = next;
+  }
+#endif
+
+  Status status = hash_with_read(fd, offset, end, &state);
+  if (status == SUCCESS)
+    *hash = xxh64_digest(&state);
+  return status;
+}
+
+Status hash_audio_payload(const char *filepath, AudioHash *result) {
+  if (!filepath || !result)
+    return ERROR_INVALID_FORMAT;
+  int fd = open(filepath, O_RDONLY);
+  if (fd < 0)
+    return ERROR_FILE_OPEN;
+  TRACE_MARK("open", filepath, fd);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return ERROR_FILE_OPEN;
+  }
+
+  off_t start, end;
+  locate_audio_range(fd, st.st_size, &start, &end);
+  result->audio_offset = start;
+  result->audio_size = end - start;
+  posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+  Status status =
+      hash_file_range(fd, result->audio_offset, result->audio_size,
+                      &result->hash);
+  close(fd);
+  return status;
+}
+
+typedef struct {
+  const FileList *files;
+  AudioHash *results;
+  Status *statuses;
+} HashBatch;
+
+static void hash_one(size_t i, void *ctx) {
+  HashBatch *batch = (HashBatch *)ctx;
+  batch->statuses[i] =
+      hash_audio_payload(batch->files->paths[i], &batch->results[i]);
+}
+
+static const AudioHash *sort_results; // qsort has no context argument
+
+static int compare_by_hash(const void *a, const void *b) {
+  const AudioHash *x = &sort_results[*(const size_t *)a];
+  const AudioHash *y = &sort_results[*(const size_t *)b];
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  if (x->audio_size != y->audio_size)
+    return x->audio_size < y->audio_size ? -1 : 1;
+  return *(const size_t *)a < *(const size_t *)b ? -1 : 1;
+}
+
+Status hash_audio_batch(const FileList *files, int jobs) {
+  if (!files || files->count == 0)
+    return ERROR_INVALID_FORMAT;
+
+  HashBatch batch;
+  memset(&batch, 0, sizeof(HashBatch));
+  batch.files = files;
+  batch.results = (AudioHash *)calloc(files->count, sizeof(AudioHash));
+  batch.statuses = (Status *)calloc(files->count, sizeof(Status));
+  size_t *order = (size_t *)malloc(files->count * sizeof(size_t));
+  if (!batch.results || !batch.statuses || !order) {
+    free(batch.results);
+    free(batch.statuses);
+    free(order);
+    return ERROR_MEM_ALLOC;
+  }
+
+  // Several files in flight keep the device queue busy; the hash itself is
+  // far faster than the disk
+  run_parallel(files->count, jobs, hash_one, &batch);
+
+  // Per-file lines in input order
+  size_t hashed = 0;
+  double audio_bytes = 0;
+  for (size_t i = 0; i < files->count; i++) {
+    if (batch.statuses[i] != SUCCESS) {
+      printf("%-16s  %12s  %s\n", "error", "-", files->paths[i]);
+      continue;
+    }
+    printf("%016llx  %12lld  %s\n", (unsigned long long)batch.results[i].hash,
+           (long long)batch.results[i].audio_size, files->paths[i]);
+    order[hashed++] = i;
+    audio_bytes += (double)batch.results[i].audio_size;
+  }
+
+  // Group identical payloads
+  sort_results = batch.results;
+  qsort(order, hashed, sizeof(size_t), compare_by_hash);
+  size_t groups = 0, redundant = 0;
+  printf("------------------------------------------------------------\n");
+  for (size_t g = 0; g < hashed;) {
+    size_t end = g + 1;
+    while (end < hashed &&
+           batch.results[order[end]].hash == batch.results[order[g]].hash &&
+           batch.results[order[end]].audio_size ==
+               batch.results[order[g]].audio_size)
+      end++;
+    if (end - g > 1) {
+      printf("Duplicate audio %016llx (%zu files, %lld bytes each):\n",
+             (unsigned long long)batch.results[order[g]].hash, end - g,
+             (long long)batch.results[order[g]].audio_size);
+      for (size_t k = g; k < end; k++)
+        printf("  %s\n", files->paths[order[k]]);
+      groups++;
+      redundant += end - g - 1;
+    }
+    g = end;
+  }
+  printf("Files: %zu  Hashed: %zu  Audio: %.2f MB  Duplicate groups: %zu "
+         "(%zu redundant files)\n",
+         files->count, hashed, audio_bytes / (1024 * 1024), groups, redundant);
+
+  free(batch.results);
+  free(batch.statuses);
+  free(order);
+  return hashed == files->count ? SUCCESS : ERROR_FILE_OPEN;
+}
@@ -0,0 +1,487 @@
+#include "../inc/catalog.h"
+#include "../inc/file_util.h"
+#include "../inc/hash.h"
+#include "../inc/string_pool.h"
+#include "../inc/track_table.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Header: magic[8] version shard shards strings (u32) records string_bytes
+// total_size total_duration_ms (u64) v2 v1 untagged reserved (u32)
+#define CATALOG_HEADER_SIZE 72
+// Record: path and text field codes (u32), tag (u8), bitrate, sample rate
+// (u16), duration in ms (u32), file size (u64)
+#define CATALOG_RECORD_SIZE (4 * (1 + FIELD_TEXT_COUNT) + 1 + 2 + 2 + 4 + 8)
+
+typedef struct {
+  uint32_t path; // String codes
+  uint32_t text[FIELD_TEXT_COUNT];
+  uint8_t tag;
+  uint16_t bitrate;
+  uint16_t sample_rate;
+  uint32_t duration_ms;
+  uint64_t size;
+  int part; // Partial the record came from (merging)
+} CatalogRecord;
+
+typedef struct {
+  StringPool strings;
+  CatalogRecord *records;
+  size_t count;
+  size_t capacity;
+} Catalog;
+
+static void put_le(uint64_t v, int bytes, unsigned char *p) {
+  for (int i = 0; i < bytes; i++)
+    p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes) {
+  uint64_t v = 0;
+  for (int i = bytes - 1; i >= 0; i--)
+    v = v << 8 | p[i];
+  return v;
+}
+
+static Status catalog_init(Catalog *c) {
+  memset(c, 0, sizeof(Catalog));
+  return string_pool_init(&c->strings);
+}
+
+static void catalog_free(Catalog *c) {
+  string_pool_free(&c->strings);
+  free(c->records);
+  memset(c, 0, sizeof(Catalog));
+}
+
+static CatalogRecord *catalog_push(Catalog *c) {
+  if (c->count == c->capacity) {
+    size_t cap = c->capacity ? c->capacity * 2 : 256;
+    CatalogRecord *grown =
+        (CatalogRecord *)realloc(c->records, cap * sizeof(CatalogRecord));
+    if (!grown)
+      return NULL;
+    c->records = grown;
+    c->capacity = cap;
+  }
+  CatalogRecord *r = &c->records[c->count++];
+  memset(r, 0, sizeof(CatalogRecord));
+  return r;
+}
+
+typedef struct {
+  const char *path;
+  size_t index;
+  int part;
+} PathOrder;
+
+static int compare_paths(const void *a, const void *b) {
+  const PathOrder *x = (const PathOrder *)a;
+  const PathOrder *y = (const PathOrder *)b;
+  int c = strcmp(x->path, y->path);
+  if (c != 0)
+    return c;
+  if (x->part != y->part)
+    return x->part < y->part ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Records of c in path order (then partial order)
+static PathOrder *sort_by_path(const Catalog *c) {
+  PathOrder *order = (PathOrder *)malloc((c->count + 1) * sizeof(PathOrder));
+  if (!order)
+    return NULL;
+  for (size_t i = 0; i < c->count; i++) {
+    order[i].path = string_pool_get(&c->strings, c->records[i].path);
+    order[i].index = i;
+    order[i].part = c->records[i].part;
+  }
+  qsort(order, c->count, sizeof(PathOrder), compare_paths);
+  return order;
+}
+
+// Write the records listed in order. Strings are re-interned in record order
+// so equal catalogs always serialize to equal bytes.
+static Status save_catalog(const Catalog *c, const PathOrder *order,
+                           size_t count, unsigned shard, unsigned shards,
+                           const char *out_path) {
+  StringPool pool;
+  if (string_pool_init(&pool) != SUCCESS)
+    return ERROR_MEM_ALLOC;
+  unsigned char *records =
+      (unsigned char *)malloc(count * CATALOG_RECORD_SIZE + 1);
+  if (!records) {
+    string_pool_free(&pool);
+    return ERROR_MEM_ALLOC;
+  }
+  uint64_t total_size = 0, total_ms = 0;
+  uint32_t tagged_v2 = 0, tagged_v1 = 0, untagged = 0;
+  Status status = SUCCESS;
+  for (size_t i = 0; i < count && status == SUCCESS; i++) {
+    const CatalogRecord *r = &c->records[order[i].index];
+    unsigned char *p = records + i * CATALOG_RECORD_SIZE;
+    uint32_t code;
+    status = string_pool_intern(
+        &pool, string_pool_get(&c->strings, r->path), &code);
+    put_le(code, 4, p);
+    for (int f = 0; f < FIELD_TEXT_COUNT && status == SUCCESS; f++) {
+      status = string_pool_intern(
+          &pool, string_pool_get(&c->strings, r->text[f]), &code);
+      put_le(code, 4, p + 4 + 4 * f);
+    }
+    p += 4 * (1 + FIELD_TEXT_COUNT);
+    p[0] = r->tag;
+    put_le(r->bitrate, 2, p + 1);
+    put_le(r->sample_rate, 2, p + 3);
+    put_le(r->duration_ms, 4, p + 5);
+    put_le(r->size, 8, p + 9);
+
+    total_size += r->size;
+    total_ms += r->duration_ms;
+    if (r->tag >= 2)
+      tagged_v2++;
+    else if (r->tag == 1)
+      tagged_v1++;
+    else
+      untagged++;
+  }
+
+  size_t string_bytes = 0;
+  for (uint32_t s = 0; s < pool.count; s++)
+    string_bytes += strlen(string_pool_get(&pool, s)) + 1;
+  size_t size = CATALOG_HEADER_SIZE + string_bytes +
+                count * CATALOG_RECORD_SIZE + 8;
+  unsigned char *buf = status == SUCCESS ? (unsigned char *)malloc(size) : NULL;
+  if (!buf) {
+    free(records);
+    string_pool_free(&pool);
+    return ERROR_MEM_ALLOC;
+  }
+
+  unsigned char *h = buf;
+  memcpy(h, CATALOG_MAGIC, 8);
+  put_le(CATALOG_VERSION, 4, h + 8);
+  put_le(shard, 4, h + 12);
+  put_le(shards, 4, h + 16);
+  put_le(pool.count, 4, h + 20);
+  put_le(count, 8, h + 24);
+  put_le(string_bytes, 8, h + 32);
+  put_le(total_size, 8, h + 40);
+  put_le(total_ms, 8, h + 48);
+  put_le(tagged_v2, 4, h + 56);
+  put_le(tagged_v1, 4, h + 60);
+  put_le(untagged, 4, h + 64);
+  put_le(0, 4, h + 68);
+  unsigned char *p = buf + CATALOG_HEADER_SIZE;
+  for (uint32_t s = 0; s < pool.count; s++) {
+    const char *str = string_pool_get(&pool, s);
+    size_t len = strlen(str) + 1;
+    memcpy(p, str, len);
+    p += len;
+  }
+  memcpy(p, records, count * CATALOG_RECORD_SIZE);
+  p += count * CATALOG_RECORD_SIZE;
+  put_le(xxh64(buf, size - 8, 0), 8, p);
+  free(records);
+
+  // Written beside the target under a private name ("<dir>/.<name>.XXXXXX",
+  // like SafeWrite) and renamed, so a reader never sees half of it and two
+  // writers never share a temporary file
+  char tmp_path[4096];
+  const char *slash = strrchr(out_path, '/');
+  int dir_len = slash ? (int)(slash - out_path + 1) : 0;
+  int fd = -1;
+  if (snprintf(tmp_path, sizeof(tmp_path), "%.*s.%s.XXXXXX", dir_len,
+               out_path, out_path + dir_len) < (int)sizeof(tmp_path))
+    fd = mkstemp(tmp_path);
+  if (fd >= 0) {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0644 & ~mask);
+  }
+  status = fd < 0 ? ERROR_FILE_OPEN : write_all(fd, buf, size);
+  if (fd >= 0 && close(fd) != 0 && status == SUCCESS)
+    status = ERROR_WRITE_FAILED;
+  if (status == SUCCESS && rename(tmp_path, out_path) != 0)
+    status = ERROR_WRITE_FAILED;
+  if (status != SUCCESS && fd >= 0)
+    unlink(tmp_path);
+  if (status == SUCCESS)
+    printf("Catalog '%s': shard %u/%u  Tracks: %zu  Strings: %u  "
+           "Size: %.1f KB\n",
+           out_path, shard, shards, count, pool.count, size / 1024.0);
+  free(buf);
+  string_pool_free(&pool);
+  return status;
+}
+
+Status write_catalog(const FileList *files, unsigned shard, unsigned shards,
+                     const char *out_path, int jobs) {
+  TrackTable table;
+  Status status = track_table_load(&table, files, jobs);
+  if (status != SUCCESS)
+    return status;
+  Catalog c;
+  status = catalog_init(&c);
+  for (size_t i = 0; i < table.rows && status == SUCCESS; i++) {
+    CatalogRecord *r = catalog_push(&c);
+    if (!r) {
+      status = ERROR_MEM_ALLOC;
+      break;
+    }
+    status = string_pool_intern(&c.strings, files->paths[i], &r->path);
+    for (int f = 0; f < FIELD_TEXT_COUNT && status == SUCCESS; f++)
+      status = string_pool_intern(
+          &c.strings, string_pool_get(&table.strings, table.text[f][i]),
+          &r->text[f]);
+    r->tag = table.tag[i];
+    r->bitrate = table.bitrate[i];
+    r->sample_rate = table.sample_rate[i];
+    r->duration_ms = (uint32_t)(table.duration[i] * 1000 + 0.5f);
+    r->size = (uint64_t)table.size[i];
+  }
+  track_table_free(&table);
+
+  PathOrder *order = status == SUCCESS ? sort_by_path(&c) : NULL;
+  if (order)
+    status = save_catalog(&c, order, c.count, shard, shards, out_path);
+  else if (status == SUCCESS)
+    status = ERROR_MEM_ALLOC;
+  if (status != SUCCESS)
+    printf("Error: Could not write catalog '%s'\n", out_path);
+  free(order);
+  catalog_free(&c);
+  return status;
+}
+
+// Add the records of one partial to c, tagged with part
+static Status load_catalog(const char *path, int part, Catalog *c,
+                           unsigned *shard, unsigned *shards) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    return ERROR_FILE_OPEN;
+  }
+  size_t size = (size_t)st.st_size;
+  unsigned char *buf = (unsigned char *)malloc(size + 1);
+  Status status = buf ? SUCCESS : ERROR_MEM_ALLOC;
+  for (size_t got = 0; status == SUCCESS && got < size;) {
+    ssize_t n = pread(fd, buf + got, size - got, (off_t)got);
+    if (n <= 0)
+      status = ERROR_INVALID_FORMAT;
+    got += n > 0 ? (size_t)n : 0;
+  }
+  close(fd);
+
+  const char **strings = NULL;
+  uint32_t string_count = 0;
+  uint64_t count = 0;
+  if (status == SUCCESS &&
+      (size < CATALOG_HEADER_SIZE + 8 || memcmp(buf, CATALOG_MAGIC, 8) != 0 ||
+       get_le(buf + 8, 4) != CATALOG_VERSION ||
+       get_le(buf + size - 8, 8) != xxh64(buf, size - 8, 0)))
+    status = ERROR_INVALID_FORMAT;
+  if (status == SUCCESS) {
+    *shard = (unsigned)get_le(buf + 12, 4);
+    *shards = (unsigned)get_le(buf + 16, 4);
+    string_count = (uint32_t)get_le(buf + 20, 4);
+    count = get_le(buf + 24, 8);
+    uint64_t string_bytes = get_le(buf + 32, 8);
+    if (string_count == 0 || string_bytes > size ||
+        count > size / CATALOG_RECORD_SIZE ||
+        CATALOG_HEADER_SIZE + string_bytes + count * CATALOG_RECORD_SIZE + 8 !=
+            size)
+      status = ERROR_INVALID_FORMAT;
+    else if (!(strings = (const char **)malloc(string_count *
+                                                sizeof(const char *))))
+      status = ERROR_MEM_ALLOC;
+  }
+
+  // The string section is string_count NUL-terminated strings back to back
+  const unsigned char *p = buf + CATALOG_HEADER_SIZE;
+  const unsigned char *records = NULL;
+  if (status == SUCCESS) {
+    records = buf + size - 8 - count * CATALOG_RECORD_SIZE;
+    for (uint32_t s = 0; s < string_count && status == SUCCESS; s++) {
+      const unsigned char *nul = memchr(p, 0, (size_t)(records - p));
+      if (!nul)
+        status = ERROR_INVALID_FORMAT;
+      strings[s] = (const char *)p;
+      p = nul + 1;
+    }
+  }
+
+  for (uint64_t i = 0; i < count && status == SUCCESS; i++) {
+    const unsigned char *q = records + i * CATALOG_RECORD_SIZE;
+    CatalogRecord *r = catalog_push(c);
+    if (!r) {
+      status = ERROR_MEM_ALLOC;
+      break;
+    }
+    r->part = part;
+    for (int f = -1; f < FIELD_TEXT_COUNT && status == SUCCESS; f++) {
+      uint32_t code = (uint32_t)get_le(q + 4 + 4 * f, 4);
+      if (code >= string_count)
+        status = ERROR_INVALID_FORMAT;
+      else
+        status = string_pool_intern(&c->strings, strings[code],
+                                    f < 0 ? &r->path : &r->text[f]);
+    }
+    q += 4 * (1 + FIELD_TEXT_COUNT);
+    r->tag = q[0];
+    r->bitrate = (uint16_t)get_le(q + 1, 2);
+    r->sample_rate = (uint16_t)get_le(q + 3, 2);
+    r->duration_ms = (uint32_t)get_le(q + 5, 4);
+    r->size = get_le(q + 9, 8);
+  }
+  free(strings);
+  free(buf);
+  return status;
+}
+
+// Names of the fields in which two records differ, comma separated
+static void describe_conflict(const CatalogRecord *a, const CatalogRecord *b,
+                              char *buf, size_t size) {
+  buf[0] = '\0';
+  size_t used = 0;
+  for (int f = 0; f < FIELD_COUNT; f++) {
+    int differs;
+    switch (f) {
+    case FIELD_TAG:
+      differs = a->tag != b->tag;
+      break;
+    case FIELD_BITRATE:
+      differs = a->bitrate != b->bitrate;
+      break;
+    case FIELD_SAMPLE_RATE:
+      differs = a->sample_rate != b->sample_rate;
+      break;
+    case FIELD_DURATION:
+      differs = a->duration_ms != b->duration_ms;
+      break;
+    case FIELD_SIZE:
+      differs = a->size != b->size;
+      break;
+    default:
+      differs = a->text[f] != b->text[f];
+    }
+    if (differs && used < size)
+      used += snprintf(buf + used, size - used, "%s%s", used ? "," : "",
+                       track_field_name(f));
+  }
+}
+
+Status merge_catalogs(char **parts, int count, const char *out_path) {
+  Catalog c;
+  if (catalog_init(&c) != SUCCESS)
+    return ERROR_MEM_ALLOC;
+  unsigned shards = 0;
+  unsigned char *seen = NULL;
+  Status status = SUCCESS;
+  for (int i = 0; i < count && status == SUCCESS; i++) {
+    unsigned shard, of;
+    status = load_catalog(parts[i], i, &c, &shard, &of);
+    if (status != SUCCESS) {
+      printf("Error: '%s' is not a readable catalog\n", parts[i]);
+      break;
+    }
+    if (!seen) {
+      shards = of;
+      seen = (unsigned char *)calloc(shards + 1, 1);
+      if (!seen)
+        status = ERROR_MEM_ALLOC;
+    }
+    if (of != shards || shard < 1 || shard > of)
+      printf("Warning: '%s' is shard %u/%u, the first partial is of %u\n",
+             parts[i], shard, of, shards);
+    else if (seen[shard]++)
+      printf("Warning: shard %u/%u given more than once ('%s')\n", shard, of,
+             parts[i]);
+  }
+
+  PathOrder *order = status == SUCCESS ? sort_by_path(&c) : NULL;
+  if (status == SUCCESS && !order)
+    status = ERROR_MEM_ALLOC;
+  size_t kept = 0, duplicates = 0, conflicts = 0;
+  for (size_t i = 0; status == SUCCESS && i < c.count; i++) {
+    if (kept > 0 && strcmp(order[kept - 1].path, order[i].path) == 0) {
+      const CatalogRecord *a = &c.records[order[kept - 1].index];
+      const CatalogRecord *b = &c.records[order[i].index];
+      char fields[128];
+      describe_conflict(a, b, fields, sizeof(fields));
+      if (fields[0]) {
+        conflicts++;
+        printf("CONFLICT\t%s\t%s\t%s\t%s\n", order[i].path, parts[a->part],
+               parts[b->part], fields);
+      } else {
+        duplicates++;
+      }
+      continue;
+    }
+    order[kept++] = order[i];
+  }
+
+  if (status == SUCCESS) {
+    status = save_catalog(&c, order, kept, 1, 1, out_path);
+    int missing = 0;
+    for (unsigned s = 1; s <= shards; s++) {
+      if (!seen[s])
+        printf("%s%u", missing++ ? ", " : "Missing shards: ", s);
+    }
+    if (missing)
+      printf(" (of %u)\n", shards);
+    printf("Partials: %d  Tracks: %zu  Duplicates: %zu  Conflicts: %zu\n",
+           count, kept, duplicates, conflicts);
+  }
+  free(order);
+  free(seen);
+  catalog_free(&c);
+  return status != SUCCESS ? status
+                           : conflicts ? ERROR_CONFLICT : SUCCESS;
+}
+
+Status load_catalog_tracks(const char *path, FileList *files,
+                           TrackTable *table) {
+  memset(table, 0, sizeof(TrackTable));
+  file_list_init(files);
+  Catalog c;
+  if (catalog_init(&c) != SUCCESS)
+    return ERROR_MEM_ALLOC;
+  unsigned shard, shards;
+  Status status = load_catalog(path, 0, &c, &shard, &shards);
+  for (size_t i = 0; i < c.count && status == SUCCESS; i++)
+    status = file_list_push(files,
+                            string_pool_get(&c.strings, c.records[i].path));
+  if (status == SUCCESS)
+    status = track_table_init(table, files);
+  if (status != SUCCESS) {
+    catalog_free(&c);
+    file_list_free(files);
+    return status;
+  }
+
+  for (size_t i = 0; i < c.count && status == SUCCESS; i++) {
+    const CatalogRecord *r = &c.records[i];
+    for (int f = 0; f < FIELD_TEXT_COUNT && status == SUCCESS; f++)
+      status = string_pool_intern(&table->strings,
+                                  string_pool_get(&c.strings, r->text[f]),
+                                  &table->text[f][i]);
+    table->tag[i] = r->tag;
+    table->bitrate[i] = r->bitrate;
+    table->sample_rate[i] = r->sample_rate;
+    table->duration[i] = r->duration_ms / 1000.0f;
+    table->size[i] = (int64_t)r->size;
+  }
+  catalog_free(&c);
+  if (status != SUCCESS) {
+    track_table_free(table);
+    file_list_free(files);
+  }
+  return status;
+}
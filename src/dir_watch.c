@@ -0,0 +1,367 @@
+#include "../inc/dir_watch.h"
+#include "../inc/file_list.h"
+#include "../inc/hash.h"
+#include "../inc/track_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WATCH_EVENTS                                                           \
+  (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE |     \
+   IN_MOVE_SELF | IN_ONLYDIR)
+#define WATCH_EVENT_BUF (64 * 1024)
+#define MAP_INITIAL_BUCKETS 1024
+
+// Chained hash map from a 64-bit key to a path. Used both for watch
+// descriptors (key = wd) and for the changed files waiting to settle
+// (key = hash of the path).
+typedef struct MapNode {
+  uint64_t key;
+  char *path;
+  long long when; // Last event, in ms (pending files only)
+  struct MapNode *next;
+} MapNode;
+
+typedef struct {
+  MapNode **buckets;
+  size_t bucket_count;
+  size_t count;
+} PathMap;
+
+static int map_init(PathMap *map) {
+  map->buckets = (MapNode **)calloc(MAP_INITIAL_BUCKETS, sizeof(MapNode *));
+  map->bucket_count = MAP_INITIAL_BUCKETS;
+  map->count = 0;
+  return map->buckets != NULL;
+}
+
+static MapNode **map_slot(const PathMap *map, uint64_t key, const char *path) {
+  MapNode **slot = &map->buckets[key & (map->bucket_count - 1)];
+  while (*slot &&
+         ((*slot)->key != key || (path && strcmp((*slot)->path, path) != 0)))
+    slot = &(*slot)->next;
+  return slot;
+}
+
+static void map_grow(PathMap *map) {
+  size_t count = map->bucket_count * 2;
+  MapNode **buckets = (MapNode **)calloc(count, sizeof(MapNode *));
+  if (!buckets)
+    return; // Keep the longer chains
+  for (size_t b = 0; b < map->bucket_count; b++) {
+    MapNode *node = map->buckets[b];
+    while (node) {
+      MapNode *next = node->next;
+      node->next = buckets[node->key & (count - 1)];
+      buckets[node->key & (count - 1)] = node;
+      node = next;
+    }
+  }
+  free(map->buckets);
+  map->buckets = buckets;
+  map->bucket_count = count;
+}
+
+// Insert or replace the path stored under key; returns the node
+static MapNode *map_put(PathMap *map, uint64_t key, const char *path,
+                        int match_path) {
+  MapNode **slot = map_slot(map, key, match_path ? path : NULL);
+  if (*slot) {
+    if (!match_path) {
+      char *copy = strdup(path);
+      if (!copy)
+        return NULL;
+      free((*slot)->path);
+      (*slot)->path = copy;
+    }
+    return *slot;
+  }
+  MapNode *node = (MapNode *)malloc(sizeof(MapNode));
+  if (!node || !(node->path = strdup(path))) {
+    free(node);
+    return NULL;
+  }
+  node->key = key;
+  node->when = 0;
+  node->next = NULL;
+  *slot = node;
+  if (++map->count > map->bucket_count * 2)
+    map_grow(map);
+  return node;
+}
+
+static void map_remove(PathMap *map, MapNode **slot) {
+  MapNode *node = *slot;
+  *slot = node->next;
+  free(node->path);
+  free(node);
+  map->count--;
+}
+
+static void map_free(PathMap *map) {
+  for (size_t b = 0; b < map->bucket_count; b++) {
+    while (map->buckets[b])
+      map_remove(map, &map->buckets[b]);
+  }
+  free(map->buckets);
+}
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+typedef struct {
+  int fd;
+  const char *root;
+  PathMap watches; // wd -> directory
+  PathMap pending; // Changed files not yet re-read
+  int debounce_ms;
+  int jobs;
+  int watch_limit_hit;
+} Watcher;
+
+static void mark_pending(Watcher *w, const char *path) {
+  uint64_t key = xxh64(path, strlen(path), 0);
+  MapNode *node = map_put(&w->pending, key, path, 1);
+  if (node)
+    node->when = now_ms();
+}
+
+// Watch dir and everything below it. With report set (a directory that
+// appeared while watching), the files already inside are queued as changed.
+static void watch_tree(Watcher *w, const char *dir, int report) {
+  if (w->watch_limit_hit)
+    return;
+  int wd = inotify_add_watch(w->fd, dir, WATCH_EVENTS);
+  if (wd < 0) {
+    if (errno == ENOSPC) {
+      // Out of watches (fs.inotify.max_user_watches): keep what we have
+      w->watch_limit_hit = 1;
+      fprintf(stderr, "Warning: inotify watch limit reached after %zu "
+                      "directories; raise fs.inotify.max_user_watches\n",
+              w->watches.count);
+    }
+    return;
+  }
+  map_put(&w->watches, (uint64_t)wd, dir, 0);
+
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    size_t len = strlen(dir) + 1 + strlen(entry->d_name) + 1;
+    char *child = (char *)malloc(len);
+    if (!child)
+      break;
+    snprintf(child, len, "%s/%s", dir, entry->d_name);
+    struct stat st;
+    if (lstat(child, &st) == 0) {
+      if (S_ISDIR(st.st_mode))
+        watch_tree(w, child, report);
+      else if (report && S_ISREG(st.st_mode) &&
+               file_list_is_mp3(entry->d_name))
+        mark_pending(w, child);
+    }
+    free(child);
+  }
+  closedir(d);
+}
+
+// Stop watching dir and every directory below it: it left the tree, or is
+// about to be watched again under its new name
+static void unwatch_tree(Watcher *w, const char *dir) {
+  size_t len = strlen(dir);
+  for (size_t b = 0; b < w->watches.bucket_count; b++) {
+    MapNode **slot = &w->watches.buckets[b];
+    while (*slot) {
+      const char *path = (*slot)->path;
+      if (strncmp(path, dir, len) == 0 &&
+          (path[len] == '\0' || path[len] == '/')) {
+        inotify_rm_watch(w->fd, (int)(*slot)->key);
+        map_remove(&w->watches, slot);
+      } else {
+        slot = &(*slot)->next;
+      }
+    }
+  }
+}
+
+static void handle_event(Watcher *w, const struct inotify_event *ev) {
+  if (ev->mask & IN_Q_OVERFLOW) {
+    // Events were dropped: walk the tree again and re-read every file
+    printf("OVERFLOW\t%s\n", w->root);
+    fflush(stdout);
+    watch_tree(w, w->root, 1);
+    return;
+  }
+  MapNode **slot = map_slot(&w->watches, (uint64_t)ev->wd, NULL);
+  if (!*slot)
+    return;
+  if (ev->mask & IN_IGNORED) {
+    // Directory removed (or unwatched): release its entry
+    map_remove(&w->watches, slot);
+    return;
+  }
+  if (ev->mask & IN_MOVE_SELF) {
+    // Only the root gets here still watched; a directory below it was
+    // released by its parent's IN_MOVED_FROM
+    char *dir = strdup((*slot)->path);
+    if (dir)
+      unwatch_tree(w, dir);
+    free(dir);
+    return;
+  }
+  if (ev->len == 0)
+    return;
+
+  const char *dir = (*slot)->path;
+  size_t len = strlen(dir) + 1 + strlen(ev->name) + 1;
+  char *path = (char *)malloc(len);
+  if (!path)
+    return;
+  snprintf(path, len, "%s/%s", dir, ev->name);
+  if (ev->mask & IN_ISDIR) {
+    if (ev->mask & IN_MOVED_FROM)
+      unwatch_tree(w, path); // Watched again if it lands inside the tree
+    else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+      watch_tree(w, path, 1);
+  } else if (file_list_is_mp3(ev->name) &&
+             (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                          IN_DELETE))) {
+    mark_pending(w, path);
+  }
+  free(path);
+}
+
+// Re-read the files that have been quiet for the debounce period, as one
+// parallel batch, and report them
+static void flush_settled(Watcher *w, long long now) {
+  FileList changed;
+  file_list_init(&changed);
+  for (size_t b = 0; b < w->pending.bucket_count; b++) {
+    MapNode **slot = &w->pending.buckets[b];
+    while (*slot) {
+      if (now - (*slot)->when < w->debounce_ms) {
+        slot = &(*slot)->next;
+        continue;
+      }
+      if (file_list_add_path(&changed, (*slot)->path) != SUCCESS)
+        printf("DELETED\t%s\n", (*slot)->path);
+      map_remove(&w->pending, slot);
+    }
+  }
+
+  TrackTable table;
+  if (changed.count > 0 &&
+      track_table_load(&table, &changed, w->jobs) == SUCCESS) {
+    const StringPool *pool = &table.strings;
+    for (size_t r = 0; r < table.rows; r++) {
+      printf("CHANGED\t%s\t%s\t%s\t%s\t%s\t%u\t%.0f\n", changed.paths[r],
+             string_pool_get(pool, table.text[FIELD_ARTIST][r]),
+             string_pool_get(pool, table.text[FIELD_ALBUM][r]),
+             string_pool_get(pool, table.text[FIELD_TITLE][r]),
+             string_pool_get(pool, table.text[FIELD_YEAR][r]),
+             table.bitrate[r], table.duration[r]);
+    }
+    track_table_free(&table);
+  }
+  file_list_free(&changed);
+  fflush(stdout);
+}
+
+// Milliseconds until the oldest pending file settles, or -1 if none
+static int next_timeout(const Watcher *w, long long now) {
+  long long wait = -1;
+  for (size_t b = 0; b < w->pending.bucket_count; b++) {
+    for (MapNode *n = w->pending.buckets[b]; n; n = n->next) {
+      long long left = n->when + w->debounce_ms - now;
+      if (left < 0)
+        left = 0;
+      if (wait < 0 || left < wait)
+        wait = left;
+    }
+  }
+  return (int)wait;
+}
+
+Status watch_directory(const char *root, int debounce_ms, int jobs) {
+  Watcher w;
+  memset(&w, 0, sizeof(Watcher));
+  w.root = root;
+  w.debounce_ms = debounce_ms;
+  w.jobs = jobs;
+  w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (w.fd < 0)
+    return ERROR_FILE_OPEN;
+  if (!map_init(&w.watches) || !map_init(&w.pending)) {
+    close(w.fd);
+    return ERROR_MEM_ALLOC;
+  }
+  watch_tree(&w, root, 0);
+  if (w.watches.count == 0) {
+    close(w.fd);
+    map_free(&w.watches);
+    map_free(&w.pending);
+    return ERROR_FILE_OPEN;
+  }
+  fprintf(stderr, "Watching %zu directories under %s\n", w.watches.count,
+          root);
+
+  char *buf = (char *)malloc(WATCH_EVENT_BUF);
+  if (!buf) {
+    close(w.fd);
+    map_free(&w.watches);
+    map_free(&w.pending);
+    return ERROR_MEM_ALLOC;
+  }
+  for (;;) {
+    struct pollfd pfd = {w.fd, POLLIN, 0};
+    int timeout = next_timeout(&w, now_ms());
+    if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+      break;
+    ssize_t n;
+    while ((n = read(w.fd, buf, WATCH_EVENT_BUF)) > 0) {
+      for (char *p = buf; p < buf + n;) {
+        const struct inotify_event *ev = (const struct inotify_event *)p;
+        handle_event(&w, ev);
+        p += sizeof(struct inotify_event) + ev->len;
+      }
+    }
+    if (w.pending.count > 0)
+      flush_settled(&w, now_ms());
+    if (w.watches.count == 0)
+      break; // The root itself was removed or moved away
+  }
+
+  free(buf);
+  close(w.fd);
+  map_free(&w.watches);
+  map_free(&w.pending);
+  return ERROR_FILE_OPEN;
+}
+
+#else
+
+Status watch_directory(const char *root, int debounce_ms, int jobs) {
+  (void)root;
+  (void)debounce_ms;
+  (void)jobs;
+  printf("Error: --watch needs inotify (Linux).\n");
+  return ERROR_FILE_OPEN;
+}
+
+#endif
@@ -0,0 +1,140 @@
+#include "../inc/disk_order.h"
+#include "../inc/worker_pool.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+typedef struct {
+  char *path;
+  dev_t dev;
+  uint64_t head; // Physical byte address of the first and last data block,
+  uint64_t tail; // or the inode number in both when unmapped
+  int mapped;
+} DiskPlace;
+
+#ifdef __linux__
+// Physical address of the byte at offset, via FIEMAP or (privileged) FIBMAP
+static int physical_address(int fd, off_t offset, uint64_t *addr) {
+  struct {
+    struct fiemap map;
+    struct fiemap_extent extent;
+  } q;
+  memset(&q, 0, sizeof(q));
+  q.map.fm_start = (uint64_t)offset;
+  q.map.fm_length = 1;
+  q.map.fm_extent_count = 1;
+  if (ioctl(fd, FS_IOC_FIEMAP, &q.map) == 0) {
+    if (q.map.fm_mapped_extents == 0 ||
+        (q.extent.fe_flags &
+         (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)))
+      return 0;
+    *addr = q.extent.fe_physical + ((uint64_t)offset - q.extent.fe_logical);
+    return 1;
+  }
+  int block_size;
+  if (ioctl(fd, FIGETBSZ, &block_size) != 0 || block_size <= 0)
+    return 0;
+  int block = (int)(offset / block_size);
+  if (ioctl(fd, FIBMAP, &block) != 0 || block == 0)
+    return 0;
+  *addr = (uint64_t)block * (uint64_t)block_size + offset % block_size;
+  return 1;
+}
+#endif
+
+static void place_one(size_t i, void *ctx) {
+  DiskPlace *p = &((DiskPlace *)ctx)[i];
+  int fd = open(p->path, O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    p->dev = st.st_dev;
+    p->head = p->tail = (uint64_t)st.st_ino;
+#ifdef __linux__
+    uint64_t head, tail;
+    if (st.st_size > 0 && physical_address(fd, 0, &head) &&
+        physical_address(fd, st.st_size - 1, &tail)) {
+      p->head = head;
+      p->tail = tail;
+      p->mapped = 1;
+    }
+#endif
+  }
+  close(fd);
+}
+
+static int compare_places(const void *a, const void *b) {
+  const DiskPlace *x = (const DiskPlace *)a;
+  const DiskPlace *y = (const DiskPlace *)b;
+  if (x->dev != y->dev)
+    return x->dev < y->dev ? -1 : 1;
+  if (x->mapped != y->mapped)
+    return x->mapped ? -1 : 1;
+  if (x->head != y->head)
+    return x->head < y->head ? -1 : 1;
+  return 0;
+}
+
+// Seeks and head travel of reading each file's head, then its tail
+static void measure(const DiskPlace *places, size_t n, uint64_t *seeks,
+                    double *travel) {
+  *seeks = 0;
+  *travel = 0;
+  const DiskPlace *prev = NULL;
+  uint64_t pos = 0;
+  for (size_t i = 0; i < n; i++) {
+    const DiskPlace *p = &places[i];
+    if (!p->mapped) {
+      (*seeks)++; // Unknown position: assume the worst
+      prev = NULL;
+      continue;
+    }
+    uint64_t stops[2] = {p->head, p->tail};
+    for (int s = 0; s < 2; s++) {
+      if (prev && prev->dev == p->dev) {
+        uint64_t d = stops[s] > pos ? stops[s] - pos : pos - stops[s];
+        *travel += (double)d;
+        if (d > DISK_ORDER_NEAR)
+          (*seeks)++;
+      } else {
+        (*seeks)++;
+      }
+      pos = stops[s];
+      prev = p;
+    }
+  }
+}
+
+Status order_by_disk_layout(FileList *files, int jobs, DiskOrderStats *stats) {
+  memset(stats, 0, sizeof(DiskOrderStats));
+  if (files->count < 2)
+    return SUCCESS;
+  DiskPlace *places = (DiskPlace *)calloc(files->count, sizeof(DiskPlace));
+  if (!places)
+    return ERROR_MEM_ALLOC;
+  for (size_t i = 0; i < files->count; i++)
+    places[i].path = files->paths[i];
+  run_parallel(files->count, jobs, place_one, places);
+
+  measure(places, files->count, &stats->seeks_before, &stats->travel_before);
+  qsort(places, files->count, sizeof(DiskPlace), compare_places);
+  measure(places, files->count, &stats->seeks_after, &stats->travel_after);
+
+  for (size_t i = 0; i < files->count; i++) {
+    files->paths[i] = places[i].path;
+    if (places[i].mapped)
+      stats->by_extent++;
+    else
+      stats->by_inode++;
+  }
+  free(places);
+  return SUCCESS;
+}
@@ -0,0 +1,93 @@
+#include "../inc/file_list.h"
+#include "../inc/hash.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+void file_list_init(FileList *list) { memset(list, 0, sizeof(FileList)); }
+
+void file_list_free(FileList *list) {
+  for (size_t i = 0; i < list->count; i++)
+    free(list->paths[i]);
+  free(list->paths);
+  memset(list, 0, sizeof(FileList));
+}
+
+void file_list_shard(FileList *list, unsigned index, unsigned count) {
+  size_t kept = 0;
+  for (size_t i = 0; i < list->count; i++) {
+    char *path = list->paths[i];
+    if (xxh64(path, strlen(path), 0) % count == index - 1)
+      list->paths[kept++] = path;
+    else
+      free(path);
+  }
+  list->count = kept;
+}
+
+Status file_list_push(FileList *list, const char *path) {
+  if (list->count == list->capacity) {
+    size_t cap = list->capacity ? list->capacity * 2 : 64;
+    char **grown = (char **)realloc(list->paths, cap * sizeof(char *));
+    if (!grown)
+      return ERROR_MEM_ALLOC;
+    list->paths = grown;
+    list->capacity = cap;
+  }
+  char *copy = strdup(path);
+  if (!copy)
+    return ERROR_MEM_ALLOC;
+  list->paths[list->count++] = copy;
+  return SUCCESS;
+}
+
+int file_list_is_mp3(const char *name) {
+  size_t len = strlen(name);
+  if (len < 4)
+    return 0;
+  const char *ext = name + len - 4;
+  return ext[0] == '.' && (ext[1] == 'm' || ext[1] == 'M') &&
+         (ext[2] == 'p' || ext[2] == 'P') && ext[3] == '3';
+}
+
+static Status add_directory(FileList *list, const char *dirpath) {
+  DIR *dir = opendir(dirpath);
+  if (!dir)
+    return ERROR_FILE_OPEN;
+
+  Status status = SUCCESS;
+  struct dirent *entry;
+  while (status == SUCCESS && (entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    size_t len = strlen(dirpath) + 1 + strlen(entry->d_name) + 1;
+    char *child = (char *)malloc(len);
+    if (!child) {
+      status = ERROR_MEM_ALLOC;
+      break;
+    }
+    snprintf(child, len, "%s/%s", dirpath, entry->d_name);
+
+    struct stat st;
+    if (stat(child, &st) == 0) {
+      if (S_ISDIR(st.st_mode))
+        status = add_directory(list, child);
+      else if (S_ISREG(st.st_mode) && file_list_is_mp3(entry->d_name))
+        status = file_list_push(list, child);
+    }
+    free(child);
+  }
+  closedir(dir);
+  return status;
+}
+
+Status file_list_add_path(FileList *list, const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return ERROR_FILE_OPEN;
+  if (S_ISDIR(st.st_mode))
+    return add_directory(list, path);
+  return file_list_push(list, path);
+}
@@ -0,0 +1,238 @@
+#ifdef __linux__
+#define _GNU_SOURCE // copy_file_range
+#endif
+#include "../inc/file_util.h"
+#include "../inc/io_budget.h"
+#include "../inc/trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COPY_BUF_SIZE (1024 * 1024) // Each of the two pipeline buffers
+#define COPY_BUF_ALIGN 4096
+#define COPY_STEP (8 * 1024 * 1024) // Kernel copy per call (progress steps)
+
+static CopyProgressFn progress_fn;
+static void *progress_ctx;
+
+void set_copy_progress(CopyProgressFn fn, void *ctx) {
+  progress_fn = fn;
+  progress_ctx = ctx;
+}
+
+Status write_all(int fd, const void *buf, size_t len) {
+  const unsigned char *p = (const unsigned char *)buf;
+  while (len > 0) {
+    ssize_t w = write(fd, p, len);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return ERROR_WRITE_FAILED;
+    }
+    io_charge_write((uint64_t)w);
+    p += w;
+    len -= (size_t)w;
+  }
+  return SUCCESS;
+}
+
+// Bookkeeping shared by both copy paths
+typedef struct {
+  int in_fd;
+  off_t start;
+  off_t total;
+  off_t done;
+  off_t dropped; // Source bytes already advised away
+  int out_fd;
+  off_t out_start; // Position of out_fd when the copy began, or -1
+  off_t flushing;  // Destination bytes whose writeback has been started
+} CopyJob;
+
+// Once per COPY_STEP, and at the end, the pages a copy has passed leave the
+// page cache, so retagging a library does not evict everything else. Source
+// pages are clean and go at once. Destination pages are dirty: each step's
+// writeback is started, and the step before it is waited for and dropped,
+// so the last step is never waited on.
+static void copy_release(CopyJob *job) {
+  off_t step = job->done - job->dropped;
+  if (step < COPY_STEP && job->done < job->total)
+    return;
+  posix_fadvise(job->in_fd, job->start + job->dropped, step,
+                POSIX_FADV_DONTNEED);
+#ifdef __linux__
+  if (job->out_start >= 0) {
+    off_t out = job->out_start;
+    if (job->flushing > 0) {
+      sync_file_range(job->out_fd, out + job->dropped - job->flushing,
+                      job->flushing,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER);
+      posix_fadvise(job->out_fd, out + job->dropped - job->flushing,
+                    job->flushing, POSIX_FADV_DONTNEED);
+    }
+    sync_file_range(job->out_fd, out + job->dropped, step,
+                    SYNC_FILE_RANGE_WRITE);
+    job->flushing = step;
+  }
+#endif
+  job->dropped = job->done;
+}
+
+static void copy_advance(CopyJob *job, off_t n) {
+  job->done += n;
+  copy_release(job);
+  if (progress_fn)
+    progress_fn(job->done, job->total, progress_ctx);
+}
+
+// Two aligned buffers: a reader thread fills one while the caller writes the
+// other, so reading and writing overlap
+typedef struct {
+  CopyJob *job;
+  unsigned char *buf[2];
+  ssize_t filled[2]; // Bytes in the buffer, or -1 for a read error
+  int ready[2];      // Filled and not yet written
+  int stop;          // The writer failed
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} CopyPipe;
+
+static void *copy_reader(void *arg) {
+  CopyPipe *p = (CopyPipe *)arg;
+  // Picks up after whatever copy_file_range already copied
+  off_t offset = p->job->start + p->job->done;
+  off_t end = p->job->start + p->job->total;
+  for (int slot = 0; offset < end; slot ^= 1) {
+    pthread_mutex_lock(&p->lock);
+    while (p->ready[slot] && !p->stop)
+      pthread_cond_wait(&p->cond, &p->lock);
+    int stop = p->stop;
+    pthread_mutex_unlock(&p->lock);
+    if (stop)
+      break;
+
+    size_t chunk =
+        end - offset > COPY_BUF_SIZE ? COPY_BUF_SIZE : (size_t)(end - offset);
+    ssize_t n;
+    do
+      n = pread(p->job->in_fd, p->buf[slot], chunk, offset);
+    while (n < 0 && errno == EINTR);
+    if (n > 0)
+      io_charge_read((uint64_t)n);
+
+    pthread_mutex_lock(&p->lock);
+    p->filled[slot] = n > 0 ? n : -1;
+    p->ready[slot] = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    if (n <= 0)
+      break;
+    offset += n;
+  }
+  return NULL;
+}
+
+static Status copy_pipelined(CopyJob *job, unsigned char *buf, int out_fd) {
+  CopyPipe p;
+  memset(&p, 0, sizeof(CopyPipe));
+  p.job = job;
+  p.buf[0] = buf;
+  p.buf[1] = buf + COPY_BUF_SIZE;
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.cond, NULL);
+  pthread_t reader;
+  if (pthread_create(&reader, NULL, copy_reader, &p) != 0) {
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    return ERROR_MEM_ALLOC; // Caller copies without the thread
+  }
+
+  Status status = SUCCESS;
+  for (int slot = 0; job->done < job->total; slot ^= 1) {
+    pthread_mutex_lock(&p.lock);
+    while (!p.ready[slot])
+      pthread_cond_wait(&p.cond, &p.lock);
+    ssize_t n = p.filled[slot];
+    pthread_mutex_unlock(&p.lock);
+
+    status = n < 0 ? ERROR_INVALID_FORMAT
+                   : write_all(out_fd, p.buf[slot], (size_t)n);
+    pthread_mutex_lock(&p.lock);
+    p.ready[slot] = 0;
+    p.stop = status != SUCCESS;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+    if (status != SUCCESS)
+      break;
+    copy_advance(job, n);
+  }
+  pthread_join(reader, NULL);
+  pthread_cond_destroy(&p.cond);
+  pthread_mutex_destroy(&p.lock);
+  return status;
+}
+
+static Status copy_buffered(CopyJob *job, unsigned char *buf, int out_fd) {
+  while (job->done < job->total) {
+    off_t left = job->total - job->done;
+    size_t chunk = left > COPY_BUF_SIZE ? COPY_BUF_SIZE : (size_t)left;
+    ssize_t n = pread(job->in_fd, buf, chunk, job->start + job->done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return ERROR_INVALID_FORMAT;
+    io_charge_read((uint64_t)n);
+    Status status = write_all(out_fd, buf, (size_t)n);
+    if (status != SUCCESS)
+      return status;
+    copy_advance(job, n);
+  }
+  return SUCCESS;
+}
+
+static Status copy_bytes(int in_fd, off_t offset, off_t len, int out_fd) {
+  CopyJob job = {in_fd, offset, len, 0, 0, out_fd, lseek(out_fd, 0, SEEK_CUR),
+                 0};
+  posix_fadvise(in_fd, offset, len, POSIX_FADV_SEQUENTIAL);
+#ifdef __linux__
+  while (job.done < len) {
+    off_t pos = offset + job.done;
+    off_t left = len - job.done;
+    size_t step =
+        io_budget_chunk(left > COPY_STEP ? COPY_STEP : (size_t)left);
+    ssize_t n = copy_file_range(in_fd, &pos, out_fd, NULL, step, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break; // Unsupported here (e.g. pipe or cross-device); copy below
+    io_charge_read((uint64_t)n);
+    io_charge_write((uint64_t)n);
+    copy_advance(&job, n);
+  }
+#endif
+  if (job.done == len)
+    return SUCCESS;
+
+  // Anything that needs more than one buffer is pipelined
+  int pipelined = len - job.done > COPY_BUF_SIZE;
+  unsigned char *buf = NULL;
+  if (posix_memalign((void **)&buf, COPY_BUF_ALIGN,
+                     pipelined ? 2 * COPY_BUF_SIZE : COPY_BUF_SIZE) != 0)
+    return ERROR_MEM_ALLOC;
+  Status status = pipelined ? copy_pipelined(&job, buf, out_fd)
+                            : copy_buffered(&job, buf, out_fd);
+  if (status == ERROR_MEM_ALLOC && pipelined)
+    status = copy_buffered(&job, buf, out_fd); // No thread to be had
+  free(buf);
+  return status;
+}
+
+Status copy_file_bytes(int in_fd, off_t offset, off_t len, int out_fd) {
+  TRACE_BEGIN(start);
+  Status status = copy_bytes(in_fd, offset, len, out_fd);
+  TRACE_END(start, "copy", NULL, len);
+  return status;
+}
@@ -0,0 +1,723 @@
+#include "../inc/frame_scan.h"
+#include "../inc/id3_reader.h"
+#include "../inc/io_budget.h"
+#include "../inc/mpeg_reader.h"
+#include "../inc/play_time.h"
+#include "../inc/tail_tags.h"
+#include "../inc/trace.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SCAN_CHUNK_MIN (16 * 1024 * 1024) // Smaller files are one range
+#define RESYNC_CONFIRM 4 // Chained headers needed to trust a chunk start
+#define SCAN_WINDOW (1024 * 1024)          // Read window per scanning thread
+
+// CRC-16 used by MPEG audio: polynomial 0x8005, initial value 0xFFFF, MSB
+// first. At most 34 bytes are covered per frame, so one table lookup per byte
+// is the right granularity.
+static const uint16_t crc16_table[256] = {
+    0x0000, 0x8005, 0x800F, 0x000A, 0x801B, 0x001E, 0x0014, 0x8011,
+    0x8033, 0x0036, 0x003C, 0x8039, 0x0028, 0x802D, 0x8027, 0x0022,
+    0x8063, 0x0066, 0x006C, 0x8069, 0x0078, 0x807D, 0x8077, 0x0072,
+    0x0050, 0x8055, 0x805F, 0x005A, 0x804B, 0x004E, 0x0044, 0x8041,
+    0x80C3, 0x00C6, 0x00CC, 0x80C9, 0x00D8, 0x80DD, 0x80D7, 0x00D2,
+    0x00F0, 0x80F5, 0x80FF, 0x00FA, 0x80EB, 0x00EE, 0x00E4, 0x80E1,
+    0x00A0, 0x80A5, 0x80AF, 0x00AA, 0x80BB, 0x00BE, 0x00B4, 0x80B1,
+    0x8093, 0x0096, 0x009C, 0x8099, 0x0088, 0x808D, 0x8087, 0x0082,
+    0x8183, 0x0186, 0x018C, 0x8189, 0x0198, 0x819D, 0x8197, 0x0192,
+    0x01B0, 0x81B5, 0x81BF, 0x01BA, 0x81AB, 0x01AE, 0x01A4, 0x81A1,
+    0x01E0, 0x81E5, 0x81EF, 0x01EA, 0x81FB, 0x01FE, 0x01F4, 0x81F1,
+    0x81D3, 0x01D6, 0x01DC, 0x81D9, 0x01C8, 0x81CD, 0x81C7, 0x01C2,
+    0x0140, 0x8145, 0x814F, 0x014A, 0x815B, 0x015E, 0x0154, 0x8151,
+    0x8173, 0x0176, 0x017C, 0x8179, 0x0168, 0x816D, 0x8167, 0x0162,
+    0x8123, 0x0126, 0x012C, 0x8129, 0x0138, 0x813D, 0x8137, 0x0132,
+    0x0110, 0x8115, 0x811F, 0x011A, 0x810B, 0x010E, 0x0104, 0x8101,
+    0x8303, 0x0306, 0x030C, 0x8309, 0x0318, 0x831D, 0x8317, 0x0312,
+    0x0330, 0x8335, 0x833F, 0x033A, 0x832B, 0x032E, 0x0324, 0x8321,
+    0x0360, 0x8365, 0x836F, 0x036A, 0x837B, 0x037E, 0x0374, 0x8371,
+    0x8353, 0x0356, 0x035C, 0x8359, 0x0348, 0x834D, 0x8347, 0x0342,
+    0x03C0, 0x83C5, 0x83CF, 0x03CA, 0x83DB, 0x03DE, 0x03D4, 0x83D1,
+    0x83F3, 0x03F6, 0x03FC, 0x83F9, 0x03E8, 0x83ED, 0x83E7, 0x03E2,
+    0x83A3, 0x03A6, 0x03AC, 0x83A9, 0x03B8, 0x83BD, 0x83B7, 0x03B2,
+    0x0390, 0x8395, 0x839F, 0x039A, 0x838B, 0x038E, 0x0384, 0x8381,
+    0x0280, 0x8285, 0x828F, 0x028A, 0x829B, 0x029E, 0x0294, 0x8291,
+    0x82B3, 0x02B6, 0x02BC, 0x82B9, 0x02A8, 0x82AD, 0x82A7, 0x02A2,
+    0x82E3, 0x02E6, 0x02EC, 0x82E9, 0x02F8, 0x82FD, 0x82F7, 0x02F2,
+    0x02D0, 0x82D5, 0x82DF, 0x02DA, 0x82CB, 0x02CE, 0x02C4, 0x82C1,
+    0x8243, 0x0246, 0x024C, 0x8249, 0x0258, 0x825D, 0x8257, 0x0252,
+    0x0270, 0x8275, 0x827F, 0x027A, 0x826B, 0x026E, 0x0264, 0x8261,
+    0x0220, 0x8225, 0x822F, 0x022A, 0x823B, 0x023E, 0x0234, 0x8231,
+    0x8213, 0x0216, 0x021C, 0x8219, 0x0208, 0x820D, 0x8207, 0x0202,
+};
+
+static uint16_t crc16_update(uint16_t crc, const unsigned char *p,
+                             size_t len) {
+  while (len--)
+    crc = (uint16_t)((crc << 8) ^ crc16_table[((crc >> 8) ^ *p++) & 0xFF]);
+  return crc;
+}
+
+// Bytes after the CRC that the checksum covers, or 0 if unsupported (Layer II
+// needs the bit allocation tables to size its protected region)
+static int crc_protected_length(const MpegFrameHeader *hdr) {
+  int mono = hdr->channel_mode == 3;
+  if (hdr->layer == 3) {
+    if (hdr->version == 3)
+      return mono ? 17 : 32;
+    return mono ? 9 : 17;
+  }
+  if (hdr->layer == 1) {
+    if (mono)
+      return 16;
+    int bound = hdr->channel_mode == 1 ? 4 * (hdr->mode_ext + 1) : 32;
+    return 4 * (32 + bound) / 8; // 4 allocation bits per subband and channel
+  }
+  return 0;
+}
+
+// 1 if the CRC matches, 0 if not, -1 if it cannot be checked
+static int check_frame_crc(const unsigned char *frame,
+                           const MpegFrameHeader *hdr) {
+  int len = crc_protected_length(hdr);
+  if (len == 0 || 6 + len > hdr->frame_size)
+    return -1;
+  uint16_t crc = crc16_update(0xFFFF, frame + 2, 2);
+  crc = crc16_update(crc, frame + 6, (size_t)len);
+  return crc == (uint16_t)((frame[4] << 8) | frame[5]);
+}
+
+static int same_stream(const MpegFrameHeader *a, const MpegFrameHeader *b) {
+  return a->version == b->version && a->layer == b->layer &&
+         a->sample_rate == b->sample_rate;
+}
+
+// Bounded read window over a file: scans hold at most SCAN_WINDOW bytes per
+// thread however large the file is
+typedef struct {
+  int fd;
+  off_t base; // File offset of buf[0]
+  size_t len; // Valid bytes in buf
+  unsigned char *buf;
+} ScanWindow;
+
+static int window_open(ScanWindow *w, int fd) {
+  w->fd = fd;
+  w->base = 0;
+  w->len = 0;
+  w->buf = (unsigned char *)malloc(SCAN_WINDOW);
+  return w->buf != NULL;
+}
+
+static void window_close(ScanWindow *w) {
+  free(w->buf);
+  w->buf = NULL;
+}
+
+// Pointer to `need` bytes at pos, refilling the window from pos if they are
+// not resident; NULL if the file cannot supply them
+static const unsigned char *window_at(ScanWindow *w, off_t pos, size_t need) {
+  if (pos >= w->base && pos + (off_t)need <= w->base + (off_t)w->len)
+    return w->buf + (pos - w->base);
+  // Under a byte limit the window refills in steps the budget allows
+  ssize_t n = pread(w->fd, w->buf, io_read_chunk(SCAN_WINDOW), pos);
+  if (n < 0)
+    n = 0;
+  io_charge_read((uint64_t)n);
+  w->base = pos;
+  w->len = (size_t)n;
+  return (size_t)n >= need ? w->buf : NULL;
+}
+
+static int header_at(ScanWindow *w, off_t pos, off_t end,
+                     MpegFrameHeader *hdr) {
+  if (pos + 4 > end)
+    return 0;
+  const unsigned char *h = window_at(w, pos, 4);
+  return h && parse_frame_header(h, hdr);
+}
+
+// First offset >= pos where a header chain of `confirm` frames starts (a chain
+// that ends exactly at `end` also counts). Returns end when there is none.
+static off_t find_sync(ScanWindow *w, off_t pos, off_t end, int confirm) {
+  for (; pos + 4 <= end; pos++) {
+    const unsigned char *h = window_at(w, pos, 1);
+    if (!h)
+      break;
+    if (*h != 0xFF)
+      continue;
+    MpegFrameHeader first, hdr;
+    if (!header_at(w, pos, end, &first))
+      continue;
+    off_t next = pos + first.frame_size;
+    int chained = 1;
+    while (chained < confirm && header_at(w, next, end, &hdr) &&
+           same_stream(&first, &hdr)) {
+      next += hdr.frame_size;
+      chained++;
+    }
+    if (chained >= confirm || next == end) {
+      TRACE_MARK("sync", NULL, pos);
+      return pos;
+    }
+  }
+  return end;
+}
+
+// Walk frames that start in [pos, limit); frames may run on up to end
+static void walk_frames(ScanWindow *w, off_t pos, off_t limit, off_t end,
+                        FrameScanStats *st) {
+  memset(st, 0, sizeof(FrameScanStats));
+  st->start = pos;
+  while (pos < limit) {
+    MpegFrameHeader hdr;
+    if (header_at(w, pos, end, &hdr)) {
+      if (pos + hdr.frame_size > end) {
+        st->truncated = 1;
+        pos = end;
+        break;
+      }
+      if (hdr.protected) {
+        const unsigned char *frame =
+            window_at(w, pos, hdr.frame_size < 64 ? hdr.frame_size : 64);
+        int crc = frame ? check_frame_crc(frame, &hdr) : -1;
+        if (crc < 0) {
+          st->crc_unchecked++;
+        } else {
+          st->crc_checked++;
+          if (!crc)
+            st->crc_errors++;
+        }
+      }
+      if (st->frames == 0) {
+        st->first_mode = hdr.channel_mode;
+        st->first_rate = hdr.sample_rate;
+      } else {
+        st->mode_changes += hdr.channel_mode != st->last_mode;
+        st->rate_changes += hdr.sample_rate != st->last_rate;
+      }
+      st->last_mode = hdr.channel_mode;
+      st->last_rate = hdr.sample_rate;
+      st->bitrate_frames[hdr.bitrate / 8]++;
+      st->frames++;
+      st->frame_bytes += hdr.frame_size;
+      st->duration += (double)hdr.samples / hdr.sample_rate;
+      if (st->min_bitrate == 0 || hdr.bitrate < st->min_bitrate)
+        st->min_bitrate = hdr.bitrate;
+      if (hdr.bitrate > st->max_bitrate)
+        st->max_bitrate = hdr.bitrate;
+      pos += hdr.frame_size;
+      continue;
+    }
+    // Lost sync: skip to the next header confirmed by the one after it
+    off_t next = find_sync(w, pos + 1, end, 2);
+    st->sync_losses++;
+    st->garbage_bytes += (uint64_t)(next - pos);
+    pos = next;
+  }
+  st->end = pos;
+}
+
+static void add_stats(FrameScanStats *total, const FrameScanStats *part) {
+  if (part->frames) {
+    if (total->frames == 0) {
+      total->first_mode = part->first_mode;
+      total->first_rate = part->first_rate;
+    } else {
+      total->mode_changes += part->first_mode != total->last_mode;
+      total->rate_changes += part->first_rate != total->last_rate;
+    }
+    total->last_mode = part->last_mode;
+    total->last_rate = part->last_rate;
+  }
+  total->mode_changes += part->mode_changes;
+  total->rate_changes += part->rate_changes;
+  for (int i = 0; i < SCAN_BITRATE_SLOTS; i++)
+    total->bitrate_frames[i] += part->bitrate_frames[i];
+  total->frames += part->frames;
+  total->crc_checked += part->crc_checked;
+  total->crc_errors += part->crc_errors;
+  total->crc_unchecked += part->crc_unchecked;
+  total->garbage_bytes += part->garbage_bytes;
+  total->sync_losses += part->sync_losses;
+  total->truncated |= part->truncated;
+  total->frame_bytes += part->frame_bytes;
+  total->duration += part->duration;
+  if (part->min_bitrate &&
+      (total->min_bitrate == 0 || part->min_bitrate < total->min_bitrate))
+    total->min_bitrate = part->min_bitrate;
+  if (part->max_bitrate > total->max_bitrate)
+    total->max_bitrate = part->max_bitrate;
+  total->end = part->end;
+}
+
+typedef struct ScanFile {
+  const char *path;
+  FrameScanResult *result;
+  int chunk_count;
+  int next_chunk; // Next chunk to hand out
+  int pending;    // Chunks not finished yet
+  int fd;
+  int failed;
+  FrameScanStats *chunks;
+  struct ScanFile *next_split; // Link in the queue of split files
+} ScanFile;
+
+// Work queue: idle threads first help with chunks of files already split,
+// then open the next file
+typedef struct {
+  ScanFile *files;
+  size_t file_count;
+  size_t next_file;
+  ScanFile *split; // Files with chunks not yet handed out
+  pthread_mutex_t lock;
+} ScanQueue;
+
+static void open_scan_file(ScanFile *f) {
+  f->fd = open(f->path, O_RDONLY);
+  TRACE_MARK("open", f->path, f->fd);
+  struct stat st;
+  if (f->fd < 0 || fstat(f->fd, &st) != 0) {
+    f->failed = 1;
+    f->result->status = ERROR_FILE_OPEN;
+    return;
+  }
+  locate_audio_range(f->fd, st.st_size, &f->result->audio_start,
+                     &f->result->audio_end);
+  posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+static void scan_chunk(ScanFile *f, int c) {
+  TRACE_BEGIN(chunk_start);
+  ScanWindow w;
+  if (!window_open(&w, f->fd)) {
+    f->failed = 1;
+    f->result->status = ERROR_MEM_ALLOC;
+    return;
+  }
+  off_t start = f->result->audio_start;
+  off_t end = f->result->audio_end;
+  off_t span = (end - start) / f->chunk_count;
+  off_t lo = start + span * c;
+  off_t hi = c == f->chunk_count - 1 ? end : lo + span;
+  // Only the first range starts on a known boundary
+  off_t pos = c == 0 ? lo : find_sync(&w, lo, end, RESYNC_CONFIRM);
+  walk_frames(&w, pos < hi ? pos : hi, hi, end, &f->chunks[c]);
+  if (pos >= hi) // No frame starts in this range
+    f->chunks[c].start = f->chunks[c].end = pos;
+  window_close(&w);
+  TRACE_END(chunk_start, "scan_chunk", f->path, c);
+}
+
+// Join the ranges. Where a walk did not stop exactly where the next range
+// resynced (a false sync, or frames the resync rejected), that range is
+// walked again from the true boundary.
+static void stitch_chunks(ScanFile *f, ScanWindow *w) {
+  FrameScanStats *total = &f->result->stats;
+  memset(total, 0, sizeof(FrameScanStats));
+  total->start = f->result->audio_start;
+  total->end = f->result->audio_start;
+  off_t end = f->result->audio_end;
+  off_t span = (end - total->start) / f->chunk_count;
+  for (int c = 0; c < f->chunk_count; c++) {
+    FrameScanStats *part = &f->chunks[c];
+    if (c > 0 && part->start != total->end) {
+      off_t hi = c == f->chunk_count - 1 ? end : total->start + span * (c + 1);
+      if (total->end >= hi) {
+        // The previous range already walked past this one
+        continue;
+      }
+      walk_frames(w, total->end, hi, end, part);
+      f->result->rewalks++;
+    }
+    add_stats(total, part);
+  }
+}
+
+static void finish_scan_file(ScanFile *f) {
+  if (!f->failed) {
+    ScanWindow w;
+    if (window_open(&w, f->fd)) {
+      f->result->chunks = f->chunk_count;
+      stitch_chunks(f, &w);
+      window_close(&w);
+      f->result->status = SUCCESS;
+    } else {
+      f->result->status = ERROR_MEM_ALLOC;
+    }
+  }
+  if (f->fd >= 0)
+    close(f->fd);
+  free(f->chunks);
+  f->fd = -1;
+  f->chunks = NULL;
+}
+
+// Open a file, decide how many ranges to split it into and allocate them
+static void setup_scan_file(ScanFile *f) {
+  open_scan_file(f);
+  off_t audio = f->result->audio_end - f->result->audio_start;
+  f->chunk_count = 1;
+  if (!f->failed && audio > 2 * SCAN_CHUNK_MIN)
+    f->chunk_count = (int)(audio / SCAN_CHUNK_MIN);
+  f->chunks = (FrameScanStats *)calloc(f->chunk_count, sizeof(FrameScanStats));
+  if (!f->chunks) {
+    f->failed = 1;
+    f->result->status = ERROR_MEM_ALLOC;
+    f->chunk_count = 1;
+  }
+  f->pending = f->chunk_count;
+  f->next_chunk = 1; // The thread that set it up scans chunk 0
+}
+
+static void *scan_worker(void *arg) {
+  ScanQueue *q = (ScanQueue *)arg;
+  for (;;) {
+    ScanFile *f = NULL;
+    int c = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->split) {
+      f = q->split;
+      c = f->next_chunk++;
+      if (f->next_chunk >= f->chunk_count)
+        q->split = f->next_split;
+    } else if (q->next_file < q->file_count) {
+      f = &q->files[q->next_file++];
+      c = -1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (!f)
+      break;
+
+    if (c < 0) {
+      setup_scan_file(f);
+      if (f->chunk_count > 1) {
+        pthread_mutex_lock(&q->lock);
+        f->next_split = q->split;
+        q->split = f;
+        pthread_mutex_unlock(&q->lock);
+      }
+      c = 0;
+    }
+
+    if (!f->failed)
+      scan_chunk(f, c);
+
+    pthread_mutex_lock(&q->lock);
+    int last = --f->pending == 0;
+    pthread_mutex_unlock(&q->lock);
+    if (last)
+      finish_scan_file(f);
+  }
+  return NULL;
+}
+
+// Bytes of the main data that a Layer III frame takes from earlier frames
+static int main_data_begin(const unsigned char *frame,
+                           const MpegFrameHeader *hdr) {
+  if (hdr->layer != 3)
+    return 0;
+  const unsigned char *side = frame + 4 + (hdr->protected ? 2 : 0);
+  if (hdr->version == 3)
+    return side[0] << 1 | side[1] >> 7; // 9 bits in MPEG 1
+  return side[0];
+}
+
+// Xing/Info (after the side information) or VBRI (at 32) header frame
+static int is_vbr_header_frame(const unsigned char *frame,
+                               const MpegFrameHeader *hdr) {
+  if (hdr->layer != 3)
+    return 0;
+  int side = crc_protected_length(hdr);
+  int at = 4 + (hdr->protected ? 2 : 0) + side;
+  if (at + 4 <= hdr->frame_size && (memcmp(frame + at, "Xing", 4) == 0 ||
+                                     memcmp(frame + at, "Info", 4) == 0))
+    return 1;
+  return 36 + 4 <= hdr->frame_size && memcmp(frame + 36, "VBRI", 4) == 0;
+}
+
+Status map_times_to_frames(int fd, off_t start, off_t end, const double *times,
+                           int count, FrameBoundary *out, FrameBoundary *first,
+                           FrameBoundary *last) {
+  ScanWindow w;
+  if (!window_open(&w, fd))
+    return ERROR_MEM_ALLOC;
+  off_t pos = find_sync(&w, start, end, RESYNC_CONFIRM);
+  MpegFrameHeader hdr;
+  if (!header_at(&w, pos, end, &hdr)) {
+    window_close(&w);
+    return ERROR_INVALID_FORMAT;
+  }
+  const unsigned char *frame = window_at(&w, pos, (size_t)hdr.frame_size);
+  if (frame && is_vbr_header_frame(frame, &hdr))
+    pos += hdr.frame_size; // Its frame count would be wrong for the cut
+
+  double t = 0;
+  int k = 0;
+  long index = 0;
+  FrameBoundary clean = {pos, 0, 0}; // Latest frame borrowing no bits
+  long clean_index = 0;
+  off_t floor = pos; // Boundaries never move back past the previous one
+  off_t frames_end = pos;
+  first->offset = pos;
+  first->time = 0;
+  first->snapped = 0;
+  while (pos < end) {
+    if (!header_at(&w, pos, end, &hdr)) {
+      pos = find_sync(&w, pos + 1, end, 2); // Skip garbage
+      continue;
+    }
+    if (pos + hdr.frame_size > end)
+      break; // Truncated last frame
+    frame = window_at(&w, pos, (size_t)hdr.frame_size);
+    if (!frame)
+      break;
+    int borrows = main_data_begin(frame, &hdr) > 0;
+    if (!borrows) {
+      clean.offset = pos;
+      clean.time = t;
+      clean_index = index;
+    }
+    double duration = (double)hdr.samples / hdr.sample_rate;
+    // Times nearer this frame's start than the next one's map here
+    while (k < count && times[k] <= t + duration / 2) {
+      out[k].offset = pos;
+      out[k].time = t;
+      out[k].snapped = 0;
+      if (borrows && index - clean_index <= RESERVOIR_LOOKBACK &&
+          clean.offset >= floor) {
+        out[k] = clean;
+        out[k].snapped = 1;
+      }
+      floor = out[k].offset;
+      k++;
+    }
+    pos += hdr.frame_size;
+    frames_end = pos;
+    t += duration;
+    index++;
+  }
+  last->offset = frames_end;
+  last->time = t;
+  last->snapped = 0;
+  for (; k < count; k++)
+    out[k] = *last;
+  window_close(&w);
+  return SUCCESS;
+}
+
+Status scan_frames_parallel(const FileList *files, FrameScanResult *results,
+                            int jobs) {
+  if (!files || !results)
+    return ERROR_INVALID_FORMAT;
+  ScanQueue q;
+  memset(&q, 0, sizeof(ScanQueue));
+  q.files = (ScanFile *)calloc(files->count, sizeof(ScanFile));
+  if (!q.files)
+    return ERROR_MEM_ALLOC;
+  q.file_count = files->count;
+  for (size_t i = 0; i < files->count; i++) {
+    q.files[i].path = files->paths[i];
+    q.files[i].result = &results[i];
+    memset(&results[i], 0, sizeof(FrameScanResult));
+  }
+  pthread_mutex_init(&q.lock, NULL);
+
+  if (jobs < 1)
+    jobs = 1;
+  pthread_t *threads = (pthread_t *)malloc(jobs * sizeof(pthread_t));
+  int started = 0;
+  if (threads) {
+    for (; started < jobs; started++)
+      if (pthread_create(&threads[started], NULL, scan_worker, &q) != 0)
+        break;
+  }
+  if (started == 0)
+    scan_worker(&q);
+  for (int t = 0; t < started; t++)
+    pthread_join(threads[t], NULL);
+  free(threads);
+  pthread_mutex_destroy(&q.lock);
+  free(q.files);
+  return SUCCESS;
+}
+
+Status scan_mpeg_files(const FileList *files, int jobs) {
+  FrameScanResult *results =
+      (FrameScanResult *)calloc(files->count, sizeof(FrameScanResult));
+  if (!results)
+    return ERROR_MEM_ALLOC;
+  Status status = scan_frames_parallel(files, results, jobs);
+  if (status != SUCCESS) {
+    free(results);
+    return status;
+  }
+
+  size_t failed = 0;
+  double total_duration = 0;
+  for (size_t i = 0; i < files->count; i++) {
+    const FrameScanStats *st = &results[i].stats;
+    if (results[i].status != SUCCESS || st->frames == 0) {
+      printf("%s: no MPEG frames found\n", files->paths[i]);
+      failed++;
+      continue;
+    }
+    int min = (int)st->duration / 60;
+    double sec = st->duration - min * 60;
+    printf("%s\n", files->paths[i]);
+    printf("  Time: %d:%06.3f  Frames: %llu  Bitrate: %.1f kb/s avg "
+           "(%d-%d)%s\n",
+           min, sec, (unsigned long long)st->frames,
+           st->frame_bytes * 8.0 / st->duration / 1000.0, st->min_bitrate,
+           st->max_bitrate,
+           st->min_bitrate == st->max_bitrate ? " CBR" : " VBR");
+    printf("  Audio: %lld bytes  Ranges: %d (%d re-walked)\n",
+           (long long)(results[i].audio_end - results[i].audio_start),
+           results[i].chunks, results[i].rewalks);
+    total_duration += st->duration;
+  }
+  printf("------------------------------------------------------------\n");
+  printf("Files: %zu  Total time: %.1f h  Unreadable: %zu\n", files->count,
+         total_duration / 3600.0, failed);
+  free(results);
+  return failed ? ERROR_INVALID_FORMAT : SUCCESS;
+}
+
+Status verify_mpeg_files(const FileList *files, int jobs) {
+  FrameScanResult *results =
+      (FrameScanResult *)calloc(files->count, sizeof(FrameScanResult));
+  if (!results)
+    return ERROR_MEM_ALLOC;
+  Status status = scan_frames_parallel(files, results, jobs);
+  if (status != SUCCESS) {
+    free(results);
+    return status;
+  }
+
+  size_t damaged = 0, failed = 0;
+  for (size_t i = 0; i < files->count; i++) {
+    const FrameScanStats *st = &results[i].stats;
+    if (results[i].status != SUCCESS) {
+      printf("ERROR    %s\n", files->paths[i]);
+      failed++;
+      continue;
+    }
+    int bad = st->frames == 0 || st->crc_errors || st->garbage_bytes ||
+              st->truncated;
+    printf("%-8s frames=%llu crc=%llu/%llu crc_errors=%llu garbage=%llu "
+           "sync_lost=%llu truncated=%d  %s\n",
+           bad ? "DAMAGED" : "OK", (unsigned long long)st->frames,
+           (unsigned long long)st->crc_checked,
+           (unsigned long long)(st->crc_checked + st->crc_unchecked),
+           (unsigned long long)st->crc_errors,
+           (unsigned long long)st->garbage_bytes,
+           (unsigned long long)st->sync_losses, st->truncated,
+           files->paths[i]);
+    if (bad)
+      damaged++;
+  }
+  printf("------------------------------------------------------------\n");
+  printf("Files: %zu  OK: %zu  Damaged: %zu  Unreadable: %zu\n", files->count,
+         files->count - damaged - failed, damaged, failed);
+  free(results);
+  return damaged || failed ? ERROR_INVALID_FORMAT : SUCCESS;
+}
+
+static const char *tail_tag_name(TailTagType type) {
+  switch (type) {
+  case TAIL_ID3V1:
+    return "ID3v1";
+  case TAIL_APEV2:
+    return "APEv2";
+  case TAIL_LYRICS3:
+    return "Lyrics3";
+  default:
+    return "ID3v2 (appended)";
+  }
+}
+
+// "[start, end) region" for every part of the file, in file order
+static void print_layout(const char *path, const FrameScanResult *r) {
+  printf("  Layout:");
+  if (r->audio_start > 0)
+    printf(" [0, %lld) ID3v2", (long long)r->audio_start);
+  printf(" [%lld, %lld) audio", (long long)r->audio_start,
+         (long long)r->audio_end);
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  TailTags tail;
+  if (fd >= 0 && fstat(fd, &st) == 0 &&
+      probe_tail_tags(fd, st.st_size, r->audio_start, &tail) == SUCCESS) {
+    for (int i = tail.count - 1; i >= 0; i--)
+      printf(" [%lld, %lld) %s", (long long)tail.blocks[i].offset,
+             (long long)(tail.blocks[i].offset + tail.blocks[i].size),
+             tail_tag_name(tail.blocks[i].type));
+  }
+  if (fd >= 0)
+    close(fd);
+  printf("\n");
+}
+
+Status profile_mpeg_files(const FileList *files, int jobs) {
+  FrameScanResult *results =
+      (FrameScanResult *)calloc(files->count, sizeof(FrameScanResult));
+  if (!results)
+    return ERROR_MEM_ALLOC;
+  Status status = scan_frames_parallel(files, results, jobs);
+  if (status != SUCCESS) {
+    free(results);
+    return status;
+  }
+
+  size_t failed = 0, vbr = 0, mixed_rate = 0, mixed_mode = 0, junky = 0;
+  uint64_t junk = 0;
+  for (size_t i = 0; i < files->count; i++) {
+    const FrameScanStats *st = &results[i].stats;
+    if (results[i].status != SUCCESS || st->frames == 0) {
+      printf("%s: no MPEG frames found\n", files->paths[i]);
+      failed++;
+      continue;
+    }
+    int is_vbr = st->min_bitrate != st->max_bitrate;
+    char time[32];
+    format_play_time(st->duration, time, sizeof(time));
+    printf("%s\n", files->paths[i]);
+    printf("  Frames: %llu  Time: %s  Bitrate: %d/%.1f/%d kb/s "
+           "(min/avg/max) %s\n",
+           (unsigned long long)st->frames, time, st->min_bitrate,
+           st->frame_bytes * 8.0 / st->duration / 1000.0, st->max_bitrate,
+           is_vbr ? "VBR" : "CBR");
+    printf("  Bitrates:");
+    for (int b = 0; b < SCAN_BITRATE_SLOTS; b++) {
+      if (st->bitrate_frames[b])
+        printf(" %d:%llu (%.1f%%)", b * 8,
+               (unsigned long long)st->bitrate_frames[b],
+               st->bitrate_frames[b] * 100.0 / st->frames);
+    }
+    printf("\n");
+    printf("  Changes: mode %llu, sample rate %llu  Junk: %llu bytes in %llu "
+           "places%s\n",
+           (unsigned long long)st->mode_changes,
+           (unsigned long long)st->rate_changes,
+           (unsigned long long)st->garbage_bytes,
+           (unsigned long long)st->sync_losses,
+           st->truncated ? "  Last frame truncated" : "");
+    print_layout(files->paths[i], &results[i]);
+    vbr += is_vbr;
+    mixed_rate += st->rate_changes > 0;
+    mixed_mode += st->mode_changes > 0;
+    junky += st->garbage_bytes > 0;
+    junk += st->garbage_bytes;
+  }
+  printf("------------------------------------------------------------\n");
+  printf("Files: %zu  CBR: %zu  VBR: %zu  Mixed sample rate: %zu  Mixed "
+         "mode: %zu  With junk: %zu (%llu bytes)  Unreadable: %zu\n",
+         files->count, files->count - failed - vbr, vbr, mixed_rate,
+         mixed_mode, junky, (unsigned long long)junk, failed);
+  free(results);
+  return failed ? ERROR_INVALID_FORMAT : SUCCESS;
+}
@@ -0,0 +1,136 @@
+#include "../inc/hash.h"
+#include <string.h>
+
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Little-endian loads via memcpy so unaligned input is safe
+static inline uint64_t read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * PRIME2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t val) {
+  acc ^= round64(0, val);
+  return acc * PRIME1 + PRIME4;
+}
+
+void xxh64_init(Xxh64State *state, uint64_t seed) {
+  memset(state, 0, sizeof(Xxh64State));
+  state->v[0] = seed + PRIME1 + PRIME2;
+  state->v[1] = seed + PRIME2;
+  state->v[2] = seed;
+  state->v[3] = seed - PRIME1;
+}
+
+void xxh64_update(Xxh64State *state, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + len;
+  state->total_len += len;
+
+  // Top up a partial stripe left from the previous call
+  if (state->mem_size + len < 32) {
+    memcpy(state->mem + state->mem_size, p, len);
+    state->mem_size += (uint32_t)len;
+    return;
+  }
+  if (state->mem_size) {
+    size_t fill = 32 - state->mem_size;
+    memcpy(state->mem + state->mem_size, p, fill);
+    for (int i = 0; i < 4; i++)
+      state->v[i] = round64(state->v[i], read64(state->mem + i * 8));
+    p += fill;
+    state->mem_size = 0;
+  }
+
+  // Main loop: four independent lanes per 32-byte stripe
+  uint64_t v1 = state->v[0], v2 = state->v[1];
+  uint64_t v3 = state->v[2], v4 = state->v[3];
+  while (p + 32 <= end) {
+    v1 = round64(v1, read64(p));
+    v2 = round64(v2, read64(p + 8));
+    v3 = round64(v3, read64(p + 16));
+    v4 = round64(v4, read64(p + 24));
+    p += 32;
+  }
+  state->v[0] = v1;
+  state->v[1] = v2;
+  state->v[2] = v3;
+  state->v[3] = v4;
+
+  if (p < end) {
+    memcpy(state->mem, p, (size_t)(end - p));
+    state->mem_size = (uint32_t)(end - p);
+  }
+}
+
+uint64_t xxh64_digest(const Xxh64State *state) {
+  uint64_t h;
+  if (state->total_len >= 32) {
+    h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) +
+        rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+    for (int i = 0; i < 4; i++)
+      h = merge_round(h, state->v[i]);
+  } else {
+    h = state->v[2] + PRIME5;
+  }
+  h += state->total_len;
+
+  const unsigned char *p = state->mem;
+  const unsigned char *end = p + state->mem_size;
+  while (p + 8 <= end) {
+    h ^= round64(0, read64(p));
+    h = rotl64(h, 27) * PRIME1 + PRIME4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * PRIME1;
+    h = rotl64(h, 23) * PRIME2 + PRIME3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (*p) * PRIME5;
+    h = rotl64(h, 11) * PRIME1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME2;
+  h ^= h >> 29;
+  h *= PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+  Xxh64State state;
+  xxh64_init(&state, seed);
+  xxh64_update(&state, data, len);
+  return xxh64_digest(&state);
+}
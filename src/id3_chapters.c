@@ -0,0 +1,321 @@
+#include "../inc/id3_chapters.h"
+#include "../inc/id3_unsync.h"
+#include "../inc/id3_v2.h"
+#include "../inc/play_time.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t be32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         (uint32_t)p[3];
+}
+
+static void put_be32(uint32_t v, unsigned char *p) {
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+// Length of the fixed part of a CHAP/CTOC body (before the sub-frames), or 0
+// if the body is too short for it
+static uint32_t fixed_length(const char *frame_id, const unsigned char *body,
+                             uint32_t size) {
+  const unsigned char *nul = memchr(body, 0, size);
+  if (!nul || nul == body)
+    return 0;
+  uint32_t pos = (uint32_t)(nul - body) + 1;
+  if (strcmp(frame_id, "CHAP") == 0)
+    return pos + 16 <= size ? pos + 16 : 0;
+  // CTOC: flags, entry count, then that many null-terminated IDs
+  if (pos + 2 > size)
+    return 0;
+  int entries = body[pos + 1];
+  pos += 2;
+  for (int i = 0; i < entries; i++) {
+    nul = memchr(body + pos, 0, size - pos);
+    if (!nul)
+      return 0;
+    pos = (uint32_t)(nul - body) + 1;
+  }
+  return pos;
+}
+
+// Decode a v2.4 sub-frame of size bytes in place into its v2.3 form and
+// return the new size: the data is resynchronised and the data length
+// indicator dropped before the flags say so. Compressed or encrypted data is
+// not decoded here, so such a sub-frame keeps its flags as they were.
+static uint32_t decode_subframe(unsigned char *f, uint32_t size) {
+  unsigned char format = f[9];
+  if (format & 0x0C)
+    return size;
+  uint32_t group = (format & 0x40) ? 1 : 0;
+  uint32_t skip = group + ((format & 0x01) ? 4 : 0);
+  if (skip > size)
+    return size;
+  unsigned char *data = f + 10 + group;
+  uint32_t len = size - skip;
+  memmove(data, f + 10 + skip, len);
+  if (format & 0x02) {
+    int after_ff = 0;
+    len = (uint32_t)id3v2_resync(data, len, &after_ff);
+  }
+  // The status flags sit one bit higher in v2.3, grouping is 0x20 there
+  f[8] = (unsigned char)((f[8] & 0x70) << 1);
+  f[9] = group ? 0x20 : 0;
+  put_be32(group + len, f + 4);
+  return group + len;
+}
+
+// Rewrite the sub-frames in place as ID3v2.3, whose sizes are not synchsafe
+// and whose flag bits mean something else. Returns their new length.
+static uint32_t normalize_subframes(unsigned char *p, uint32_t len,
+                                    int major_version) {
+  uint32_t pos = 0;
+  while (pos + 10 <= len && p[pos] != 0) {
+    uint32_t size = be32(p + pos + 4);
+    if (major_version == 4) {
+      size = (uint32_t)p[pos + 4] << 21 | (uint32_t)p[pos + 5] << 14 |
+             (uint32_t)p[pos + 6] << 7 | (uint32_t)p[pos + 7];
+      put_be32(size, p + pos + 4);
+    }
+    if (size > len - pos - 10)
+      break;
+    if (major_version == 4) {
+      uint32_t decoded = decode_subframe(p + pos, size);
+      memmove(p + pos + 10 + decoded, p + pos + 10 + size,
+              len - pos - 10 - size);
+      len -= size - decoded;
+      size = decoded;
+    }
+    pos += 10 + size;
+  }
+  return len;
+}
+
+static int reserve_bytes(unsigned char **buf, size_t *cap, size_t len,
+                         size_t bytes) {
+  if (len + bytes > *cap) {
+    size_t grown = *cap ? *cap * 2 : 4096;
+    while (grown < len + bytes)
+      grown *= 2;
+    unsigned char *p = (unsigned char *)realloc(*buf, grown);
+    if (!p)
+      return 0;
+    *buf = p;
+    *cap = grown;
+  }
+  return 1;
+}
+
+static int reserve(ChapterTable *t, size_t bytes) {
+  if (!reserve_bytes(&t->block, &t->block_cap, t->block_len, bytes))
+    return 0;
+  if (t->count == t->capacity) {
+    int cap = t->capacity ? t->capacity * 2 : 16;
+    Id3Chapter *items =
+        (Id3Chapter *)realloc(t->items, cap * sizeof(Id3Chapter));
+    if (!items)
+      return 0;
+    t->items = items;
+    t->capacity = cap;
+  }
+  return 1;
+}
+
+Status chapter_table_add(ChapterTable *table, const char *frame_id,
+                         const unsigned char *body, uint32_t size,
+                         int major_version) {
+  uint32_t fixed = fixed_length(frame_id, body, size);
+  if (fixed == 0)
+    return ERROR_INVALID_FORMAT;
+  if (!reserve(table, 10 + (size_t)size))
+    return ERROR_MEM_ALLOC;
+
+  uint32_t offset = (uint32_t)table->block_len;
+  unsigned char *frame = table->block + offset;
+  memcpy(frame, frame_id, 4);
+  frame[8] = 0;
+  frame[9] = 0;
+  memcpy(frame + 10, body, size);
+  size = fixed +
+         normalize_subframes(frame + 10 + fixed, size - fixed, major_version);
+  put_be32(size, frame + 4);
+  table->block_len += 10 + (size_t)size;
+
+  if (strcmp(frame_id, "CHAP") == 0) {
+    const unsigned char *times = frame + 10 + fixed - 16;
+    Id3Chapter *c = &table->items[table->count++];
+    memset(c, 0, sizeof(Id3Chapter));
+    c->start_ms = be32(times);
+    c->end_ms = be32(times + 4);
+    c->offset = offset;
+    c->size = 10 + size;
+  }
+  return SUCCESS;
+}
+
+Status chapter_table_index(ChapterTable *table, const unsigned char *prefix,
+                           uint32_t prefix_len, int major_version) {
+  uint32_t fixed = fixed_length("CHAP", prefix, prefix_len);
+  if (fixed == 0)
+    return ERROR_INVALID_FORMAT;
+  if (!reserve_bytes(&table->stubs, &table->stubs_cap, table->stubs_len,
+                     10 + (size_t)prefix_len) ||
+      !reserve(table, 0))
+    return ERROR_MEM_ALLOC;
+
+  // A stub: the frame's first bytes behind a header of their own length, so
+  // the lookups below work on it unchanged
+  unsigned char *frame = table->stubs + table->stubs_len;
+  memcpy(frame, "CHAP", 4);
+  frame[8] = 0;
+  frame[9] = 0;
+  memcpy(frame + 10, prefix, prefix_len);
+  prefix_len = fixed + normalize_subframes(frame + 10 + fixed,
+                                           prefix_len - fixed, major_version);
+  put_be32(prefix_len, frame + 4);
+  const unsigned char *times = frame + 10 + fixed - 16;
+  Id3Chapter *c = &table->items[table->count++];
+  memset(c, 0, sizeof(Id3Chapter));
+  c->start_ms = be32(times);
+  c->end_ms = be32(times + 4);
+  c->offset = (uint32_t)table->stubs_len;
+  c->size = 10 + prefix_len;
+  c->in_file = 1;
+  table->stubs_len += 10 + (size_t)prefix_len;
+  return SUCCESS;
+}
+
+Status chapter_table_add_ref(ChapterTable *table, off_t offset,
+                             uint32_t size) {
+  if (table->ref_count == table->ref_capacity) {
+    int cap = table->ref_capacity ? table->ref_capacity * 2 : 16;
+    ChapterRef *refs =
+        (ChapterRef *)realloc(table->refs, cap * sizeof(ChapterRef));
+    if (!refs)
+      return ERROR_MEM_ALLOC;
+    table->refs = refs;
+    table->ref_capacity = cap;
+  }
+  table->refs[table->ref_count].offset = offset;
+  table->refs[table->ref_count++].size = size;
+  return SUCCESS;
+}
+
+static int compare_chapters(const void *a, const void *b) {
+  const Id3Chapter *x = (const Id3Chapter *)a;
+  const Id3Chapter *y = (const Id3Chapter *)b;
+  if (x->start_ms != y->start_ms)
+    return x->start_ms < y->start_ms ? -1 : 1;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+void chapter_table_sort(ChapterTable *table) {
+  if (table->count > 1)
+    qsort(table->items, table->count, sizeof(Id3Chapter), compare_chapters);
+}
+
+int chapter_at(const ChapterTable *table, uint32_t ms) {
+  // Last chapter starting at or before ms
+  int lo = 0, hi = table->count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (table->items[mid].start_ms <= ms)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0 || ms >= table->items[lo - 1].end_ms)
+    return -1;
+  return lo - 1;
+}
+
+static const unsigned char *chapter_frame(const ChapterTable *table, int i) {
+  const Id3Chapter *c = &table->items[i];
+  return (c->in_file ? table->stubs : table->block) + c->offset;
+}
+
+const char *chapter_element_id(const ChapterTable *table, int i) {
+  return (const char *)chapter_frame(table, i) + 10;
+}
+
+const char *chapter_title(ChapterTable *table, int i) {
+  Id3Chapter *c = &table->items[i];
+  if (c->title_loaded)
+    return c->title;
+  c->title_loaded = 1;
+  const unsigned char *frame = chapter_frame(table, i);
+  uint32_t fixed = fixed_length("CHAP", frame + 10, c->size - 10);
+  uint32_t pos = 10 + fixed;
+  while (pos + 10 <= c->size && frame[pos] != 0) {
+    uint32_t size = be32(frame + pos + 4);
+    if (size > c->size - pos - 10)
+      break;
+    if (memcmp(frame + pos, "TIT2", 4) == 0) {
+      // Only a plain or grouped title is readable
+      uint32_t group = frame[pos + 9] == 0x20 ? 1 : 0;
+      if ((frame[pos + 9] & ~0x20) == 0 && size > group)
+        c->title = decode_id3v2_text(frame + pos + 10 + group, size - group);
+      break;
+    }
+    pos += 10 + size;
+  }
+  return c->title;
+}
+
+void chapter_table_free(ChapterTable *table) {
+  for (int i = 0; i < table->count; i++)
+    free(table->items[i].title);
+  free(table->items);
+  free(table->block);
+  free(table->stubs);
+  free(table->refs);
+  memset(table, 0, sizeof(ChapterTable));
+}
+
+static void print_chapter(ChapterTable *table, int i) {
+  const Id3Chapter *c = &table->items[i];
+  char a[32], b[32];
+  format_play_time(c->start_ms / 1000.0, a, sizeof(a));
+  format_play_time(c->end_ms / 1000.0, b, sizeof(b));
+  const char *title = chapter_title(table, i);
+  printf("%3d  %s - %s  %s\t%s\n", i + 1, a, b, chapter_element_id(table, i),
+         title ? title : "");
+}
+
+Status list_chapters(const char *filepath, const char *at) {
+  double seconds = 0;
+  const char *end;
+  if (at && (!parse_play_time(at, &end, &seconds) || *end != '\0')) {
+    printf("Error: --chapter-at expects a time, e.g. 1:02:03.5\n");
+    return ERROR_INVALID_FORMAT;
+  }
+
+  ID3v2_Content content;
+  memset(&content, 0, sizeof(ID3v2_Content));
+  Status status = read_id3v2_tag(filepath, &content);
+  ChapterTable *table = &content.chapters;
+  if (status != SUCCESS || table->count == 0) {
+    printf("No chapters in '%s'\n", filepath);
+    free_id3v2_content(&content);
+    return ERROR_TAG_NOT_FOUND;
+  }
+
+  if (at) {
+    int i = chapter_at(table, (uint32_t)(seconds * 1000 + 0.5));
+    if (i < 0) {
+      printf("No chapter at %s\n", at);
+      status = ERROR_TAG_NOT_FOUND;
+    } else {
+      print_chapter(table, i);
+    }
+  } else {
+    printf("%s: %d chapters\n", filepath, table->count);
+    for (int i = 0; i < table->count; i++)
+      print_chapter(table, i);
+  }
+  free_id3v2_content(&content);
+  return status;
+}
@@ -1,16 +1,28 @@
 #include "../inc/id3_reader.h"
+#include "../inc/file_util.h"
 #include "../inc/id3_v1.h"
 #include "../inc/id3_v2.h"
+#include "../inc/io_budget.h"
 #include "../inc/mpeg_reader.h"
+#include "../inc/safe_write.h"
+#include "../inc/tail_tags.h"
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 Status read_id3_tags(const char *filepath) {
+  // The trailing tags are probed once, for all three readers
+  TailTags probed;
+  const TailTags *tail =
+      probe_file_tail(filepath, &probed) == SUCCESS ? &probed : NULL;
+
   // Line 1: [filename] [size]
   MpegInfo mpeg_info;
   memset(&mpeg_info, 0, sizeof(MpegInfo));
-  read_mpeg_info(filepath, &mpeg_info);
+  read_mpeg_info_tail(filepath, tail, &mpeg_info);
 
   printf("%s %.2f MB\n", filepath, (double)mpeg_info.filesize / (1024 * 1024));
 
@@ -31,11 +43,12 @@ Status read_id3_tags(const char *filepath) {
   // Line 4: id3 version
   ID3v2_Content v2_content;
   memset(&v2_content, 0, sizeof(ID3v2_Content));
-  Status v2_status = read_id3v2_tag(filepath, &v2_content);
+  Status v2_status = read_id3v2_tag_tail(filepath, tail, &v2_content);
 
   ID3v1_Tag v1_tag;
   memset(&v1_tag, 0, sizeof(ID3v1_Tag));
-  Status v1_status = read_id3v1_tag(filepath, &v1_tag);
+  Status v1_status = tail ? read_id3v1_from_tail(tail, &v1_tag)
+                          : read_id3v1_tag(filepath, &v1_tag);
 
   if (v2_status == SUCCESS) {
     printf("ID3 v2.%d:\n", v2_content.major_version);
@@ -67,6 +80,10 @@ Status read_id3_tags(const char *filepath) {
         printf("       Description: %s\n", v2_content.image.description);
     }
 
+    if (v2_content.chapters.count > 0)
+      printf("Chapters: %d (--chapters lists them)\n",
+             v2_content.chapters.count);
+
     // Line 8: comment
     if (v2_content.comment) {
       if (v2_content.comment_desc || v2_content.lang) {
@@ -95,57 +112,122 @@ Status update_id3_tags(const char *filepath, const TagUpdate *update) {
   printf("Updating tags for file: %s\n", filepath);
   printf("----------------------------------------\n");
 
-  // Update ID3v1
-  ID3v1_Tag tag;
-  memset(&tag, 0, sizeof(ID3v1_Tag));
-  Status v1_read = read_id3v1_tag(filepath, &tag);
-
-  if (v1_read == SUCCESS || v1_read == ERROR_TAG_NOT_FOUND) {
-    if (v1_read == ERROR_TAG_NOT_FOUND) {
-      tag.genre = 12; // Other
-    }
-    if (update->title)
-      strncpy(tag.title, update->title, 30);
-    if (update->artist)
-      strncpy(tag.artist, update->artist, 30);
-    if (update->album)
-      strncpy(tag.album, update->album, 30);
-    if (update->year)
-      strncpy(tag.year, update->year, 4);
-    if (update->comment)
-      strncpy(tag.comment, update->comment, 30);
-    if (update->genre)
-      tag.genre = (uint8_t)atoi(update->genre);
-    if (update->track)
-      printf("  Set Track (v2 only): %s\n", update->track);
-
-    write_id3v1_tag(filepath, &tag);
-    printf("  ID3v1 updated.\n");
+  if (update->track)
+    printf("  Set Track (v2 only): %s\n", update->track);
+
+  // Both tags go into one replacement, read and written under the writer
+  // lock: the ID3v2 rewrite copies the ID3v1 tag along, and it is updated
+  // in the new file. Either both change or neither does.
+  SafeWrite sw;
+  Status status = safe_write_begin(&sw, filepath);
+  if (status == SUCCESS) {
+    ID3v2_Content content;
+    memset(&content, 0, sizeof(ID3v2_Content));
+    read_id3v2_tag(filepath, &content); // Get current values
+    status = write_id3v2_rewrite(&sw, &content, update);
+    free_id3v2_content(&content);
+    if (status == SUCCESS)
+      status = write_id3v1_update(sw.tmp_fd, lseek(sw.tmp_fd, 0, SEEK_END),
+                                  update);
+    if (status == SUCCESS)
+      status = safe_write_commit(&sw);
+    else
+      safe_write_abort(&sw);
   }
 
-  // Update ID3v2
-  Status v2_write = write_id3v2_tag(filepath, update);
-  if (v2_write == SUCCESS) {
+  if (status == SUCCESS) {
+    printf("  ID3v1 updated.\n");
     printf("  ID3v2 updated successfully.\n");
   } else {
     const char *err = "Unknown error";
-    if (v2_write == ERROR_FILE_OPEN)
+    if (status == ERROR_FILE_OPEN)
       err = "Could not open file (check if filename is correct)";
-    else if (v2_write == ERROR_MEM_ALLOC)
-      err = "Memory allocation failed";
-    else if (v2_write == ERROR_INVALID_FORMAT)
+    else if (status == ERROR_MEM_ALLOC)
+      err = "Memory allocation failed (or over --frame-cap/--mem-budget)";
+    else if (status == ERROR_INVALID_FORMAT)
       err = "Invalid ID3 format";
-    printf("  Error updating ID3v2: %s\n", err);
+    else if (status == ERROR_WRITE_FAILED)
+      err = "Could not write the new file";
+    else if (status == ERROR_FILE_BUSY)
+      err = "File is locked by another writer";
+    else if (status == ERROR_CONFLICT)
+      err = "File changed while updating; nothing written";
+    printf("  Error updating tags: %s\n", err);
   }
 
   printf("----------------------------------------\n");
-  return v2_write;
+  return status;
 }
 
 Status delete_id3_tags(const char *filepath) {
   printf("Deleting tags from: %s\n", filepath);
-  remove_id3v1_tag(filepath);
-  remove_id3v2_tag(filepath);
-  printf("Tags deleted.\n");
-  return SUCCESS;
+  // Keep only the audio: the leading ID3v2 tag and every trailing block
+  // (ID3v1, APEv2, Lyrics3, appended ID3v2) go in one rewrite
+  SafeWrite sw;
+  Status status = safe_write_begin(&sw, filepath);
+  if (status == SUCCESS) {
+    off_t start, end;
+    locate_audio_range(sw.fd, sw.size, &start, &end);
+    if (start == 0 && end == sw.size) {
+      safe_write_abort(&sw); // Nothing to delete
+    } else {
+      status = copy_file_bytes(sw.fd, start, end - start, sw.tmp_fd);
+      if (status == SUCCESS)
+        status = safe_write_commit(&sw);
+      else
+        safe_write_abort(&sw);
+    }
+  }
+  if (status == ERROR_FILE_BUSY)
+    printf("Error: File is locked by another writer.\n");
+  else if (status == ERROR_CONFLICT)
+    printf("Error: File changed while deleting tags.\n");
+  else if (status != SUCCESS)
+    printf("Error: Could not delete tags.\n");
+  else
+    printf("Tags deleted.\n");
+  return status;
+}
+
+void locate_audio_range(int fd, off_t size, off_t *start, off_t *end) {
+  locate_audio_range_tail(fd, size, NULL, start, end);
+}
+
+void locate_audio_range_tail(int fd, off_t size, const TailTags *tail,
+                             off_t *start, off_t *end) {
+  unsigned char header[10];
+  *start = 0;
+  *end = size;
+  if (size >= 10 && pread(fd, header, 10, 0) == 10) {
+    io_charge_read(10);
+    *start = id3v2_tag_length(header);
+  }
+  if (*start > size)
+    *start = size; // Tag size claims more than the file holds
+  TailTags probed;
+  if (tail)
+    *end = tail->audio_end;
+  else if (probe_tail_tags(fd, size, *start, &probed) == SUCCESS)
+    *end = probed.audio_end;
+}
+
+Status probe_file_tail(const char *filepath, TailTags *tail) {
+  int fd = open(filepath, O_RDONLY);
+  if (fd < 0)
+    return ERROR_FILE_OPEN;
+  struct stat st;
+  unsigned char header[10];
+  off_t floor = 0;
+  Status status = ERROR_FILE_OPEN;
+  if (fstat(fd, &st) == 0) {
+    if (st.st_size >= 10 && pread(fd, header, 10, 0) == 10) {
+      io_charge_read(10);
+      floor = id3v2_tag_length(header);
+    }
+    if (floor > st.st_size)
+      floor = st.st_size;
+    status = probe_tail_tags(fd, st.st_size, floor, tail);
+  }
+  close(fd);
+  return status;
 }
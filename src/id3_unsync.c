@@ -0,0 +1,109 @@
+#ifdef __linux__
+#define _GNU_SOURCE // fopencookie
+#endif
+#include "../inc/id3_unsync.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+size_t id3v2_resync(unsigned char *buf, size_t len, int *after_ff) {
+  if (len == 0)
+    return 0;
+  unsigned char last = buf[len - 1];
+  size_t r = (*after_ff && buf[0] == 0) ? 1 : 0;
+  size_t w = 0;
+#ifdef __SSE2__
+  // 16 bytes per compare. A block without 0xFF moves down whole; at a 0xFF
+  // everything up to it moves and a 0x00 right after it is dropped. The
+  // reads stay ahead of the writes, so the pass works in place.
+  const __m128i ff = _mm_set1_epi8((char)0xFF);
+  while (r + 16 <= len) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(buf + r));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, ff));
+    if (mask == 0) {
+      _mm_storeu_si128((__m128i *)(buf + w), v);
+      r += 16;
+      w += 16;
+      continue;
+    }
+    size_t run = (size_t)__builtin_ctz((unsigned)mask) + 1;
+    if (w != r)
+      memmove(buf + w, buf + r, run);
+    r += run;
+    w += run;
+    if (r < len && buf[r] == 0)
+      r++;
+  }
+#endif
+  while (r < len) {
+    unsigned char c = buf[r++];
+    buf[w++] = c;
+    if (c == 0xFF && r < len && buf[r] == 0)
+      r++;
+  }
+  *after_ff = last == 0xFF;
+  return w;
+}
+
+// Fill buf with decoded bytes; 0 at the end of the encoded body
+static size_t resync_read(ResyncSource *src, unsigned char *buf, size_t size) {
+  size_t out = 0;
+  // A chunk can decode to nothing (a lone dropped 0x00), so go again
+  while (out == 0 && src->left > 0 && size > 0) {
+    size_t want = (off_t)size < src->left ? size : (size_t)src->left;
+    size_t got = fread(buf, 1, want, src->raw);
+    if (got == 0) {
+      src->left = 0;
+      break;
+    }
+    src->left -= (off_t)got;
+    out = id3v2_resync(buf, got, &src->after_ff);
+  }
+  return out;
+}
+
+#ifdef __linux__
+static ssize_t cookie_read(void *cookie, char *buf, size_t size) {
+  return (ssize_t)resync_read((ResyncSource *)cookie, (unsigned char *)buf,
+                              size);
+}
+
+FILE *open_resync_stream(ResyncSource *src, FILE *raw, off_t size) {
+  src->raw = raw;
+  src->left = size;
+  src->after_ff = 0;
+  cookie_io_functions_t io = {cookie_read, NULL, NULL, NULL};
+  return fopencookie(src, "rb", io);
+}
+#else
+#define RESYNC_CHUNK (64 * 1024)
+
+// No custom streams: decode the whole body into a temporary file
+FILE *open_resync_stream(ResyncSource *src, FILE *raw, off_t size) {
+  src->raw = raw;
+  src->left = size;
+  src->after_ff = 0;
+  FILE *out = tmpfile();
+  unsigned char *buf = (unsigned char *)malloc(RESYNC_CHUNK);
+  if (!out || !buf) {
+    free(buf);
+    if (out)
+      fclose(out);
+    return NULL;
+  }
+  size_t n;
+  while ((n = resync_read(src, buf, RESYNC_CHUNK)) > 0) {
+    if (fwrite(buf, 1, n, out) != n) {
+      fclose(out);
+      out = NULL;
+      break;
+    }
+  }
+  free(buf);
+  if (out)
+    rewind(out);
+  return out;
+}
+#endif
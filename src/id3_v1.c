@@ -1,30 +1,21 @@
 #include "../inc/id3_v1.h"
+#include "../inc/file_util.h"
+#include "../inc/io_budget.h"
+#include "../inc/safe_write.h"
+#include "../inc/tail_tags.h"
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 // Genres list could be added here or in utils
 
-Status read_id3v1_tag(const char *filepath, ID3v1_Tag *tag) {
-  FILE *fp = fopen(filepath, "rb");
-  if (!fp) {
-    return ERROR_FILE_OPEN;
-  }
-
-  // Seek to end - 128 bytes
-  if (fseek(fp, -128, SEEK_END) != 0) {
-    fclose(fp);
-    return ERROR_INVALID_FORMAT; // File likely too small
-  }
-
-  char buffer[128];
-  if (fread(buffer, 1, 128, fp) != 128) {
-    fclose(fp);
-    return ERROR_INVALID_FORMAT;
-  }
-  fclose(fp);
-
+Status parse_id3v1_tag(const unsigned char buffer[128], ID3v1_Tag *tag) {
   // Check for "TAG"
-  if (strncmp(buffer, "TAG", 3) != 0) {
+  if (strncmp((const char *)buffer, "TAG", 3) != 0) {
     return ERROR_TAG_NOT_FOUND;
   }
 
@@ -60,94 +51,101 @@ Status read_id3v1_tag(const char *filepath, ID3v1_Tag *tag) {
   return SUCCESS;
 }
 
-Status write_id3v1_tag(const char *filepath, const ID3v1_Tag *tag) {
-  if (!filepath || !tag)
-    return ERROR_INVALID_FORMAT; // Invalid args
-
-  FILE *fp = fopen(filepath, "r+b"); // Read/Update binary
-  if (!fp)
-    return ERROR_FILE_OPEN;
-
-  // Check if file has existing tag
-  fseek(fp, 0, SEEK_END);
-  long filesize = ftell(fp);
-  int has_tag = 0;
-
-  if (filesize >= 128) {
-    fseek(fp, -128, SEEK_END);
-    char header[3];
-    if (fread(header, 1, 3, fp) == 3 && strncmp(header, "TAG", 3) == 0) {
-      has_tag = 1;
-    }
-  }
-
-  // Prepare buffer
-  char buffer[128];
+void encode_id3v1_tag(const ID3v1_Tag *tag, unsigned char buffer[128]) {
   memset(buffer, 0, 128);
-  strncpy(buffer, "TAG", 3);
-
-  // Helper to copy and pad with nulls/spaces (spec says 0-filled usually, but
-  // space is common too. we use 0) strncpy pads with 0 if src is shorter than
-  // n.
-  strncpy(buffer + 3, tag->title, 30);
-  strncpy(buffer + 33, tag->artist, 30);
-  strncpy(buffer + 63, tag->album, 30);
-  strncpy(buffer + 93, tag->year, 4);
-  strncpy(buffer + 97, tag->comment, 30);
+  memcpy(buffer, "TAG", 3);
+
+  // Fields are 0-filled (spaces are common too): the buffer is already
+  // zeroed, so only the characters are copied, without a terminator
+  memcpy(buffer + 3, tag->title, strnlen(tag->title, 30));
+  memcpy(buffer + 33, tag->artist, strnlen(tag->artist, 30));
+  memcpy(buffer + 63, tag->album, strnlen(tag->album, 30));
+  memcpy(buffer + 93, tag->year, strnlen(tag->year, 4));
+  memcpy(buffer + 97, tag->comment, strnlen(tag->comment, 30));
   buffer[127] = tag->genre;
+}
 
-  // Write
-  if (has_tag) {
-    fseek(fp, -128, SEEK_END);
-  } else {
-    fseek(fp, 0, SEEK_END); // Append
+void merge_id3v1_update(ID3v1_Tag *tag, const TagUpdate *update,
+                        int had_tag) {
+  if (!had_tag) {
+    tag->genre = 12; // Other
   }
+  if (update->title)
+    strncpy(tag->title, update->title, 30);
+  if (update->artist)
+    strncpy(tag->artist, update->artist, 30);
+  if (update->album)
+    strncpy(tag->album, update->album, 30);
+  if (update->year)
+    strncpy(tag->year, update->year, 4);
+  if (update->comment)
+    strncpy(tag->comment, update->comment, 30);
+  if (update->genre)
+    tag->genre = (uint8_t)atoi(update->genre);
+}
 
-  if (fwrite(buffer, 1, 128, fp) != 128) {
-    fclose(fp);
-    return ERROR_FILE_OPEN; // Write error
+Status read_id3v1_tag(const char *filepath, ID3v1_Tag *tag) {
+  int fd = open(filepath, O_RDONLY);
+  if (fd < 0)
+    return ERROR_FILE_OPEN;
+  struct stat st;
+  TailTags tail;
+  if (fstat(fd, &st) != 0 || st.st_size < 128 ||
+      probe_tail_tags(fd, st.st_size, 0, &tail) != SUCCESS) {
+    close(fd);
+    return ERROR_INVALID_FORMAT; // File likely too small
   }
+  close(fd);
+  return read_id3v1_from_tail(&tail, tag);
+}
+
+Status read_id3v1_from_tail(const TailTags *tail, ID3v1_Tag *tag) {
+  // Usually the last 128 bytes, but APEv2, Lyrics3 or an appended ID3v2 tag
+  // may follow it
+  if (tail->v1_index < 0)
+    return ERROR_TAG_NOT_FOUND;
+  return parse_id3v1_tag(tail->v1, tag);
+}
 
-  fclose(fp);
+Status write_id3v1_update(int fd, off_t size, const TagUpdate *update) {
+  // The existing tag, wherever it sits among the trailers
+  TailTags tail;
+  int has_tag = probe_tail_tags(fd, size, 0, &tail) == SUCCESS &&
+                tail.v1_index >= 0;
+  ID3v1_Tag tag;
+  memset(&tag, 0, sizeof(ID3v1_Tag));
+  if (has_tag && parse_id3v1_tag(tail.v1, &tag) != SUCCESS)
+    has_tag = 0;
+  merge_id3v1_update(&tag, update, has_tag);
+
+  unsigned char buffer[128];
+  encode_id3v1_tag(&tag, buffer);
+  off_t at = has_tag ? tail.blocks[tail.v1_index].offset : size; // Or append
+  if (pwrite(fd, buffer, 128, at) != 128)
+    return ERROR_WRITE_FAILED;
+  io_charge_write(128);
   return SUCCESS;
 }
 
 Status remove_id3v1_tag(const char *filepath) {
-  FILE *fp = fopen(filepath, "r+b");
-  if (!fp)
-    return ERROR_FILE_OPEN;
-  fseek(fp, 0, SEEK_END);
-  long size = ftell(fp);
-  if (size < 128) {
-    fclose(fp);
+  SafeWrite sw;
+  Status status = safe_write_begin(&sw, filepath);
+  if (status != SUCCESS)
+    return status;
+  TailTags tail;
+  if (probe_tail_tags(sw.fd, sw.size, 0, &tail) != SUCCESS ||
+      tail.v1_index < 0) {
+    safe_write_abort(&sw); // No tag
     return SUCCESS;
   }
-  fseek(fp, -128, SEEK_END);
-  char hdr[3];
-  if (fread(hdr, 1, 3, fp) == 3 && strncmp(hdr, "TAG", 3) == 0) {
-    fclose(fp);
-    // On Windows, truncating is tricky with stdio.
-    // We'll use a simpler approach: recreate file without last 128 bytes if it
-    // has TAG.
-    char tmp[512];
-    sprintf(tmp, "%s.v1tmp", filepath);
-    FILE *fin = fopen(filepath, "rb");
-    FILE *fout = fopen(tmp, "wb");
-    unsigned char b[8192];
-    long to_copy = size - 128;
-    while (to_copy > 0) {
-      size_t r = fread(b, 1, to_copy > 8192 ? 8192 : to_copy, fin);
-      if (r <= 0)
-        break;
-      fwrite(b, 1, r, fout);
-      to_copy -= r;
-    }
-    fclose(fin);
-    fclose(fout);
-    remove(filepath);
-    rename(tmp, filepath);
-  } else {
-    fclose(fp);
+  // Rebuild without the 128 bytes of the tag, keeping any other trailers
+  off_t tag = tail.blocks[tail.v1_index].offset;
+  status = copy_file_bytes(sw.fd, 0, tag, sw.tmp_fd);
+  if (status == SUCCESS)
+    status = copy_file_bytes(sw.fd, tag + 128, sw.size - tag - 128, sw.tmp_fd);
+  if (status != SUCCESS) {
+    safe_write_abort(&sw);
+    return status;
   }
-  return SUCCESS;
+  return safe_write_commit(&sw);
 }
@@ -1,10 +1,19 @@
 #include "../inc/id3_v2.h"
+#include "../inc/file_util.h"
+#include "../inc/id3_unsync.h"
+#include "../inc/io_budget.h"
+#include "../inc/tail_tags.h"
+#include "../inc/trace.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Helper to decode synchsafe integer (4 bytes, 7 bits each)
-static int decode_synchsafe(unsigned char *bytes) {
+static int decode_synchsafe(const unsigned char *bytes) {
   return (bytes[0] << 21) | (bytes[1] << 14) | (bytes[2] << 7) | bytes[3];
 }
 
@@ -25,7 +34,7 @@ static void encode_int(int value, unsigned char *bytes) {
 }
 
 // Helper to decode integer
-static int decode_int(unsigned char *bytes) {
+static int decode_int(const unsigned char *bytes) {
   return (bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
 }
 
@@ -68,6 +77,12 @@ static char *sanitize_string(const char *raw, int len, int encoding) {
   return clean;
 }
 
+char *decode_id3v2_text(const unsigned char *body, uint32_t size) {
+  if (size < 2)
+    return NULL;
+  return sanitize_string((const char *)body + 1, (int)size - 1, body[0]);
+}
+
 void free_id3v2_content(ID3v2_Content *content) {
   if (content->title)
     free(content->title);
@@ -93,40 +108,195 @@ void free_id3v2_content(ID3v2_Content *content) {
     free(content->image.mime_type);
   if (content->image.data)
     free(content->image.data);
+  chapter_table_free(&content->chapters);
   memset(content, 0, sizeof(ID3v2_Content));
 }
 
-Status read_id3v2_tag(const char *filepath, ID3v2_Content *content) {
-  if (!filepath || !content)
-    return ERROR_INVALID_FORMAT;
-  FILE *fp = fopen(filepath, "rb");
-  if (!fp)
-    return ERROR_FILE_OPEN;
+static uint32_t frame_cap = ID3V2_DEFAULT_FRAME_CAP;
+static size_t mem_budget = ID3V2_DEFAULT_MEM_BUDGET;
+static int load_pictures = 1;
 
-  unsigned char header[10];
-  if (fread(header, 1, 10, fp) != 10) {
-    fclose(fp);
-    return ERROR_INVALID_FORMAT;
+void set_id3v2_memory_limits(uint32_t cap, size_t budget) {
+  frame_cap = cap;
+  mem_budget = budget;
+}
+
+void set_id3v2_picture_loading(int load) { load_pictures = load; }
+
+// Move past n bytes: a seek on files, a read-and-discard on pipes
+static int skip_bytes(FILE *fp, off_t n, int seekable) {
+  if (n <= 0)
+    return 1;
+  if (seekable)
+    return fseeko(fp, n, SEEK_CUR) == 0;
+  unsigned char skip[4096];
+  while (n > 0) {
+    size_t chunk = n > (off_t)sizeof(skip) ? sizeof(skip) : (size_t)n;
+    if (fread(skip, 1, chunk, fp) != chunk)
+      return 0;
+    n -= chunk;
   }
+  return 1;
+}
 
-  if (strncmp((char *)header, "ID3", 3) != 0) {
-    fclose(fp);
-    return ERROR_TAG_NOT_FOUND;
+// Bytes of an APIC frame read up front: enough for MIME type, picture type
+// and description; the picture itself is read or skipped separately
+#define PIC_PREFIX_SIZE 1024
+// Read of a chapter frame left in the file, for its index entry and title
+#define CHAP_PREFIX_SIZE 256
+
+// Parse the APIC/PIC frame whose first `load` bytes are in data. The picture
+// is loaded only if it fits the frame cap and the file's memory budget;
+// otherwise its file offset is recorded (seekable input) so writers can copy
+// it straight from the file. Returns the picture bytes consumed from fp.
+static Status parse_picture(FILE *fp, const unsigned char *data, uint32_t load,
+                            uint32_t frame_size, off_t body_offset,
+                            int major_version, int seekable, size_t *mem_used,
+                            ID3v2_Content *content, uint32_t *consumed) {
+  *consumed = 0;
+  uint32_t offset;
+  if (major_version == 2) {
+    if (load < 5)
+      return SUCCESS;
+    char fmt[4] = {(char)data[1], (char)data[2], (char)data[3], '\0'};
+    content->image.mime_type = strdup(fmt); // For v2.2 this is 3-char format
+    offset = 4;
+  } else {
+    const unsigned char *end = memchr(data + 1, 0, load - 1);
+    if (!end || (uint32_t)(end - data) + 1 >= load)
+      return SUCCESS; // MIME type runs past what was read
+    content->image.mime_type = strdup((const char *)data + 1);
+    offset = (uint32_t)(end - data) + 1;
+  }
+  content->image.type = data[offset++];
+  int enc = data[0];
+  uint32_t step = (enc == 1 || enc == 2) ? 2 : 1;
+  uint32_t d_end = offset;
+  while (d_end < load) {
+    if (data[d_end] == 0 &&
+        (step == 1 || (d_end + 1 < load && data[d_end + 1] == 0)))
+      break;
+    d_end += step;
+  }
+  content->image.description =
+      sanitize_string((const char *)data + offset, d_end - offset, enc);
+  uint32_t img_start = d_end + step;
+  if (img_start >= frame_size)
+    return SUCCESS;
+
+  uint32_t size = frame_size - img_start;
+  uint32_t in_prefix = img_start < load ? load - img_start : 0;
+  content->image.size = size;
+  if ((load_pictures || !seekable) && size <= frame_cap &&
+      *mem_used + size <= mem_budget) {
+    content->image.data = (unsigned char *)malloc(size);
+    if (!content->image.data)
+      return ERROR_MEM_ALLOC;
+    memcpy(content->image.data, data + img_start, in_prefix);
+    if (fread(content->image.data + in_prefix, 1, size - in_prefix, fp) !=
+        size - in_prefix)
+      return ERROR_INVALID_FORMAT;
+    *mem_used += size;
+    *consumed = size - in_prefix;
+  } else if (seekable) {
+    content->image.data_offset = body_offset + img_start;
+  } else {
+    // A pipe cannot be revisited, and holding the picture would break the
+    // memory budget
+    return ERROR_MEM_ALLOC;
   }
+  return SUCCESS;
+}
 
-  int major_version = header[3];
-  content->major_version = major_version;
-  int tag_size = decode_synchsafe(&header[6]);
-  long end_pos = 10 + tag_size;
+// Bytes the frame's format flags put ahead of its content: a grouping
+// identity, a v2.4 data length indicator. -1 for compressed or encrypted
+// content, which is not decoded.
+static int frame_prefix_length(const unsigned char fh[10], int major_version) {
+  if (major_version == 3) {
+    if (fh[9] & 0xC0)
+      return -1;
+    return (fh[9] & 0x20) ? 1 : 0;
+  }
+  if (major_version == 4) {
+    if (fh[9] & 0x0C)
+      return -1;
+    return ((fh[9] & 0x40) ? 1 : 0) + ((fh[9] & 0x01) ? 4 : 0);
+  }
+  return 0;
+}
+
+// The content field a text frame fills, or NULL for text that is not kept
+static char **text_field(ID3v2_Content *content, const char *id) {
+  if (strcmp(id, "TIT2") == 0)
+    return &content->title;
+  if (strcmp(id, "TPE1") == 0)
+    return &content->artist;
+  if (strcmp(id, "TALB") == 0)
+    return &content->album;
+  if (strcmp(id, "TYER") == 0 || strcmp(id, "TDRC") == 0)
+    return &content->year;
+  if (strcmp(id, "TRCK") == 0)
+    return &content->track;
+  if (strcmp(id, "TCON") == 0)
+    return &content->genre;
+  return NULL;
+}
+
+// The text_lost bit of a kept field, or of the comment for NULL
+static unsigned lost_bit(const ID3v2_Content *content, char *const *field) {
+  if (field == &content->title)
+    return ID3V2_LOST_TITLE;
+  if (field == &content->artist)
+    return ID3V2_LOST_ARTIST;
+  if (field == &content->album)
+    return ID3V2_LOST_ALBUM;
+  if (field == &content->year)
+    return ID3V2_LOST_YEAR;
+  if (field == &content->genre)
+    return ID3V2_LOST_GENRE;
+  if (field == &content->track)
+    return ID3V2_LOST_TRACK;
+  return ID3V2_LOST_COMMENT;
+}
 
-  while (ftell(fp) < end_pos) {
+static size_t string_size(const char *s) { return s ? strlen(s) + 1 : 0; }
+
+// A chapter frame that is not held in memory goes back into a rewritten tag
+// by copying it from the file, which only works for an ID3v2.3 frame in a
+// file that can be revisited. Any other is lost, and the table says so.
+static void keep_chapter_in_file(ChapterTable *table, off_t offset,
+                                 uint32_t size, int referable) {
+  if (!referable || chapter_table_add_ref(table, offset, size) != SUCCESS)
+    table->lost = 1;
+}
+
+// Parses the frames of a tag body of tag_size bytes from the current stream
+// position. Position is tracked by count rather than ftell() so that the same
+// loop works on pipes. At most frame_cap bytes of any frame are held in memory
+// and the total stays within mem_budget. body_base is the file offset of the
+// first frame, for pictures left in place. *consumed receives the number of
+// body bytes read.
+static Status parse_id3v2_frames(FILE *fp, off_t tag_size, int major_version,
+                                 int tag_flags, int seekable, off_t body_base,
+                                 ID3v2_Content *content, off_t *consumed) {
+  off_t pos = 0;
+  size_t mem_used = 0;
+  Status status = SUCCESS;
+  unsigned char *data = NULL;
+  int referable = seekable && major_version == 3;
+
+  while (pos < tag_size) {
+    TRACE_BEGIN(frame_start);
     char frame_id[5] = {0};
-    int frame_size = 0;
+    uint32_t frame_size = 0;
     int header_size = (major_version == 2) ? 6 : 10;
 
     unsigned char frame_header[10];
-    if (fread(frame_header, 1, header_size, fp) != (size_t)header_size)
+    if (pos + header_size > tag_size ||
+        fread(frame_header, 1, header_size, fp) != (size_t)header_size)
       break;
+    off_t frame_offset = body_base + pos;
+    pos += header_size;
 
     if (frame_header[0] == 0)
       break; // Padding
@@ -138,21 +308,36 @@ Status read_id3v2_tag(const char *filepath, ID3v2_Content *content) {
     } else {
       memcpy(frame_id, frame_header, 4);
       if (major_version == 4)
-        frame_size = decode_synchsafe(&frame_header[4]);
+        frame_size = (uint32_t)decode_synchsafe(&frame_header[4]);
       else
-        frame_size = decode_int(&frame_header[4]);
+        frame_size = (uint32_t)decode_int(&frame_header[4]);
     }
 
-    if (frame_size <= 0 || (ftell(fp) + frame_size) > end_pos)
-      break;
-
-    unsigned char *data = (unsigned char *)malloc(frame_size);
-    if (!data)
-      break;
-    if (fread(data, 1, frame_size, fp) != (size_t)frame_size) {
-      free(data);
+    if (frame_size == 0 || pos + frame_size > tag_size)
       break;
+    uint32_t frame_total = (uint32_t)header_size + frame_size;
+    int is_chap =
+        strcmp(frame_id, "CHAP") == 0 || strcmp(frame_id, "CTOC") == 0;
+
+    // v2.4 unsynchronises frame by frame; the tag flag marks every frame
+    int unsync = major_version == 4 &&
+                 ((frame_header[9] & 0x02) || (tag_flags & 0x80));
+    int prefix = frame_prefix_length(frame_header, major_version);
+    if (prefix < 0 || (uint32_t)prefix >= frame_size) {
+      // A compressed or encrypted chapter cannot be indexed, only kept
+      if (prefix < 0 && is_chap)
+        keep_chapter_in_file(&content->chapters, frame_offset, frame_total,
+                             referable);
+      if (!skip_bytes(fp, frame_size, seekable))
+        break;
+      pos += frame_size;
+      TRACE_END(frame_start, "frame", frame_id, frame_size);
+      continue;
     }
+    if (!skip_bytes(fp, prefix, seekable))
+      break;
+    pos += prefix;
+    frame_size -= (uint32_t)prefix;
 
     // Map v2.2 IDs to v2.3 equivalents for logic consistency
     char mapped_id[5];
@@ -176,244 +361,657 @@ Status read_id3v2_tag(const char *filepath, ID3v2_Content *content) {
         strcpy(mapped_id, "APIC");
     }
 
-    if (mapped_id[0] == 'T' && strcmp(mapped_id, "TXXX") != 0) {
-      char *text = sanitize_string((char *)data + 1, frame_size - 1, data[0]);
-      if (strcmp(mapped_id, "TIT2") == 0)
-        content->title = text;
-      else if (strcmp(mapped_id, "TPE1") == 0)
-        content->artist = text;
-      else if (strcmp(mapped_id, "TALB") == 0)
-        content->album = text;
-      else if (strcmp(mapped_id, "TYER") == 0 || strcmp(mapped_id, "TDRC") == 0)
-        content->year = text;
-      else if (strcmp(mapped_id, "TRCK") == 0)
-        content->track = text;
-      else if (strcmp(mapped_id, "TCON") == 0)
-        content->genre = text;
-      else
-        free(text);
-    } else if (strcmp(mapped_id, "COMM") == 0) {
-      if (frame_size >= 4) {
+    // Only the part of the frame that is needed is held in memory: a prefix
+    // of pictures, and at most frame_cap bytes of anything else. An
+    // unsynchronised picture is decoded in memory, so it is loaded whole.
+    int is_pic = strcmp(mapped_id, "APIC") == 0;
+    int is_comm = strcmp(mapped_id, "COMM") == 0;
+    char **field = mapped_id[0] == 'T' ? text_field(content, mapped_id) : NULL;
+    // Frames that would add nothing are skipped unread: text this reader
+    // does not keep and repeats of a field it has (the first wins). A
+    // comment is only replaced by one without a description.
+    int wanted = is_pic || is_chap || (field && !*field) ||
+                 (is_comm && (!content->lang || content->comment_desc));
+    uint32_t load = frame_size;
+    if (is_pic && !unsync && load > PIC_PREFIX_SIZE)
+      load = PIC_PREFIX_SIZE;
+    else if (!is_pic && load > frame_cap)
+      load = frame_cap;
+    if (is_pic && unsync && !content->image.mime_type &&
+        (load > frame_cap || mem_used + load > mem_budget)) {
+      // Its encoded bytes in the file are no use to a writer either
+      status = ERROR_MEM_ALLOC;
+      break;
+    }
+    if (is_chap && (load < frame_size || mem_used + load > mem_budget)) {
+      // Too large to hold: indexed from its first bytes, left in the file
+      unsigned char head[CHAP_PREFIX_SIZE];
+      uint32_t got =
+          frame_size < CHAP_PREFIX_SIZE ? frame_size : CHAP_PREFIX_SIZE;
+      if (fread(head, 1, got, fp) != got)
+        break;
+      pos += got;
+      if (strcmp(mapped_id, "CHAP") == 0) {
+        uint32_t len = got;
+        if (unsync) {
+          int after_ff = 0;
+          len = (uint32_t)id3v2_resync(head, got, &after_ff);
+        }
+        if (chapter_table_index(&content->chapters, head, len,
+                                major_version) == SUCCESS)
+          mem_used += len;
+      }
+      keep_chapter_in_file(&content->chapters, frame_offset, frame_total,
+                           referable);
+      if (!skip_bytes(fp, frame_size - got, seekable))
+        break;
+      pos += frame_size - got;
+      TRACE_END(frame_start, "frame", frame_id, frame_size);
+      continue;
+    }
+    // Text or a comment held short, or not at all, cannot be written back
+    if (wanted && (field || is_comm) &&
+        (load < frame_size || mem_used + load > mem_budget))
+      content->text_lost |= lost_bit(content, field);
+    if (!wanted || (is_pic && content->image.mime_type) ||
+        mem_used + load > mem_budget) {
+      // Only the first picture is kept; over-budget frames are skipped
+      if (!skip_bytes(fp, frame_size, seekable))
+        break;
+      pos += frame_size;
+      TRACE_END(frame_start, "frame", frame_id, frame_size);
+      continue;
+    }
+
+    data = (unsigned char *)malloc(load);
+    if (!data) {
+      status = ERROR_MEM_ALLOC;
+      break;
+    }
+    if (fread(data, 1, load, fp) != load)
+      break;
+    off_t body_offset = body_base + pos;
+    pos += load;
+    uint32_t remaining = frame_size - load;
+    int data_len = (int)load;
+    if (unsync) {
+      int after_ff = 0;
+      data_len = (int)id3v2_resync(data, load, &after_ff);
+    }
+
+    if (field) {
+      *field = sanitize_string((char *)data + 1, data_len - 1, data[0]);
+      mem_used += string_size(*field);
+    } else if (is_comm) {
+      if (data_len >= 4) {
         int enc = data[0];
-        char lang[4] = {(char)data[1], (char)data[2], (char)data[3], '\0'};
-        content->lang = strdup(lang);
         int step = (enc == 1 || enc == 2) ? 2 : 1;
         int d_end = 4;
-        while (d_end < frame_size) {
+        while (d_end < data_len) {
           if (data[d_end] == 0 &&
-              (step == 1 || (d_end + 1 < frame_size && data[d_end + 1] == 0)))
+              (step == 1 || (d_end + 1 < data_len && data[d_end + 1] == 0)))
             break;
           d_end += step;
         }
-        content->comment_desc =
-            sanitize_string((char *)data + 4, d_end - 4, enc);
-        int text_start = d_end + step;
-        if (text_start < frame_size)
-          content->comment = sanitize_string((char *)data + text_start,
-                                             frame_size - text_start, enc);
+        char *desc = sanitize_string((char *)data + 4, d_end - 4, enc);
+        if (!content->lang || !desc) {
+          // Replaces the described comment kept so far, if any
+          mem_used -= string_size(content->lang) +
+                      string_size(content->comment_desc) +
+                      string_size(content->comment);
+          free(content->lang);
+          free(content->comment_desc);
+          free(content->comment);
+          char lang[4] = {(char)data[1], (char)data[2], (char)data[3], '\0'};
+          content->lang = strdup(lang);
+          content->comment_desc = desc;
+          content->comment = NULL;
+          int text_start = d_end + step;
+          if (text_start < data_len)
+            content->comment = sanitize_string((char *)data + text_start,
+                                               data_len - text_start, enc);
+          mem_used += string_size(content->lang) + string_size(desc) +
+                      string_size(content->comment);
+        } else {
+          free(desc);
+        }
       }
-    } else if (strcmp(mapped_id, "APIC") == 0) {
+    } else if (is_pic) {
       // APIC: Enc(1) Mime(n+1) Type(1) Desc(n+0/1) Data(bin)
       // PIC: Enc(1) Format(3) Type(1) Desc(n+0/1) Data(bin)
-      int offset = 1;
-      if (major_version == 2) {
-        char fmt[4] = {(char)data[1], (char)data[2], (char)data[3], '\0'};
-        content->image.mime_type =
-            strdup(fmt); // For v2.2 this is 3-char format
-        offset = 4;
-      } else {
-        content->image.mime_type = strdup((char *)data + 1);
-        offset = 1 + strlen(content->image.mime_type) + 1;
-      }
-      content->image.type = data[offset++];
-      int enc = data[0];
-      int step = (enc == 1 || enc == 2) ? 2 : 1;
-      int d_end = offset;
-      while (d_end < frame_size) {
-        if (data[d_end] == 0 &&
-            (step == 1 || (d_end + 1 < frame_size && data[d_end + 1] == 0)))
-          break;
-        d_end += step;
-      }
-      content->image.description =
-          sanitize_string((char *)data + offset, d_end - offset, enc);
-      int img_start = d_end + step;
-      if (img_start < frame_size) {
-        content->image.size = frame_size - img_start;
-        content->image.data = (unsigned char *)malloc(content->image.size);
-        if (content->image.data)
-          memcpy(content->image.data, data + img_start, content->image.size);
-      }
+      uint32_t read_on = 0;
+      uint32_t size = unsync ? (uint32_t)data_len : frame_size;
+      status = parse_picture(fp, data, (uint32_t)data_len, size, body_offset,
+                             major_version, seekable, &mem_used, content,
+                             &read_on);
+      pos += read_on;
+      remaining -= read_on;
+      if (status != SUCCESS)
+        break;
+    } else if (is_chap) {
+      // Held whole for the rewrite; a malformed frame is left out
+      Status added = chapter_table_add(&content->chapters, mapped_id, data,
+                                       (uint32_t)data_len, major_version);
+      if (added == SUCCESS)
+        mem_used += (size_t)data_len;
+      else if (added == ERROR_MEM_ALLOC)
+        content->chapters.lost = 1;
     }
     free(data);
+    data = NULL;
+
+    if (!skip_bytes(fp, remaining, seekable))
+      break;
+    pos += remaining;
+    TRACE_END(frame_start, "frame", frame_id, frame_size);
   }
-  fclose(fp);
-  return SUCCESS;
+  free(data);
+  chapter_table_sort(&content->chapters);
+  *consumed = pos;
+  return status;
 }
 
-static void write_frame(FILE *fp, const char *id, const char *value) {
-  if (!value)
-    return;
-  int len = strlen(value) + 1; // +1 for encoding byte
-  unsigned char header[10];
-  memcpy(header, id, 4);
-  encode_int(len, &header[4]);
-  header[8] = 0;
-  header[9] = 0; // Flags
-  fwrite(header, 1, 10, fp);
-  unsigned char enc = 0; // ISO-8859-1
-  fwrite(&enc, 1, 1, fp);
-  fwrite(value, 1, len - 1, fp);
-}
-
-Status write_id3v2_tag(const char *filepath, const TagUpdate *update) {
-  // Simplified version: Read existing tags, update them, and write a new tag at
-  // the beginning. Real implementation needs to preserve other frames. For this
-  // project, we'll implement a robust version that preserves existing frames if
-  // possible.
-
-  ID3v2_Content content;
-  memset(&content, 0, sizeof(ID3v2_Content));
-  read_id3v2_tag(filepath, &content); // Get current values
-
-  // Use a temporary file to rebuild
-  char tmp_path[512];
-  sprintf(tmp_path, "%s.tmp", filepath);
-  FILE *fout = fopen(tmp_path, "wb");
-  if (!fout)
-    return ERROR_FILE_OPEN;
-
-  // Write ID3v2.3 Header (fixed size for now)
-  // We'll calculate size later or use a buffer. Let's use a memory buffer.
-  unsigned char *tag_buf = (unsigned char *)malloc(1024 * 1024); // 1MB buffer
-  if (!tag_buf) {
-    fclose(fout);
-    return ERROR_MEM_ALLOC;
+// Parses the body of the tag whose header was just read from fp, honouring
+// the header flags. *consumed receives the number of body bytes read from fp.
+static Status parse_id3v2_body(FILE *fp, const unsigned char header[10],
+                               int seekable, ID3v2_Content *content,
+                               off_t *consumed) {
+  int major_version = header[3];
+  int flags = header[5];
+  off_t tag_size = decode_synchsafe(&header[6]);
+  *consumed = 0;
+  if (major_version == 2 && (flags & 0x40))
+    return SUCCESS; // v2.2 compression: no scheme was ever defined
+
+  // Before v2.4 unsynchronisation covers the whole body, frame headers
+  // included, so frames are parsed from the decoded stream. Positions in it
+  // no longer match the file, which rules out leaving pictures in place.
+  FILE *in = fp;
+  ResyncSource src;
+  if (major_version < 4 && (flags & 0x80)) {
+    in = open_resync_stream(&src, fp, tag_size);
+    if (!in)
+      return ERROR_MEM_ALLOC;
+    seekable = 0;
   }
 
-  FILE *fmem = tmpfile(); // Use temp file as buffer
-  if (!fmem) {
-    free(tag_buf);
-    fclose(fout);
-    return ERROR_MEM_ALLOC;
+  Status status = SUCCESS;
+  off_t skipped = 0;
+  if (flags & 0x40) {
+    // Extended header: v2.3 gives its size without the size field, v2.4
+    // (synchsafe) with it
+    unsigned char b[4];
+    off_t rest = -1;
+    if (fread(b, 1, 4, in) == 4)
+      rest = major_version == 4 ? (off_t)decode_synchsafe(b) - 4
+                                : (off_t)(uint32_t)decode_int(b);
+    if (rest < 0 || 4 + rest > tag_size || !skip_bytes(in, rest, seekable))
+      status = ERROR_INVALID_FORMAT;
+    skipped = 4 + rest;
   }
 
-  // Write updated or existing frames
-  write_frame(fmem, "TIT2", update->title ? update->title : content.title);
-  write_frame(fmem, "TPE1", update->artist ? update->artist : content.artist);
-  write_frame(fmem, "TALB", update->album ? update->album : content.album);
-  write_frame(fmem, "TYER", update->year ? update->year : content.year);
-  write_frame(fmem, "TCON", update->genre ? update->genre : content.genre);
-  write_frame(fmem, "TRCK", update->track ? update->track : content.track);
-  write_frame(fmem, "COMM",
-              update->comment ? update->comment : content.comment);
-
-  // Handle image if it exists in current content (preserving it)
-  if (content.image.size > 0) {
-    unsigned char img_hdr[10];
-    memcpy(img_hdr, "APIC", 4);
-    int img_frame_size =
-        1 + strlen(content.image.mime_type) + 1 + 1 +
-        (content.image.description ? strlen(content.image.description) : 0) +
-        1 + content.image.size;
-    encode_int(img_frame_size, &img_hdr[4]);
-    img_hdr[8] = 0;
-    img_hdr[9] = 0;
-    fwrite(img_hdr, 1, 10, fmem);
-    unsigned char enc = 0;
-    fwrite(&enc, 1, 1, fmem);
-    fwrite(content.image.mime_type, 1, strlen(content.image.mime_type) + 1,
-           fmem);
-    fwrite(&content.image.type, 1, 1, fmem);
-    if (content.image.description)
-      fwrite(content.image.description, 1, strlen(content.image.description),
-             fmem);
-    unsigned char zero = 0;
-    fwrite(&zero, 1, 1, fmem);
-    fwrite(content.image.data, 1, content.image.size, fmem);
+  off_t pos = 0;
+  if (status == SUCCESS) {
+    off_t base = seekable ? ftello(in) : 0;
+    status = parse_id3v2_frames(in, tag_size - skipped, major_version, flags,
+                                seekable, base, content, &pos);
   }
+  if (in != fp) {
+    fclose(in);
+    *consumed = tag_size - src.left;
+  } else {
+    *consumed = skipped + pos;
+  }
+  return status;
+}
+
+off_t id3v2_tag_length(const unsigned char header[10]) {
+  if (strncmp((const char *)header, "ID3", 3) != 0)
+    return 0;
+  off_t length = 10 + (off_t)decode_synchsafe(&header[6]);
+  if (header[3] == 4 && (header[5] & 0x10))
+    length += 10; // v2.4 footer
+  return length;
+}
 
-  long frames_size = ftell(fmem);
-  rewind(fmem);
-
-  // Write Header to real temp file
-  unsigned char id3_hdr[10] = {'I', 'D', '3', 3, 0, 0, 0, 0, 0, 0};
-  encode_synchsafe(frames_size, &id3_hdr[6]);
-  fwrite(id3_hdr, 1, 10, fout);
-
-  // Copy frames from fmem to fout
-  size_t n;
-  while ((n = fread(tag_buf, 1, 1024 * 1024, fmem)) > 0)
-    fwrite(tag_buf, 1, n, fout);
-  fclose(fmem);
-  free(tag_buf);
-
-  // Copy audio data
-  FILE *fin = fopen(filepath, "rb");
-  if (!fin) {
-    fclose(fout);
-    remove(tmp_path);
+Status read_id3v2_tag(const char *filepath, ID3v2_Content *content) {
+  return read_id3v2_tag_tail(filepath, NULL, content);
+}
+
+Status read_id3v2_tag_tail(const char *filepath, const TailTags *tail,
+                           ID3v2_Content *content) {
+  if (!filepath || !content)
+    return ERROR_INVALID_FORMAT;
+  TRACE_BEGIN(read_start);
+  FILE *fp = fopen(filepath, "rb");
+  if (!fp)
     return ERROR_FILE_OPEN;
-  }
+  TRACE_MARK("open", filepath, 0);
 
-  // Skip old tag
-  unsigned char old_hdr[10];
-  if (fread(old_hdr, 1, 10, fin) == 10 &&
-      strncmp((char *)old_hdr, "ID3", 3) == 0) {
-    int old_size = decode_synchsafe(&old_hdr[6]);
-    fseek(fin, 10 + old_size, SEEK_SET);
-  } else {
-    rewind(fin);
+  TRACE_BEGIN(header_start);
+  unsigned char header[10];
+  if (fread(header, 1, 10, fp) != 10) {
+    fclose(fp);
+    return ERROR_INVALID_FORMAT;
   }
 
-  // Copy rest of file
-  unsigned char copy_buf[8192];
-  while ((n = fread(copy_buf, 1, 8192, fin)) > 0) {
-    // If we reach the end, check for ID3v1 to decide whether to copy it
-    // Actually, SRS says "handle all ID3 versions", so we keep ID3v1 as is or
-    // update it too. Let's just copy everything until the end.
-    fwrite(copy_buf, 1, n, fout);
+  if (strncmp((char *)header, "ID3", 3) != 0) {
+    // No leading tag: use one appended to the end (ID3v2.4 with footer)
+    const TailBlock *appended = NULL;
+    TailTags probed;
+    if (tail)
+      appended = find_tail_block(tail, TAIL_ID3V2);
+    else if (fseeko(fp, 0, SEEK_END) == 0 &&
+             probe_tail_tags(fileno(fp), ftello(fp), 0, &probed) == SUCCESS)
+      appended = find_tail_block(&probed, TAIL_ID3V2);
+    if (!appended || fseeko(fp, appended->offset, SEEK_SET) != 0 ||
+        fread(header, 1, 10, fp) != 10) {
+      fclose(fp);
+      return ERROR_TAG_NOT_FOUND;
+    }
   }
 
-  fclose(fin);
-  fclose(fout);
-  free_id3v2_content(&content);
+  content->major_version = header[3];
+  TRACE_END(header_start, "tag_header", filepath, decode_synchsafe(&header[6]));
+  off_t consumed;
+  Status status = parse_id3v2_body(fp, header, 1, content, &consumed);
+  fclose(fp);
+  io_charge_read(10 + (uint64_t)consumed);
+  TRACE_END(read_start, "read_id3v2_tag", filepath, consumed);
+  return status;
+}
 
-  // Replace original file
-  remove(filepath);
-  rename(tmp_path, filepath);
+Status read_id3v2_stream(FILE *fp, const unsigned char header[10],
+                         ID3v2_Content *content) {
+  if (!fp || !header || !content)
+    return ERROR_INVALID_FORMAT;
+  if (strncmp((const char *)header, "ID3", 3) != 0)
+    return ERROR_TAG_NOT_FOUND;
 
+  content->major_version = header[3];
+  // Pictures over the frame cap can be left in place only if the stream is a
+  // regular file that the writer can read again
+  struct stat st;
+  int seekable = fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode);
+  off_t tag_size = decode_synchsafe(&header[6]);
+  off_t pos;
+  Status status = parse_id3v2_body(fp, header, seekable, content, &pos);
+  if (status != SUCCESS)
+    return status;
+
+  // Consume padding and anything the parser stopped short of, so the stream
+  // is left at the first byte after the tag.
+  if (!skip_bytes(fp, tag_size - pos, seekable))
+    return ERROR_INVALID_FORMAT;
   return SUCCESS;
 }
 
-Status remove_id3v2_tag(const char *filepath) {
-  char tmp_path[512];
-  sprintf(tmp_path, "%s.tmp", filepath);
-  FILE *fin = fopen(filepath, "rb");
-  if (!fin)
-    return ERROR_FILE_OPEN;
-  FILE *fout = fopen(tmp_path, "wb");
-  if (!fout) {
-    fclose(fin);
+Status locate_id3v2_image(const char *filepath, ImageLocation *loc) {
+  if (!filepath || !loc)
+    return ERROR_INVALID_FORMAT;
+  FILE *fp = fopen(filepath, "rb");
+  if (!fp)
     return ERROR_FILE_OPEN;
+
+  unsigned char header[10];
+  if (fread(header, 1, 10, fp) != 10 ||
+      strncmp((char *)header, "ID3", 3) != 0) {
+    fclose(fp);
+    return ERROR_TAG_NOT_FOUND;
+  }
+  int major_version = header[3];
+  int header_size = (major_version == 2) ? 6 : 10;
+  off_t tag_size = decode_synchsafe(&header[6]);
+  off_t pos = 0;
+  Status status = ERROR_TAG_NOT_FOUND;
+  // An unsynchronised or compressed body does not hold the picture as is
+  if ((major_version < 4 && (header[5] & 0x80)) ||
+      (major_version == 2 && (header[5] & 0x40))) {
+    fclose(fp);
+    return ERROR_INVALID_FORMAT;
+  }
+  if (header[5] & 0x40) {
+    unsigned char b[4];
+    if (fread(b, 1, 4, fp) != 4) {
+      fclose(fp);
+      return ERROR_INVALID_FORMAT;
+    }
+    off_t rest = major_version == 4 ? (off_t)decode_synchsafe(b) - 4
+                                    : (off_t)(uint32_t)decode_int(b);
+    fseeko(fp, rest, SEEK_CUR);
+    pos = 4 + rest;
   }
 
-  unsigned char hdr[10];
-  if (fread(hdr, 1, 10, fin) == 10 && strncmp((char *)hdr, "ID3", 3) == 0) {
-    int size = decode_synchsafe(&hdr[6]);
-    fseek(fin, 10 + size, SEEK_SET);
-  } else {
-    rewind(fin);
+  // Walk frame headers only, seeking over frame bodies
+  while (pos + header_size <= tag_size) {
+    unsigned char fh[10];
+    if (fread(fh, 1, header_size, fp) != (size_t)header_size || fh[0] == 0)
+      break;
+    pos += header_size;
+    off_t frame_size;
+    int is_pic;
+    if (major_version == 2) {
+      frame_size = (fh[3] << 16) | (fh[4] << 8) | fh[5];
+      is_pic = memcmp(fh, "PIC", 3) == 0;
+    } else {
+      frame_size = major_version == 4 ? (off_t)decode_synchsafe(&fh[4])
+                                      : (off_t)(uint32_t)decode_int(&fh[4]);
+      is_pic = memcmp(fh, "APIC", 4) == 0;
+    }
+    if (frame_size <= 0 || pos + frame_size > tag_size)
+      break;
+    if (!is_pic) {
+      fseeko(fp, frame_size, SEEK_CUR);
+      pos += frame_size;
+      continue;
+    }
+    int skip = frame_prefix_length(fh, major_version);
+    if (skip < 0 || skip >= frame_size ||
+        (major_version == 4 && ((fh[9] & 0x02) || (header[5] & 0x80)))) {
+      status = ERROR_INVALID_FORMAT;
+      break;
+    }
+    fseeko(fp, skip, SEEK_CUR);
+    pos += skip;
+    frame_size -= skip;
+
+    // Only the prefix before the picture bytes is read
+    unsigned char prefix[512];
+    long want = frame_size < (long)sizeof(prefix) ? frame_size
+                                                  : (long)sizeof(prefix);
+    if (fread(prefix, 1, want, fp) != (size_t)want)
+      break;
+    int enc = prefix[0];
+    long offset;
+    if (major_version == 2) {
+      memcpy(loc->mime_type, prefix + 1, 3);
+      loc->mime_type[3] = '\0';
+      offset = 4;
+    } else {
+      const unsigned char *end = memchr(prefix + 1, 0, want - 1);
+      if (!end || end - prefix - 1 >= (long)sizeof(loc->mime_type))
+        break;
+      memcpy(loc->mime_type, prefix + 1, end - prefix - 1);
+      loc->mime_type[end - prefix - 1] = '\0';
+      offset = end - prefix + 1;
+    }
+    if (offset >= want)
+      break;
+    loc->type = prefix[offset++];
+    int step = (enc == 1 || enc == 2) ? 2 : 1;
+    while (offset + step <= want &&
+           !(prefix[offset] == 0 && (step == 1 || prefix[offset + 1] == 0)))
+      offset += step;
+    if (offset + step > want)
+      break; // Description longer than the prefix we read
+    offset += step;
+    loc->offset = 10 + pos + offset;
+    loc->size = (uint32_t)(frame_size - offset);
+    status = SUCCESS;
+    break;
   }
+  fclose(fp);
+  return status;
+}
 
-  unsigned char buf[8192];
-  size_t n;
-  while ((n = fread(buf, 1, 8192, fin)) > 0)
-    fwrite(buf, 1, n, fout);
+// Queue a text frame: header and encoding byte from scratch, value in place
+static void plan_text_frame(Id3v2WritePlan *plan, const char *id,
+                            const char *value) {
+  if (!value)
+    return;
+  size_t len = strlen(value);
+  unsigned char *hdr = plan->scratch + plan->scratch_used;
+  memcpy(hdr, id, 4);
+  encode_int((int)len + 1, &hdr[4]); // +1 for encoding byte
+  hdr[8] = 0;
+  hdr[9] = 0;  // Flags
+  hdr[10] = 0; // ISO-8859-1
+  plan->scratch_used += 11;
+  plan->iov[plan->iov_count].iov_base = hdr;
+  plan->iov[plan->iov_count++].iov_len = 11;
+  plan->iov[plan->iov_count].iov_base = (void *)value;
+  plan->iov[plan->iov_count++].iov_len = len;
+  plan->total_size += 11 + len;
+}
 
-  fclose(fin);
-  fclose(fout);
-  remove(filepath);
-  rename(tmp_path, filepath);
+static void plan_bytes(Id3v2WritePlan *plan, const void *data, size_t len) {
+  if (len == 0)
+    return;
+  plan->iov[plan->iov_count].iov_base = (void *)data;
+  plan->iov[plan->iov_count++].iov_len = len;
+  plan->total_size += len;
+}
+
+void plan_id3v2_image(Id3v2WritePlan *plan, const ImageMetadata *image) {
+  // The picture bytes are referenced where they already are in memory
+  static const unsigned char zero = 0;
+  if (image->size > 0 && image->mime_type) {
+    size_t mime_len = strlen(image->mime_type) + 1;
+    size_t desc_len = image->description ? strlen(image->description) : 0;
+    unsigned char *hdr = plan->scratch + plan->scratch_used;
+    memcpy(hdr, "APIC", 4);
+    encode_int((int)(1 + mime_len + 1 + desc_len + 1 + image->size), &hdr[4]);
+    hdr[8] = 0;
+    hdr[9] = 0;
+    hdr[10] = 0; // ISO-8859-1
+    plan->scratch_used += 11;
+    plan_bytes(plan, hdr, 11);
+    plan_bytes(plan, image->mime_type, mime_len);
+    plan_bytes(plan, &image->type, 1);
+    plan_bytes(plan, image->description, desc_len);
+    plan_bytes(plan, &zero, 1);
+    if (image->data) {
+      plan_bytes(plan, image->data, image->size);
+    } else {
+      // Never loaded: copied from the source file after the gather list
+      plan->deferred_offset = image->data_offset;
+      plan->deferred_len = image->size;
+      plan->total_size += image->size;
+    }
+  }
+
+  encode_synchsafe((int)(plan->total_size - 10), &plan->scratch[6]);
+}
+
+void plan_id3v2_frames(Id3v2WritePlan *plan, const unsigned char *frames,
+                       size_t len) {
+  plan_bytes(plan, frames, len);
+  encode_synchsafe((int)(plan->total_size - 10), &plan->scratch[6]);
+}
+
+// ID3V2_LOST_* bits of the fields update replaces
+static unsigned updated_fields(const TagUpdate *update) {
+  return (update->title ? ID3V2_LOST_TITLE : 0) |
+         (update->artist ? ID3V2_LOST_ARTIST : 0) |
+         (update->album ? ID3V2_LOST_ALBUM : 0) |
+         (update->year ? ID3V2_LOST_YEAR : 0) |
+         (update->genre ? ID3V2_LOST_GENRE : 0) |
+         (update->track ? ID3V2_LOST_TRACK : 0) |
+         (update->comment ? ID3V2_LOST_COMMENT : 0);
+}
+
+void plan_id3v2_tag(Id3v2WritePlan *plan, const ID3v2_Content *content,
+                    const TagUpdate *update) {
+  memset(plan, 0, sizeof(Id3v2WritePlan));
+
+  // Tag header first; its size field is rewritten as every frame is added
+  unsigned char *id3_hdr = plan->scratch;
+  memcpy(id3_hdr, "ID3\3\0\0", 6);
+  plan->scratch_used = 10;
+  plan_bytes(plan, id3_hdr, 10);
+
+  // Write updated or existing frames
+  plan_text_frame(plan, "TIT2", update->title ? update->title : content->title);
+  plan_text_frame(plan, "TPE1",
+                  update->artist ? update->artist : content->artist);
+  plan_text_frame(plan, "TALB", update->album ? update->album : content->album);
+  plan_text_frame(plan, "TYER", update->year ? update->year : content->year);
+  plan_text_frame(plan, "TCON", update->genre ? update->genre : content->genre);
+  plan_text_frame(plan, "TRCK", update->track ? update->track : content->track);
+  plan_text_frame(plan, "COMM",
+                  update->comment ? update->comment : content->comment);
+
+  // Chapters go back exactly as read
+  const ChapterTable *chapters = &content->chapters;
+  plan_bytes(plan, chapters->block, chapters->block_len);
+  plan->chapter_refs = chapters->refs;
+  plan->chapter_ref_count = chapters->ref_count;
+  plan->chapters_lost = chapters->lost;
+  plan->text_lost = content->text_lost & ~updated_fields(update);
+  for (int i = 0; i < chapters->ref_count; i++)
+    plan->total_size += chapters->refs[i].size;
+
+  plan_id3v2_image(plan, &content->image); // Also sizes the header
+}
+
+Status serialize_id3v2_frames(const ID3v2_Content *content, int source_fd,
+                              unsigned char **frames, size_t *len) {
+  TagUpdate none;
+  memset(&none, 0, sizeof(TagUpdate));
+  Id3v2WritePlan plan;
+  plan_id3v2_tag(&plan, content, &none);
+  *frames = NULL;
+  if (plan.chapters_lost || plan.text_lost)
+    return ERROR_MEM_ALLOC;
+  *len = plan.total_size - 10;
+  *frames = (unsigned char *)malloc(*len > 0 ? *len : 1);
+  if (!*frames)
+    return ERROR_MEM_ALLOC;
+  unsigned char *p = *frames;
+  for (int i = 1; i < plan.iov_count; i++) { // iov[0] is the tag header
+    memcpy(p, plan.iov[i].iov_base, plan.iov[i].iov_len);
+    p += plan.iov[i].iov_len;
+  }
+  // Frames left in the file end the buffer, the picture last
+  int ok = 1;
+  for (int i = 0; ok && i < plan.chapter_ref_count; i++) {
+    const ChapterRef *ref = &plan.chapter_refs[i];
+    ok = source_fd >= 0 &&
+         pread(source_fd, p, ref->size, ref->offset) == (ssize_t)ref->size;
+    p += ref->size;
+  }
+  if (ok && plan.deferred_len > 0)
+    ok = source_fd >= 0 && pread(source_fd, p, plan.deferred_len,
+                                 plan.deferred_offset) ==
+                               (ssize_t)plan.deferred_len;
+  if (!ok) {
+    free(*frames);
+    *frames = NULL;
+    return ERROR_INVALID_FORMAT;
+  }
   return SUCCESS;
 }
+
+Status write_id3v2_plan(int fd, const Id3v2WritePlan *plan, int source_fd) {
+  if (plan->chapters_lost || plan->text_lost)
+    return ERROR_MEM_ALLOC;
+  TRACE_BEGIN(start);
+  // writev() may stop short; resume from a private copy of the vector
+  struct iovec iov[ID3V2_PLAN_MAX_IOV];
+  memcpy(iov, plan->iov, plan->iov_count * sizeof(struct iovec));
+  struct iovec *cur = iov;
+  int count = plan->iov_count;
+  while (count > 0) {
+    ssize_t n = writev(fd, cur, count);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return ERROR_WRITE_FAILED;
+    }
+    io_charge_write((uint64_t)n);
+    while (count > 0 && (size_t)n >= cur->iov_len) {
+      n -= cur->iov_len;
+      cur++;
+      count--;
+    }
+    if (count > 0) {
+      cur->iov_base = (unsigned char *)cur->iov_base + n;
+      cur->iov_len -= n;
+    }
+  }
+  Status status = SUCCESS;
+  for (int i = 0; status == SUCCESS && i < plan->chapter_ref_count; i++)
+    status = source_fd < 0 ? ERROR_INVALID_FORMAT
+                           : copy_file_bytes(source_fd,
+                                             plan->chapter_refs[i].offset,
+                                             plan->chapter_refs[i].size, fd);
+  if (status == SUCCESS && plan->deferred_len > 0)
+    status = source_fd < 0 ? ERROR_INVALID_FORMAT
+                           : copy_file_bytes(source_fd, plan->deferred_offset,
+                                             plan->deferred_len, fd);
+  TRACE_END(start, "write_plan", NULL, plan->total_size);
+  return status;
+}
+
+// Bytes of the ID3v2 tag at the start of the open file, 0 if none
+static off_t leading_tag_length(int fd) {
+  unsigned char hdr[10];
+  if (pread(fd, hdr, 10, 0) != 10 || strncmp((char *)hdr, "ID3", 3) != 0)
+    return 0;
+  return id3v2_tag_length(hdr);
+}
+
+Status write_id3v2_replace(SafeWrite *sw, const Id3v2WritePlan *plan) {
+  // The whole new tag goes out in one writev() batch; audio data, and any
+  // picture too large to have been loaded, is copied from the original
+  Status status = write_id3v2_plan(sw->tmp_fd, plan, sw->fd);
+  if (status != SUCCESS)
+    return status;
+  off_t audio = leading_tag_length(sw->fd);
+  if (audio > sw->size)
+    audio = sw->size;
+  // A tag read from the end of the file is superseded by the new leading
+  // one; drop it and keep everything else
+  TailTags tail;
+  const TailBlock *appended = NULL;
+  if (audio == 0 && probe_tail_tags(sw->fd, sw->size, 0, &tail) == SUCCESS)
+    appended = find_tail_block(&tail, TAIL_ID3V2);
+  if (!appended)
+    return copy_file_bytes(sw->fd, audio, sw->size - audio, sw->tmp_fd);
+  off_t after = appended->offset + appended->size;
+  status = copy_file_bytes(sw->fd, 0, appended->offset, sw->tmp_fd);
+  if (status == SUCCESS)
+    status = copy_file_bytes(sw->fd, after, sw->size - after, sw->tmp_fd);
+  return status;
+}
+
+Status write_id3v2_rewrite(SafeWrite *sw, const ID3v2_Content *content,
+                           const TagUpdate *update) {
+  Id3v2WritePlan plan;
+  plan_id3v2_tag(&plan, content, update);
+  return write_id3v2_replace(sw, &plan);
+}
+
+Status write_id3v2_content(const char *filepath, const ID3v2_Content *content,
+                           const TagUpdate *update) {
+  SafeWrite sw;
+  Status status = safe_write_begin(&sw, filepath);
+  if (status != SUCCESS)
+    return status;
+  status = write_id3v2_rewrite(&sw, content, update);
+  if (status != SUCCESS) {
+    safe_write_abort(&sw);
+    return status;
+  }
+  return safe_write_commit(&sw);
+}
+
+Status remove_id3v2_tag(const char *filepath) {
+  SafeWrite sw;
+  Status status = safe_write_begin(&sw, filepath);
+  if (status != SUCCESS)
+    return status;
+  off_t audio = leading_tag_length(sw.fd);
+  if (audio == 0) {
+    safe_write_abort(&sw); // Nothing to remove
+    return SUCCESS;
+  }
+  if (audio > sw.size)
+    audio = sw.size;
+  status = copy_file_bytes(sw.fd, audio, sw.size - audio, sw.tmp_fd);
+  if (status != SUCCESS) {
+    safe_write_abort(&sw);
+    return status;
+  }
+  return safe_write_commit(&sw);
+}
@@ -0,0 +1,183 @@
+#ifdef __linux__
+#define _GNU_SOURCE // syscall
+#endif
+#include "../inc/io_budget.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define IO_MIN_CHUNK (64 * 1024)
+
+typedef struct {
+  double rate; // Tokens per second, 0 = unlimited
+  double burst;
+  double tokens;
+  uint64_t total;
+} Bucket;
+
+static int active;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static Bucket reads, writes, ops;
+static double first;   // Time of the first charge, 0 before it
+static double refilled; // Time the buckets were last topped up
+static double reported;
+static double throttled;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void bucket_init(Bucket *b, uint64_t limit) {
+  memset(b, 0, sizeof(Bucket));
+  b->rate = (double)limit;
+  b->burst = b->rate * IO_BURST_MS / 1000.0;
+  if (b->burst < 1)
+    b->burst = 1;
+  b->tokens = b->burst;
+}
+
+static void bucket_refill(Bucket *b, double dt) {
+  if (b->rate <= 0)
+    return;
+  b->tokens += b->rate * dt;
+  if (b->tokens > b->burst)
+    b->tokens = b->burst;
+}
+
+// Take amount tokens; the seconds until the debt is paid off
+static double bucket_take(Bucket *b, uint64_t amount) {
+  b->total += amount;
+  if (b->rate <= 0)
+    return 0;
+  b->tokens -= (double)amount;
+  return b->tokens < 0 ? -b->tokens / b->rate : 0;
+}
+
+void set_io_limits(uint64_t read_bps, uint64_t write_bps, uint64_t iops) {
+  bucket_init(&reads, read_bps);
+  bucket_init(&writes, write_bps);
+  bucket_init(&ops, iops);
+  active = read_bps || write_bps || iops;
+}
+
+int io_budget_active(void) { return active; }
+
+static void charge(Bucket *b, uint64_t bytes) {
+  if (!active)
+    return;
+  pthread_mutex_lock(&lock);
+  double now = now_seconds();
+  if (first == 0)
+    first = refilled = reported = now;
+  double dt = now - refilled;
+  refilled = now;
+  bucket_refill(&reads, dt);
+  bucket_refill(&writes, dt);
+  bucket_refill(&ops, dt);
+  double wait = bucket_take(b, bytes);
+  double op_wait = bucket_take(&ops, 1);
+  if (op_wait > wait)
+    wait = op_wait;
+  throttled += wait;
+  int report = now - reported >= IO_REPORT_INTERVAL;
+  if (report)
+    reported = now;
+  pthread_mutex_unlock(&lock);
+
+  if (report)
+    print_io_budget(stderr);
+  if (wait > 0) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)wait;
+    ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+      ;
+  }
+}
+
+void io_charge_read(uint64_t bytes) { charge(&reads, bytes); }
+
+void io_charge_write(uint64_t bytes) { charge(&writes, bytes); }
+
+static size_t chunk_at(double rate, size_t want) {
+  if (!active || rate <= 0)
+    return want;
+  size_t cap = (size_t)(rate * IO_BURST_MS / 1000.0);
+  if (cap < IO_MIN_CHUNK)
+    cap = IO_MIN_CHUNK;
+  return want < cap ? want : cap;
+}
+
+size_t io_budget_chunk(size_t want) {
+  double rate = reads.rate;
+  if (writes.rate > 0 && (rate <= 0 || writes.rate < rate))
+    rate = writes.rate;
+  return chunk_at(rate, want);
+}
+
+size_t io_read_chunk(size_t want) { return chunk_at(reads.rate, want); }
+
+int io_read_limited(void) { return active && reads.rate > 0; }
+
+int set_io_idle(void) {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+  // IOPRIO_WHO_PROCESS, this process, class IDLE (3) in the top bits
+  return syscall(SYS_ioprio_set, 1, 0, 3 << 13) == 0;
+#else
+  return 0;
+#endif
+}
+
+static void bucket_state(const Bucket *b, double elapsed, double dt,
+                         IoBucketState *s) {
+  Bucket now = *b;
+  bucket_refill(&now, dt);
+  s->limit = (uint64_t)b->rate;
+  s->total = b->total;
+  s->level = now.tokens;
+  s->rate = elapsed > 0 ? (double)b->total / elapsed : 0;
+}
+
+void io_budget_stats(IoBudgetStats *stats) {
+  pthread_mutex_lock(&lock);
+  double now = now_seconds();
+  double dt = first > 0 ? now - refilled : 0;
+  stats->elapsed = first > 0 ? now - first : 0;
+  bucket_state(&reads, stats->elapsed, dt, &stats->read);
+  bucket_state(&writes, stats->elapsed, dt, &stats->write);
+  bucket_state(&ops, stats->elapsed, dt, &stats->ops);
+  stats->throttled = throttled;
+  pthread_mutex_unlock(&lock);
+}
+
+// "12.5 MB (3.1 MB/s of 4.0, bucket -0.2)": the limit and level only if set
+static void print_bytes(FILE *out, const char *name, const IoBucketState *s) {
+  const double mb = 1024.0 * 1024;
+  fprintf(out, "%s %.1f MB (%.1f MB/s", name, (double)s->total / mb,
+          s->rate / mb);
+  if (s->limit)
+    fprintf(out, " of %.1f, bucket %.2f MB", (double)s->limit / mb,
+            s->level / mb);
+  fprintf(out, ")");
+}
+
+void print_io_budget(FILE *out) {
+  IoBudgetStats s;
+  io_budget_stats(&s);
+  fprintf(out, "I/O budget: ");
+  print_bytes(out, "read", &s.read);
+  print_bytes(out, ", write", &s.write);
+  fprintf(out, ", %llu ops (%.1f/s", (unsigned long long)s.ops.total,
+          s.ops.rate);
+  if (s.ops.limit)
+    fprintf(out, " of %llu, bucket %.1f", (unsigned long long)s.ops.limit,
+            s.ops.level);
+  fprintf(out, "), throttled %.1f s over %.1f s\n", s.throttled, s.elapsed);
+}
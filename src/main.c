@@ -1,8 +1,77 @@
+#include "../inc/art_store.h"
+#include "../inc/audio_hash.h"
+#include "../inc/catalog.h"
+#include "../inc/dir_watch.h"
+#include "../inc/disk_order.h"
+#include "../inc/file_list.h"
+#include "../inc/file_util.h"
+#include "../inc/frame_scan.h"
+#include "../inc/id3_chapters.h"
 #include "../inc/id3_reader.h"
 #include "../inc/id3_v2.h"
+#include "../inc/io_budget.h"
+#include "../inc/mp3_cut.h"
+#include "../inc/safe_write.h"
+#include "../inc/tag_clone.h"
+#include "../inc/tag_filter.h"
+#include "../inc/trace.h"
+#include "../inc/track_query.h"
 #include "../inc/types.h"
+#include "../inc/write_cost.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+// Expand the positional arguments (files or directories) of a batch mode
+static int build_file_list(FileList *list, char **paths, int count) {
+  file_list_init(list);
+  for (int i = 0; i < count; i++) {
+    if (file_list_add_path(list, paths[i]) != SUCCESS)
+      printf("Warning: Could not read '%s'\n", paths[i]);
+  }
+  if (list->count == 0) {
+    printf("Error: No input files found.\n");
+    file_list_free(list);
+    return 0;
+  }
+  return 1;
+}
+
+// --progress: percentage of large audio copies, on stderr
+static void print_copy_progress(off_t done, off_t total, void *ctx) {
+  static _Thread_local int last = -1; // Each -j worker reports its own copy
+  (void)ctx;
+  if (total < 64 * 1024 * 1024)
+    return;
+  int percent = (int)(done * 100 / total);
+  if (percent == last)
+    return;
+  last = percent == 100 ? -1 : percent;
+  fprintf(stderr, "\rCopying audio: %3d%% of %.1f MB%s", percent,
+          (double)total / (1024 * 1024), percent == 100 ? "\n" : "");
+}
+
+// Whether the options ask for a tag rewrite. A track number (-T) only rides
+// along with one of the other fields.
+static int has_tag_edits(const TagUpdate *u) {
+  return u->title || u->artist || u->album || u->year || u->comment ||
+         u->genre;
+}
+
+// A byte count given on the command line, or 0 if text is not a number
+static unsigned long parse_byte_count(const char *text) {
+  char *end;
+  errno = 0;
+  unsigned long n = strtoul(text, &end, 10);
+  if (!isdigit((unsigned char)text[0]) || *end != '\0' || errno != 0)
+    return 0;
+  return n;
+}
 
 void print_help(const char *program_name) {
   printf("usage: %s -[tTaAycg] \"value\" file1\n", program_name);
@@ -14,6 +83,57 @@ void print_help(const char *program_name) {
   printf("-y\tModifies a Year tag\n");
   printf("-c\tModifies a Comment tag\n");
   printf("-g\tModifies a Genre tag\n");
+  printf("--filter\tRetags stdin to stdout, e.g. %s --filter -t \"x\" < in > out\n",
+         program_name);
+  printf("--hash\tHashes the audio payload of files/directories and groups "
+         "duplicates\n");
+  printf("--scan\tExact duration, frame count and bitrate of files/directories "
+         "(large files use all threads)\n");
+  printf("--profile\tBitrate histogram, VBR, mode/sample-rate changes, junk "
+         "and byte layout of files/directories\n");
+  printf("--plan\tWith -t/-a/.../-d, shows per file whether the write would "
+         "grow, shrink or truncate and the bytes written, writing nothing\n");
+  printf("--where EXPR\tLists tracks matching e.g. \"artist=X and "
+         "bitrate<128\" (ops = != < <= > >= ~)\n");
+  printf("--group-by F\tGroups matching tracks by a field; with --distinct "
+         "G, only groups where G varies\n");
+  printf("--from-catalog FILE\tRuns --where/--group-by over a saved "
+         "catalog instead of reading the files\n");
+  printf("--watch DIR\tPrints a record for every .mp3 changed or deleted "
+         "below DIR (--debounce MS, default 500)\n");
+  printf("--cut A-B\tWrites the audio from A to B (seconds or m:ss, frame "
+         "accurate) to <name>_cut.mp3\n");
+  printf("--split-at T1,T2\tSplits losslessly into <name>_01.mp3, "
+         "<name>_02.mp3, ...\n");
+  printf("--copy-tags-from SRC\tCopies SRC's tag fields to files/directories "
+         "(--fields, default " CLONE_DEFAULT_FIELDS ")\n");
+  printf("--chapters\tLists the CHAP chapters of a file; --chapter-at T "
+         "shows the one playing at T\n");
+  printf("--verify\tChecks frame sync and CRC-16 of files/directories\n");
+  printf("--export-art DIR\tStores each distinct embedded image once in DIR "
+         "and prints track -> image\n");
+  printf("--strip-art\tWith --export-art, replaces embedded art by a link\n");
+  printf("--progress\tShows the progress of rewrites copying over 64 MB of "
+         "audio\n");
+  printf("--no-wait\tFail instead of waiting when another writer holds the "
+         "file\n");
+  printf("--frame-cap N\tLargest tag frame held in memory, in bytes "
+         "(default 1 MB)\n");
+  printf("--mem-budget N\tMost tag bytes held in memory per file "
+         "(default 4 MB)\n");
+  printf("--trace FILE\tWrites a Chrome trace-event timeline of the run to "
+         "FILE (builds made with TRACE=1)\n");
+  printf("--catalog FILE\tWrites a binary catalog of files/directories; "
+         "with --shard I/N only the I-th of N shards\n");
+  printf("--merge OUT\tCombines partial catalogs into OUT, reporting "
+         "duplicates and conflicts\n");
+  printf("--disk-order\tProcesses batch files in physical disk order "
+         "(fewer seeks on HDDs)\n");
+  printf("--max-read-bps N\tLimits reads to N bytes/s across all threads "
+         "(also --max-write-bps N, --max-iops N)\n");
+  printf("--idle-io\tRuns in the idle I/O scheduling class (Linux), so "
+         "other disk users go first\n");
+  printf("-j\tWorker threads for batch modes (default: CPU count)\n");
   printf("-h\tDisplays this help info\n");
   printf("-v\tPrints version info\n");
 }
@@ -47,6 +167,37 @@ int main(int argc, char *argv[]) {
 
   int extract_image = 0;
   int delete_tags = 0;
+  int filter = 0;
+  int hash_mode = 0;
+  int verify_mode = 0;
+  int scan_mode = 0;
+  int profile_mode = 0;
+  int plan_mode = 0;
+  char *where = NULL;
+  char *group_by = NULL;
+  char *distinct = NULL;
+  int chapters_mode = 0;
+  char *chapter_time = NULL;
+  char *cut_range = NULL;
+  char *split_points = NULL;
+  char *watch_dir = NULL;
+  int debounce_ms = 500;
+  char *clone_source = NULL;
+  char *clone_fields = NULL;
+  char *art_dir = NULL;
+  int strip_art = 0;
+  int disk_order = 0;
+  char *catalog_out = NULL;
+  char *merge_out = NULL;
+  char *from_catalog = NULL;
+  unsigned shard = 1, shards = 1;
+  unsigned long frame_cap = ID3V2_DEFAULT_FRAME_CAP;
+  unsigned long mem_budget = ID3V2_DEFAULT_MEM_BUDGET;
+  unsigned long long max_read_bps = 0, max_write_bps = 0, max_iops = 0;
+  int idle_io = 0;
+  int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  char **paths = (char **)malloc(argc * sizeof(char *));
+  int path_count = 0;
   int i;
   for (i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--delete-tag") == 0) {
@@ -57,6 +208,156 @@ int main(int argc, char *argv[]) {
       extract_image = 1;
       continue;
     }
+    if (strcmp(argv[i], "--filter") == 0) {
+      filter = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--hash") == 0) {
+      hash_mode = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--scan") == 0) {
+      scan_mode = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--plan") == 0) {
+      plan_mode = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--profile") == 0) {
+      profile_mode = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--verify") == 0) {
+      verify_mode = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--where") == 0 && i + 1 < argc) {
+      where = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--group-by") == 0 && i + 1 < argc) {
+      group_by = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--distinct") == 0 && i + 1 < argc) {
+      distinct = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--chapters") == 0) {
+      chapters_mode = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--chapter-at") == 0 && i + 1 < argc) {
+      chapter_time = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--cut") == 0 && i + 1 < argc) {
+      cut_range = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--split-at") == 0 && i + 1 < argc) {
+      split_points = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+      watch_dir = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--debounce") == 0 && i + 1 < argc) {
+      debounce_ms = atoi(argv[++i]);
+      continue;
+    }
+    if (strcmp(argv[i], "--copy-tags-from") == 0 && i + 1 < argc) {
+      clone_source = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--fields") == 0 && i + 1 < argc) {
+      clone_fields = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--export-art") == 0 && i + 1 < argc) {
+      art_dir = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--progress") == 0) {
+      set_copy_progress(print_copy_progress, NULL);
+      continue;
+    }
+    if (strcmp(argv[i], "--no-wait") == 0) {
+      set_write_lock_wait(0);
+      continue;
+    }
+    if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+#ifdef MP3TAG_TRACE
+      trace_start(argv[++i]);
+      continue;
+#else
+      printf("Error: --trace needs a build made with `make TRACE=1`\n");
+      return 1;
+#endif
+    }
+    if (strcmp(argv[i], "--frame-cap") == 0 && i + 1 < argc) {
+      frame_cap = parse_byte_count(argv[++i]);
+      if (frame_cap == 0 || frame_cap > UINT32_MAX) {
+        printf("Error: --frame-cap expects a positive number of bytes\n");
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--mem-budget") == 0 && i + 1 < argc) {
+      mem_budget = parse_byte_count(argv[++i]);
+      if (mem_budget == 0) {
+        printf("Error: --mem-budget expects a positive number of bytes\n");
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--catalog") == 0 && i + 1 < argc) {
+      catalog_out = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--from-catalog") == 0 && i + 1 < argc) {
+      from_catalog = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--merge") == 0 && i + 1 < argc) {
+      merge_out = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc) {
+      char end;
+      if (sscanf(argv[++i], "%u/%u%c", &shard, &shards, &end) != 2 ||
+          shard < 1 || shard > shards) {
+        printf("Error: --shard expects I/N with 1 <= I <= N, e.g. 2/4\n");
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--max-read-bps") == 0 && i + 1 < argc) {
+      max_read_bps = strtoull(argv[++i], NULL, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--max-write-bps") == 0 && i + 1 < argc) {
+      max_write_bps = strtoull(argv[++i], NULL, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--max-iops") == 0 && i + 1 < argc) {
+      max_iops = strtoull(argv[++i], NULL, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--idle-io") == 0) {
+      idle_io = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--disk-order") == 0) {
+      disk_order = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--strip-art") == 0) {
+      strip_art = 1;
+      continue;
+    }
     if (argv[i][0] == '-') {
       // It's a flag
       char flag = argv[i][1];
@@ -98,6 +399,9 @@ int main(int argc, char *argv[]) {
       case 'T':
         track = value;
         break;
+      case 'j':
+        jobs = atoi(value);
+        break;
       default:
         printf("Unknown option: -%c\n", flag);
         print_help(argv[0]);
@@ -106,7 +410,118 @@ int main(int argc, char *argv[]) {
     } else {
       // It's likely the filename
       filepath = argv[i];
+      if (paths)
+        paths[path_count++] = argv[i];
+    }
+  }
+
+  set_id3v2_memory_limits((uint32_t)frame_cap, mem_budget);
+  set_io_limits(max_read_bps, max_write_bps, max_iops);
+  if (idle_io && !set_io_idle())
+    fprintf(stderr, "Warning: Could not switch to the idle I/O class.\n");
+
+  TagUpdate update;
+  update.title = title;
+  update.artist = artist;
+  update.album = album;
+  update.year = year;
+  update.comment = comment;
+  update.genre = genre;
+  update.track = track;
+
+  if (filter) {
+    Status status = filter_id3_tags(stdin, stdout, &update);
+    if (status == ERROR_MEM_ALLOC) {
+      fprintf(stderr, "Error: Tag over --frame-cap/--mem-budget; raise them "
+                      "(or redirect from a file, not a pipe).\n");
+      return 1;
+    } else if (status != SUCCESS) {
+      fprintf(stderr, "Error: Retag filter failed.\n");
+      return 1;
     }
+    return 0;
+  }
+
+  if (watch_dir) {
+    Status status = watch_directory(watch_dir, debounce_ms, jobs);
+    if (status != SUCCESS)
+      printf("Error: Could not watch '%s'.\n", watch_dir);
+    free(paths);
+    return 1;
+  }
+
+  if (merge_out) {
+    if (path_count == 0) {
+      printf("Error: --merge needs the partial catalogs to combine.\n");
+      return 1;
+    }
+    Status status = merge_catalogs(paths, path_count, merge_out);
+    free(paths);
+    return status == SUCCESS ? 0 : 1;
+  }
+
+  if (from_catalog) {
+    if (!where && !group_by) {
+      printf("Error: --from-catalog needs --where or --group-by.\n");
+      free(paths);
+      return 1;
+    }
+    Status status =
+        query_tracks(NULL, from_catalog, where, group_by, distinct, jobs);
+    free(paths);
+    return status == SUCCESS ? 0 : 1;
+  }
+
+  if (plan_mode && !has_tag_edits(&update) && !delete_tags) {
+    printf("Error: --plan needs the tag options (-t, -a, -A, -y, -c, -g) or "
+           "-d to plan.\n");
+    return 1;
+  }
+
+  if (hash_mode || verify_mode || scan_mode || profile_mode || plan_mode ||
+      art_dir || where || group_by || clone_source || catalog_out) {
+    FileList files;
+    if (!build_file_list(&files, paths, path_count))
+      return 1;
+    if (shards > 1)
+      file_list_shard(&files, shard, shards);
+    DiskOrderStats order;
+    if (disk_order && files.count > 1 &&
+        order_by_disk_layout(&files, jobs, &order) == SUCCESS)
+      fprintf(stderr,
+              "Disk order: %zu files by extent, %zu by inode; seeks %llu -> "
+              "%llu (%lld saved), head travel %.2f GB -> %.2f GB\n",
+              order.by_extent, order.by_inode,
+              (unsigned long long)order.seeks_before,
+              (unsigned long long)order.seeks_after,
+              (long long)order.seeks_before - (long long)order.seeks_after,
+              order.travel_before / (1024.0 * 1024 * 1024),
+              order.travel_after / (1024.0 * 1024 * 1024));
+    Status status;
+    if (hash_mode)
+      status = hash_audio_batch(&files, jobs);
+    else if (verify_mode)
+      status = verify_mpeg_files(&files, jobs);
+    else if (scan_mode)
+      status = scan_mpeg_files(&files, jobs);
+    else if (profile_mode)
+      status = profile_mpeg_files(&files, jobs);
+    else if (plan_mode) // Edits win over -d, as in the dispatch below
+      status =
+          plan_tag_writes(&files, &update, !has_tag_edits(&update), jobs);
+    else if (catalog_out)
+      status = write_catalog(&files, shard, shards, catalog_out, jobs);
+    else if (clone_source)
+      status = copy_tags_from(clone_source, clone_fields, &files, jobs);
+    else if (where || group_by)
+      status = query_tracks(&files, NULL, where, group_by, distinct, jobs);
+    else
+      status = export_album_art(&files, art_dir, strip_art, jobs);
+    if (io_budget_active())
+      print_io_budget(stderr);
+    file_list_free(&files);
+    free(paths);
+    return status == SUCCESS ? 0 : 1;
   }
 
   if (filepath == NULL) {
@@ -116,16 +531,18 @@ int main(int argc, char *argv[]) {
   }
 
   // Dispatch
-  if (title || artist || album || year || comment || genre) {
-    TagUpdate update;
-    update.title = title;
-    update.artist = artist;
-    update.album = album;
-    update.year = year;
-    update.comment = comment;
-    update.genre = genre;
-    update.track = track;
-
+  if (chapters_mode || chapter_time) {
+    Status status = list_chapters(filepath, chapter_time);
+    free(paths);
+    return status == SUCCESS ? 0 : 1;
+  }
+  if (cut_range || split_points) {
+    Status status = cut_range ? cut_mp3(filepath, cut_range)
+                              : split_mp3(filepath, split_points);
+    free(paths);
+    return status == SUCCESS ? 0 : 1;
+  }
+  if (has_tag_edits(&update)) {
     update_id3_tags(filepath, &update);
   } else if (delete_tags) {
     delete_id3_tags(filepath);
@@ -148,7 +565,18 @@ int main(int argc, char *argv[]) {
 
       FILE *img = fopen(out_name, "wb");
       if (img) {
-        fwrite(content.image.data, 1, content.image.size, img);
+        if (content.image.data) {
+          fwrite(content.image.data, 1, content.image.size, img);
+        } else {
+          // Too large to have been loaded: copy it straight from the file
+          int src = open(filepath, O_RDONLY);
+          fflush(img);
+          if (src >= 0) {
+            copy_file_bytes(src, content.image.data_offset, content.image.size,
+                            fileno(img));
+            close(src);
+          }
+        }
         fclose(img);
         printf("Album art extracted to '%s' (%u bytes)\n", out_name,
                content.image.size);
@@ -0,0 +1,182 @@
+#include "../inc/mp3_cut.h"
+#include "../inc/file_util.h"
+#include "../inc/frame_scan.h"
+#include "../inc/id3_reader.h"
+#include "../inc/id3_v2.h"
+#include "../inc/play_time.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CUT_MAX_POINTS 256
+
+// "<dir>/<name>" of "<dir>/<name>.mp3" followed by suffix
+static void output_path(const char *filepath, const char *suffix, char *buf,
+                        size_t size) {
+  const char *slash = strrchr(filepath, '/');
+  const char *dot = strrchr(filepath, '.');
+  int len = dot && (!slash || dot > slash) ? (int)(dot - filepath)
+                                           : (int)strlen(filepath);
+  snprintf(buf, size, "%.*s%s", len, filepath, suffix);
+}
+
+// One output: the tag, then the frames in [from, to) of the source
+static Status write_segment(int src_fd, const char *out_path,
+                            const ID3v2_Content *content,
+                            const TagUpdate *update, const FrameBoundary *from,
+                            const FrameBoundary *to) {
+  int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out_fd < 0)
+    return ERROR_FILE_OPEN;
+  Id3v2WritePlan plan;
+  plan_id3v2_tag(&plan, content, update);
+  Status status = write_id3v2_plan(out_fd, &plan, src_fd);
+  if (status == SUCCESS)
+    status = copy_file_bytes(src_fd, from->offset, to->offset - from->offset,
+                             out_fd);
+  if (close(out_fd) != 0 && status == SUCCESS)
+    status = ERROR_WRITE_FAILED;
+  if (status != SUCCESS) {
+    unlink(out_path);
+    return status;
+  }
+
+  char a[32], b[32];
+  format_play_time(from->time, a, sizeof(a));
+  format_play_time(to->time, b, sizeof(b));
+  printf("%s: %s - %s (%.2f MB)%s\n", out_path, a, b,
+         (double)(to->offset - from->offset) / (1024 * 1024),
+         from->snapped ? "  [start moved back to a frame outside the bit "
+                         "reservoir]"
+                       : "");
+  return SUCCESS;
+}
+
+// Open the source and map the cut times to frame boundaries
+static Status map_cut_points(const char *filepath, int *fd,
+                             const double *times, int count,
+                             FrameBoundary *points, FrameBoundary *first,
+                             FrameBoundary *last) {
+  *fd = open(filepath, O_RDONLY);
+  struct stat st;
+  if (*fd < 0 || fstat(*fd, &st) != 0) {
+    if (*fd >= 0)
+      close(*fd);
+    return ERROR_FILE_OPEN;
+  }
+  off_t start, end;
+  locate_audio_range(*fd, st.st_size, &start, &end);
+  Status status =
+      map_times_to_frames(*fd, start, end, times, count, points, first, last);
+  if (status != SUCCESS)
+    close(*fd);
+  return status;
+}
+
+Status cut_mp3(const char *filepath, const char *range) {
+  double times[2];
+  const char *s;
+  int count = 1;
+  if (!parse_play_time(range, &s, &times[0]) || *s != '-') {
+    printf("Error: --cut expects start-end, e.g. 1:30-2:45\n");
+    return ERROR_INVALID_FORMAT;
+  }
+  if (s[1] != '\0') {
+    if (!parse_play_time(s + 1, &s, &times[1]) || *s != '\0' ||
+        times[1] <= times[0]) {
+      printf("Error: --cut end must be a time after the start\n");
+      return ERROR_INVALID_FORMAT;
+    }
+    count = 2;
+  }
+
+  int fd;
+  FrameBoundary points[2], first, last;
+  Status status =
+      map_cut_points(filepath, &fd, times, count, points, &first, &last);
+  if (status != SUCCESS) {
+    printf("Error: No MPEG audio found in '%s'\n", filepath);
+    return status;
+  }
+  if (count == 1)
+    points[1] = last;
+  if (points[1].offset <= points[0].offset) {
+    printf("Error: The cut lies beyond the end of the audio\n");
+    close(fd);
+    return ERROR_INVALID_FORMAT;
+  }
+
+  ID3v2_Content content;
+  memset(&content, 0, sizeof(ID3v2_Content));
+  read_id3v2_tag(filepath, &content);
+  chapter_table_free(&content.chapters); // Times of the uncut file
+  TagUpdate none;
+  memset(&none, 0, sizeof(TagUpdate));
+  char out[4096];
+  output_path(filepath, "_cut.mp3", out, sizeof(out));
+  status = write_segment(fd, out, &content, &none, &points[0], &points[1]);
+  if (status != SUCCESS)
+    printf("Error: Could not write '%s'\n", out);
+  free_id3v2_content(&content);
+  close(fd);
+  return status;
+}
+
+Status split_mp3(const char *filepath, const char *list) {
+  double times[CUT_MAX_POINTS];
+  int count = 0;
+  const char *s = list;
+  while (*s) {
+    if (count == CUT_MAX_POINTS || !parse_play_time(s, &s, &times[count]) ||
+        (count > 0 && times[count] <= times[count - 1]) ||
+        (*s != ',' && *s != '\0')) {
+      printf("Error: --split-at expects ascending times, e.g. 3:20,7:45\n");
+      return ERROR_INVALID_FORMAT;
+    }
+    count++;
+    if (*s == ',')
+      s++;
+  }
+
+  int fd;
+  FrameBoundary points[CUT_MAX_POINTS + 2];
+  FrameBoundary first, last;
+  Status status =
+      map_cut_points(filepath, &fd, times, count, points + 1, &first, &last);
+  if (status != SUCCESS) {
+    printf("Error: No MPEG audio found in '%s'\n", filepath);
+    return status;
+  }
+  // Segments run between consecutive distinct boundaries
+  points[0] = first;
+  points[count + 1] = last;
+  int segments = 0;
+  for (int i = 1; i <= count + 1; i++) {
+    if (points[i].offset > points[segments].offset)
+      points[++segments] = points[i];
+  }
+
+  ID3v2_Content content;
+  memset(&content, 0, sizeof(ID3v2_Content));
+  read_id3v2_tag(filepath, &content);
+  chapter_table_free(&content.chapters); // Times of the uncut file
+  for (int i = 0; i < segments && status == SUCCESS; i++) {
+    char suffix[32], track[32], out[4096];
+    snprintf(suffix, sizeof(suffix), "_%02d.mp3", i + 1);
+    snprintf(track, sizeof(track), "%d/%d", i + 1, segments);
+    output_path(filepath, suffix, out, sizeof(out));
+    TagUpdate update;
+    memset(&update, 0, sizeof(TagUpdate));
+    update.track = track;
+    status = write_segment(fd, out, &content, &update, &points[i],
+                           &points[i + 1]);
+    if (status != SUCCESS)
+      printf("Error: Could not write '%s'\n", out);
+  }
+  free_id3v2_content(&content);
+  close(fd);
+  return status;
+}
@@ -1,4 +1,7 @@
 #include "../inc/mpeg_reader.h"
+#include "../inc/id3_reader.h"
+#include "../inc/io_budget.h"
+#include "../inc/trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,7 +22,72 @@ static const int samplerate_v1[] = {44100, 48000, 32000};
 static const int samplerate_v2[] = {22050, 24000, 16000};
 static const int samplerate_v25[] = {11025, 12000, 8000};
 
+int parse_frame_header(const unsigned char *h, MpegFrameHeader *hdr) {
+  // Sync word
+  if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0)
+    return 0;
+
+  int ver_bits = (h[1] >> 3) & 0x03;
+  int layer_bits = (h[1] >> 1) & 0x03;
+  if (ver_bits == 0x01 || layer_bits == 0x00)
+    return 0;
+
+  int br_idx = (h[2] >> 4) & 0x0F;
+  int sr_idx = (h[2] >> 2) & 0x03;
+  if (br_idx == 0 || br_idx == 15 || sr_idx == 3)
+    return 0;
+
+  hdr->version = ver_bits;
+  hdr->layer = 4 - layer_bits; // 3 -> Layer I, 1 -> Layer III
+  hdr->protected = !(h[1] & 0x01);
+
+  if (ver_bits == 3) { // V1
+    if (hdr->layer == 1)
+      hdr->bitrate = bitrate_v1_l1[br_idx];
+    else if (hdr->layer == 2)
+      hdr->bitrate = bitrate_v1_l2[br_idx];
+    else
+      hdr->bitrate = bitrate_v1_l3[br_idx];
+  } else { // V2 or 2.5
+    if (hdr->layer == 1)
+      hdr->bitrate = bitrate_v2_l1[br_idx];
+    else
+      hdr->bitrate = bitrate_v2_l23[br_idx];
+  }
+
+  if (ver_bits == 3)
+    hdr->sample_rate = samplerate_v1[sr_idx];
+  else if (ver_bits == 2)
+    hdr->sample_rate = samplerate_v2[sr_idx];
+  else
+    hdr->sample_rate = samplerate_v25[sr_idx];
+
+  hdr->padding = (h[2] >> 1) & 0x01;
+  hdr->channel_mode = (h[3] >> 6) & 0x03;
+  hdr->mode_ext = (h[3] >> 4) & 0x03;
+
+  // Frame length in bytes, header included
+  if (hdr->layer == 1) {
+    hdr->samples = 384;
+    hdr->frame_size =
+        (12 * hdr->bitrate * 1000 / hdr->sample_rate + hdr->padding) * 4;
+  } else if (hdr->layer == 3 && ver_bits != 3) {
+    hdr->samples = 576;
+    hdr->frame_size = 72 * hdr->bitrate * 1000 / hdr->sample_rate + hdr->padding;
+  } else {
+    hdr->samples = 1152;
+    hdr->frame_size =
+        144 * hdr->bitrate * 1000 / hdr->sample_rate + hdr->padding;
+  }
+  return 1;
+}
+
 Status read_mpeg_info(const char *filepath, MpegInfo *info) {
+  return read_mpeg_info_tail(filepath, NULL, info);
+}
+
+Status read_mpeg_info_tail(const char *filepath, const TailTags *tail,
+                           MpegInfo *info) {
   if (!filepath || !info)
     return ERROR_INVALID_FORMAT;
   FILE *fp = fopen(filepath, "rb");
@@ -27,106 +95,61 @@ Status read_mpeg_info(const char *filepath, MpegInfo *info) {
     return ERROR_FILE_OPEN;
 
   // Get file size
-  fseek(fp, 0, SEEK_END);
-  info->filesize = ftell(fp);
-  fseek(fp, 0, SEEK_SET);
+  fseeko(fp, 0, SEEK_END);
+  info->filesize = ftello(fp);
+
+  // The search starts after the leading tags, so sync-like bytes inside
+  // them (e.g. picture data) are never taken for the first frame
+  off_t audio_start, audio_end;
+  locate_audio_range_tail(fileno(fp), info->filesize, tail, &audio_start,
+                          &audio_end);
+  fseeko(fp, audio_start, SEEK_SET);
 
   int frames_found = 0;
 
-  // Limit search to first 100KB to avoid scanning whole file if not found
+  // Limit search to first 100KB of audio to avoid scanning whole file if
+  // not found
   long search_limit = 100 * 1024;
-  if (info->filesize < search_limit)
-    search_limit = info->filesize;
+  if (audio_end - audio_start < search_limit)
+    search_limit = audio_end > audio_start ? (long)(audio_end - audio_start)
+                                           : 0;
 
-  // Read up to search_limit into a buffer
-  // Just alloc 100KB or file size
-  unsigned char *search_buf = (unsigned char *)malloc(search_limit);
+  unsigned char *search_buf = (unsigned char *)malloc(search_limit + 1);
   if (!search_buf) {
     fclose(fp);
     return ERROR_MEM_ALLOC;
   }
 
+  // fread may return less at EOF; the search covers what was read
   size_t bytes_read = fread(search_buf, 1, search_limit, fp);
-  // If read less, proceed with what we got (e.g. file smaller than limit)
-  // But search_limit was capped by filesize. if read failed, error.
-  // unless fread returns short count? Just use ftell to know actual bytes read
-  // or assume success if limit correct. Actually fread might return less if
-  // EOF.
-
+  io_charge_read(bytes_read);
   fclose(fp); // Close early, we have data.
 
   for (size_t i = 0; i + 4 < bytes_read; i++) {
-    // Sync word
-    if (search_buf[i] == 0xFF && (search_buf[i + 1] & 0xE0) == 0xE0) {
+    MpegFrameHeader hdr;
+    if (parse_frame_header(&search_buf[i], &hdr)) {
       // Found sync at offset i
-
-      // Parse Version
-      int ver_bits = (search_buf[i + 1] >> 3) & 0x03;
-      int layer_bits = (search_buf[i + 1] >> 1) & 0x03;
-
-      if (ver_bits == 0x01)
-        continue;
-      if (layer_bits == 0x00)
-        continue;
-
-      // Decode Version
-      if (ver_bits == 3) {
+      TRACE_MARK("sync", filepath, audio_start + i);
+      if (hdr.version == 3)
         strcpy(info->version, "MPEG 1");
-      } else if (ver_bits == 2) {
+      else if (hdr.version == 2)
         strcpy(info->version, "MPEG 2");
-      } else {
+      else
         strcpy(info->version, "MPEG 2.5");
-      }
 
-      // Decode Layer
-      int layer_idx = 0;
-      if (layer_bits == 3) {
+      if (hdr.layer == 1)
         strcpy(info->layer, "Layer I");
-        layer_idx = 1;
-      } else if (layer_bits == 2) {
+      else if (hdr.layer == 2)
         strcpy(info->layer, "Layer II");
-        layer_idx = 2;
-      } else {
+      else
         strcpy(info->layer, "Layer III");
-        layer_idx = 3;
-      }
 
-      // Bitrate
-      int br_idx = (search_buf[i + 2] >> 4) & 0x0F;
-      if (br_idx == 0 || br_idx == 15)
-        continue;
-
-      int bitrate = 0;
-      if (ver_bits == 3) { // V1
-        if (layer_idx == 1)
-          bitrate = bitrate_v1_l1[br_idx];
-        else if (layer_idx == 2)
-          bitrate = bitrate_v1_l2[br_idx];
-        else
-          bitrate = bitrate_v1_l3[br_idx];
-      } else { // V2 or 2.5
-        if (layer_idx == 1)
-          bitrate = bitrate_v2_l1[br_idx];
-        else
-          bitrate = bitrate_v2_l23[br_idx];
-      }
+      int bitrate = hdr.bitrate;
       info->bitrate = bitrate;
-
-      // Sample Rate
-      int sr_idx = (search_buf[i + 2] >> 2) & 0x03;
-      if (sr_idx == 3)
-        continue;
-
-      if (ver_bits == 3)
-        info->sample_rate = samplerate_v1[sr_idx];
-      else if (ver_bits == 2)
-        info->sample_rate = samplerate_v2[sr_idx];
-      else
-        info->sample_rate = samplerate_v25[sr_idx];
+      info->sample_rate = hdr.sample_rate;
 
       // Mode
-      int mode_bits = (search_buf[i + 3] >> 6) & 0x03;
-      switch (mode_bits) {
+      switch (hdr.channel_mode) {
       case 0:
         strcpy(info->mode, "Stereo");
         break;
@@ -141,9 +164,9 @@ Status read_mpeg_info(const char *filepath, MpegInfo *info) {
         break;
       }
 
-      // Calculate Duration (Approx CBR)
+      // Calculate Duration (Approx CBR) over the audio between the tags
       if (bitrate > 0) {
-        long audio_size = info->filesize - 128;
+        off_t audio_size = audio_end - audio_start;
         info->duration = (double)audio_size * 8.0 / (bitrate * 1000.0);
       }
 
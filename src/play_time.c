@@ -0,0 +1,30 @@
+#include "../inc/play_time.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int parse_play_time(const char *s, const char **end, double *seconds) {
+  double total = 0;
+  char *stop;
+  for (int part = 0; part < 3; part++) {
+    double v = strtod(s, &stop);
+    if (stop == s || v < 0)
+      return 0;
+    total = total * 60 + v;
+    s = stop;
+    if (*s != ':')
+      break;
+    s++;
+  }
+  *seconds = total;
+  *end = s;
+  return 1;
+}
+
+void format_play_time(double seconds, char *buf, size_t size) {
+  int min = (int)(seconds / 60);
+  double sec = seconds - min * 60;
+  if (min >= 60)
+    snprintf(buf, size, "%d:%02d:%06.3f", min / 60, min % 60, sec);
+  else
+    snprintf(buf, size, "%d:%06.3f", min, sec);
+}
@@ -0,0 +1,151 @@
+#ifdef __linux__
+#define _GNU_SOURCE // renameat2
+#endif
+#include "../inc/safe_write.h"
+#include "../inc/trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOCK_RETRIES 8 // Times to chase a path replaced while we waited
+
+static int lock_wait = 1;
+
+void set_write_lock_wait(int wait) { lock_wait = wait; }
+
+Status safe_write_lock(int fd) {
+  while (flock(fd, LOCK_EX | (lock_wait ? 0 : LOCK_NB)) != 0) {
+    if (errno == EINTR)
+      continue;
+    return errno == EWOULDBLOCK ? ERROR_FILE_BUSY : ERROR_FILE_OPEN;
+  }
+  return SUCCESS;
+}
+
+static int same_mtime(const struct stat *st, const struct timespec *t) {
+  return st->st_mtim.tv_sec == t->tv_sec && st->st_mtim.tv_nsec == t->tv_nsec;
+}
+
+// Open and lock the file the path names now. Another writer may have
+// replaced it while we waited for the lock, in which case the lock is on
+// the old file and we go again.
+static Status open_locked(SafeWrite *sw, struct stat *st) {
+  for (int attempt = 0; attempt < LOCK_RETRIES; attempt++) {
+    int fd = open(sw->path, O_RDONLY);
+    if (fd < 0)
+      return ERROR_FILE_OPEN;
+    Status status = safe_write_lock(fd);
+    if (status != SUCCESS) {
+      close(fd);
+      return status;
+    }
+    struct stat now;
+    if (fstat(fd, st) == 0 && stat(sw->path, &now) == 0 &&
+        now.st_dev == st->st_dev && now.st_ino == st->st_ino) {
+      sw->fd = fd;
+      return SUCCESS;
+    }
+    close(fd);
+  }
+  return ERROR_CONFLICT;
+}
+
+Status safe_write_begin(SafeWrite *sw, const char *path) {
+  memset(sw, 0, sizeof(SafeWrite));
+  sw->path = path;
+  sw->fd = -1;
+  sw->tmp_fd = -1;
+  struct stat st;
+  TRACE_BEGIN(lock_start);
+  Status status = open_locked(sw, &st);
+  TRACE_END(lock_start, "lock", path, status);
+  if (status != SUCCESS)
+    return status;
+  sw->dev = st.st_dev;
+  sw->ino = st.st_ino;
+  sw->size = st.st_size;
+  sw->mtime = st.st_mtim;
+
+  // "<dir>/.<name>.XXXXXX": unique per writer, and on the same filesystem so
+  // the commit is a rename
+  const char *slash = strrchr(path, '/');
+  int dir_len = slash ? (int)(slash - path + 1) : 0;
+  if (snprintf(sw->tmp_path, sizeof(sw->tmp_path), "%.*s.%s.XXXXXX", dir_len,
+               path, path + dir_len) >= (int)sizeof(sw->tmp_path)) {
+    safe_write_abort(sw);
+    return ERROR_FILE_OPEN;
+  }
+  sw->tmp_fd = mkstemp(sw->tmp_path);
+  if (sw->tmp_fd < 0) {
+    sw->tmp_path[0] = '\0';
+    safe_write_abort(sw);
+    return ERROR_FILE_OPEN;
+  }
+  fchmod(sw->tmp_fd, st.st_mode & 07777);
+  return SUCCESS;
+}
+
+Status safe_write_commit(SafeWrite *sw) {
+  TRACE_MARK("commit", sw->path, sw->size);
+  // Optimistic check: the original is exactly as it was when we began
+  struct stat st;
+  if (fstat(sw->fd, &st) != 0 || st.st_size != sw->size ||
+      !same_mtime(&st, &sw->mtime)) {
+    safe_write_abort(sw);
+    return ERROR_CONFLICT;
+  }
+  if (close(sw->tmp_fd) != 0) {
+    sw->tmp_fd = -1;
+    safe_write_abort(sw);
+    return ERROR_WRITE_FAILED;
+  }
+  sw->tmp_fd = -1;
+
+#if defined(__linux__) && defined(RENAME_EXCHANGE)
+  // Swap the two names in one step, then make sure what came out is the file
+  // we read; if someone replaced it just now, swap back and report it
+  if (renameat2(AT_FDCWD, sw->tmp_path, AT_FDCWD, sw->path, RENAME_EXCHANGE) ==
+      0) {
+    struct stat old;
+    if (stat(sw->tmp_path, &old) != 0 || old.st_dev != sw->dev ||
+        old.st_ino != sw->ino) {
+      renameat2(AT_FDCWD, sw->tmp_path, AT_FDCWD, sw->path, RENAME_EXCHANGE);
+      safe_write_abort(sw);
+      return ERROR_CONFLICT;
+    }
+    unlink(sw->tmp_path);
+    close(sw->fd);
+    return SUCCESS;
+  }
+  // Filesystem without RENAME_EXCHANGE: plain atomic replace below
+#endif
+  struct stat now;
+  if (stat(sw->path, &now) != 0 || now.st_dev != sw->dev ||
+      now.st_ino != sw->ino) {
+    safe_write_abort(sw);
+    return ERROR_CONFLICT;
+  }
+  if (rename(sw->tmp_path, sw->path) != 0) {
+    safe_write_abort(sw);
+    return ERROR_WRITE_FAILED;
+  }
+  close(sw->fd);
+  return SUCCESS;
+}
+
+void safe_write_abort(SafeWrite *sw) {
+  if (sw->tmp_fd >= 0)
+    close(sw->tmp_fd);
+  if (sw->tmp_path[0])
+    unlink(sw->tmp_path);
+  if (sw->fd >= 0)
+    close(sw->fd);
+  sw->tmp_fd = -1;
+  sw->fd = -1;
+  sw->tmp_path[0] = '\0';
+}
@@ -0,0 +1,122 @@
+#include "../inc/string_pool.h"
+#include "../inc/hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_INITIAL_SLOTS 1024
+#define POOL_INITIAL_ARENA (64 * 1024)
+
+static uint32_t hash_string(const char *s, size_t len) {
+  return (uint32_t)xxh64(s, len, 0);
+}
+
+// Slot holding s, or the free slot where it would go
+static StringSlot *find_slot(const StringPool *pool, const char *s,
+                             uint32_t hash) {
+  size_t i = hash & pool->slot_mask;
+  for (;;) {
+    StringSlot *slot = &pool->slots[i];
+    if (slot->code == 0)
+      return slot;
+    if (slot->hash == hash &&
+        strcmp(pool->arena + pool->offsets[slot->code - 1], s) == 0)
+      return slot;
+    i = (i + 1) & pool->slot_mask;
+  }
+}
+
+static Status grow_slots(StringPool *pool) {
+  size_t count = (pool->slot_mask + 1) * 2;
+  StringSlot *slots = (StringSlot *)calloc(count, sizeof(StringSlot));
+  if (!slots)
+    return ERROR_MEM_ALLOC;
+  for (size_t i = 0; i <= pool->slot_mask; i++) {
+    StringSlot slot = pool->slots[i];
+    if (slot.code == 0)
+      continue;
+    size_t j = slot.hash & (count - 1);
+    while (slots[j].code != 0)
+      j = (j + 1) & (count - 1);
+    slots[j] = slot;
+  }
+  free(pool->slots);
+  pool->slots = slots;
+  pool->slot_mask = count - 1;
+  return SUCCESS;
+}
+
+Status string_pool_init(StringPool *pool) {
+  memset(pool, 0, sizeof(StringPool));
+  pool->slots = (StringSlot *)calloc(POOL_INITIAL_SLOTS, sizeof(StringSlot));
+  if (!pool->slots)
+    return ERROR_MEM_ALLOC;
+  pool->slot_mask = POOL_INITIAL_SLOTS - 1;
+  uint32_t empty;
+  return string_pool_intern(pool, "", &empty);
+}
+
+Status string_pool_intern(StringPool *pool, const char *s, uint32_t *code) {
+  if (!s)
+    s = "";
+  size_t len = strlen(s);
+  uint32_t hash = hash_string(s, len);
+  StringSlot *slot = find_slot(pool, s, hash);
+  if (slot->code != 0) {
+    *code = slot->code - 1;
+    return SUCCESS;
+  }
+
+  if (pool->arena_used + len + 1 > pool->arena_cap) {
+    size_t cap = pool->arena_cap ? pool->arena_cap * 2 : POOL_INITIAL_ARENA;
+    while (cap < pool->arena_used + len + 1)
+      cap *= 2;
+    if (cap > UINT32_MAX)
+      return ERROR_MEM_ALLOC;
+    char *arena = (char *)realloc(pool->arena, cap);
+    if (!arena)
+      return ERROR_MEM_ALLOC;
+    pool->arena = arena;
+    pool->arena_cap = cap;
+  }
+  if (pool->count == pool->capacity) {
+    uint32_t cap = pool->capacity ? pool->capacity * 2 : 256;
+    uint32_t *offsets =
+        (uint32_t *)realloc(pool->offsets, cap * sizeof(uint32_t));
+    if (!offsets)
+      return ERROR_MEM_ALLOC;
+    pool->offsets = offsets;
+    pool->capacity = cap;
+  }
+
+  memcpy(pool->arena + pool->arena_used, s, len + 1);
+  pool->offsets[pool->count] = (uint32_t)pool->arena_used;
+  pool->arena_used += len + 1;
+  slot->hash = hash;
+  slot->code = ++pool->count;
+  *code = pool->count - 1;
+
+  // Keep the index at most half full
+  if ((size_t)pool->count * 2 > pool->slot_mask + 1)
+    return grow_slots(pool);
+  return SUCCESS;
+}
+
+int string_pool_find(const StringPool *pool, const char *s, uint32_t *code) {
+  size_t len = strlen(s);
+  StringSlot *slot = find_slot(pool, s, hash_string(s, len));
+  if (slot->code == 0)
+    return 0;
+  *code = slot->code - 1;
+  return 1;
+}
+
+const char *string_pool_get(const StringPool *pool, uint32_t code) {
+  return pool->arena + pool->offsets[code];
+}
+
+void string_pool_free(StringPool *pool) {
+  free(pool->arena);
+  free(pool->offsets);
+  free(pool->slots);
+  memset(pool, 0, sizeof(StringPool));
+}
@@ -0,0 +1,204 @@
+#include "../inc/tag_clone.h"
+#include "../inc/id3_v2.h"
+#include "../inc/safe_write.h"
+#include "../inc/worker_pool.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+  CLONE_TITLE = 1 << 0,
+  CLONE_ARTIST = 1 << 1,
+  CLONE_ALBUM = 1 << 2,
+  CLONE_YEAR = 1 << 3,
+  CLONE_GENRE = 1 << 4,
+  CLONE_TRACK = 1 << 5,
+  CLONE_COMMENT = 1 << 6,
+  CLONE_ART = 1 << 7
+};
+
+static const char *const clone_names[] = {
+    "title", "artist", "album", "year", "genre", "track", "comment", "art"};
+
+typedef struct {
+  const FileList *targets;
+  int mask;
+  const unsigned char *shared; // Serialized source frames, never modified
+  size_t shared_len;
+  dev_t source_dev;
+  ino_t source_ino;
+  Status *results;
+} CloneBatch;
+
+// Bit mask from a comma separated field list, 0 if a name is unknown
+static int parse_fields(const char *list) {
+  int mask = 0;
+  const char *s = list;
+  while (*s) {
+    size_t len = strcspn(s, ",");
+    int bit = 0;
+    for (int i = 0; i < (int)(sizeof(clone_names) / sizeof(clone_names[0]));
+         i++) {
+      if (strlen(clone_names[i]) == len && strncmp(s, clone_names[i], len) == 0)
+        bit = 1 << i;
+    }
+    if (!bit)
+      return 0;
+    mask |= bit;
+    s += len;
+    if (*s == ',')
+      s++;
+  }
+  return mask;
+}
+
+// Clear fields of content, a shallow view whose strings still belong to the
+// original: with keep set, every field not in mask; otherwise those in mask
+static void select_fields(ID3v2_Content *content, int mask, int keep) {
+  int drop = keep ? ~mask : mask;
+  if (drop & CLONE_TITLE)
+    content->title = NULL;
+  if (drop & CLONE_ARTIST)
+    content->artist = NULL;
+  if (drop & CLONE_ALBUM)
+    content->album = NULL;
+  if (drop & CLONE_YEAR)
+    content->year = NULL;
+  if (drop & CLONE_GENRE)
+    content->genre = NULL;
+  if (drop & CLONE_TRACK)
+    content->track = NULL;
+  if (drop & CLONE_COMMENT)
+    content->comment = NULL;
+  if (drop & CLONE_ART)
+    memset(&content->image, 0, sizeof(ImageMetadata));
+  // Text cut short only matters for the fields still there (ID3V2_LOST_*
+  // follows the CLONE_* order)
+  content->text_lost &= ~(unsigned)drop;
+  if (keep) // Chapters belong to the source's own audio
+    memset(&content->chapters, 0, sizeof(ChapterTable));
+}
+
+static Status clone_one(const CloneBatch *batch, const char *path) {
+  SafeWrite sw;
+  Status status = safe_write_begin(&sw, path);
+  if (status != SUCCESS)
+    return status;
+  if (sw.dev == batch->source_dev && sw.ino == batch->source_ino) {
+    safe_write_abort(&sw); // The source already has its own tags
+    return SUCCESS;
+  }
+
+  // Only the target's own frames are planned here; the shared frames go in
+  // as one iovec, and the target's picture (possibly still in the file) last
+  ID3v2_Content content;
+  memset(&content, 0, sizeof(ID3v2_Content));
+  read_id3v2_tag(path, &content);
+  ID3v2_Content own = content;
+  select_fields(&own, batch->mask, 0);
+  ImageMetadata image = own.image;
+  memset(&own.image, 0, sizeof(ImageMetadata));
+
+  TagUpdate none;
+  memset(&none, 0, sizeof(TagUpdate));
+  Id3v2WritePlan plan;
+  plan_id3v2_tag(&plan, &own, &none);
+  plan_id3v2_frames(&plan, batch->shared, batch->shared_len);
+  plan_id3v2_image(&plan, &image);
+  status = write_id3v2_replace(&sw, &plan);
+  free_id3v2_content(&content);
+  if (status != SUCCESS) {
+    safe_write_abort(&sw);
+    return status;
+  }
+  return safe_write_commit(&sw);
+}
+
+static void clone_task(size_t i, void *ctx) {
+  CloneBatch *batch = (CloneBatch *)ctx;
+  batch->results[i] = clone_one(batch, batch->targets->paths[i]);
+}
+
+Status copy_tags_from(const char *source, const char *fields,
+                      const FileList *targets, int jobs) {
+  CloneBatch batch;
+  memset(&batch, 0, sizeof(CloneBatch));
+  batch.targets = targets;
+  batch.mask = parse_fields(fields ? fields : CLONE_DEFAULT_FIELDS);
+  if (!batch.mask) {
+    printf("Error: --fields takes a list of title, artist, album, year, "
+           "genre, track, comment, art\n");
+    return ERROR_INVALID_FORMAT;
+  }
+
+  // Parse and serialize the source exactly once
+  int fd = open(source, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    printf("Error: Could not open '%s'\n", source);
+    return ERROR_FILE_OPEN;
+  }
+  batch.source_dev = st.st_dev;
+  batch.source_ino = st.st_ino;
+  ID3v2_Content content;
+  memset(&content, 0, sizeof(ID3v2_Content));
+  Status status = read_id3v2_tag(source, &content);
+  unsigned char *shared = NULL;
+  if (status == SUCCESS) {
+    ID3v2_Content selected = content;
+    select_fields(&selected, batch.mask, 1);
+    status =
+        serialize_id3v2_frames(&selected, fd, &shared, &batch.shared_len);
+  }
+  free_id3v2_content(&content);
+  close(fd);
+  if (status == ERROR_MEM_ALLOC) {
+    printf("Error: The tag of '%s' is over --frame-cap/--mem-budget\n",
+           source);
+    return status;
+  } else if (status != SUCCESS) {
+    printf("Error: Could not read the ID3v2 tag of '%s'\n", source);
+    return status;
+  }
+  batch.shared = shared;
+
+  batch.results = (Status *)calloc(targets->count, sizeof(Status));
+  if (!batch.results) {
+    free(shared);
+    return ERROR_MEM_ALLOC;
+  }
+  run_parallel(targets->count, jobs, clone_task, &batch);
+
+  size_t failed = 0;
+  for (size_t i = 0; i < targets->count; i++) {
+    const char *outcome = "ok";
+    switch (batch.results[i]) {
+    case SUCCESS:
+      break;
+    case ERROR_FILE_BUSY:
+      outcome = "locked";
+      break;
+    case ERROR_CONFLICT:
+      outcome = "changed while writing";
+      break;
+    default:
+      outcome = "error";
+      break;
+    }
+    if (batch.results[i] != SUCCESS)
+      failed++;
+    printf("%s\t%s\n", targets->paths[i], outcome);
+  }
+  printf("------------------------------------------------------------\n");
+  printf("Targets: %zu  Shared frames: %zu bytes (serialized once)  "
+         "Errors: %zu\n",
+         targets->count, batch.shared_len, failed);
+  free(batch.results);
+  free(shared);
+  return failed ? ERROR_WRITE_FAILED : SUCCESS;
+}
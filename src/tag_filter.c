@@ -0,0 +1,184 @@
+#include "../inc/tag_filter.h"
+#include "../inc/file_util.h"
+#include "../inc/id3_v1.h"
+#include "../inc/id3_v2.h"
+#include "../inc/tail_tags.h"
+#include "../inc/trace.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#define FILTER_BUF_SIZE (1024 * 1024)
+#define V1_SIZE 128
+
+// Emit the trailing ID3v1 block: the held-back tail if it was a tag, merged
+// with the update, or a new tag when the stream had none.
+static Status write_trailer(int out_fd, const unsigned char *tail,
+                            const TagUpdate *update) {
+  ID3v1_Tag tag;
+  memset(&tag, 0, sizeof(ID3v1_Tag));
+  int had_tag = tail && parse_id3v1_tag(tail, &tag) == SUCCESS;
+  merge_id3v1_update(&tag, update, had_tag);
+
+  unsigned char buffer[V1_SIZE];
+  encode_id3v1_tag(&tag, buffer);
+  return write_all(out_fd, buffer, V1_SIZE);
+}
+
+// Copy [offset, end) of a regular file, in the kernel where possible
+static Status copy_range_loop(int in_fd, int out_fd, off_t offset, off_t end) {
+#ifdef __linux__
+  while (offset < end) {
+    size_t chunk = (size_t)(end - offset);
+    if (chunk > 0x7ffff000)
+      chunk = 0x7ffff000;
+    ssize_t n = sendfile(out_fd, in_fd, &offset, chunk);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      break; // Fall back to the buffered copy below
+    }
+  }
+#endif
+  if (offset < end) {
+    unsigned char *buf = (unsigned char *)malloc(FILTER_BUF_SIZE);
+    if (!buf)
+      return ERROR_MEM_ALLOC;
+    while (offset < end) {
+      size_t chunk = (size_t)(end - offset);
+      if (chunk > FILTER_BUF_SIZE)
+        chunk = FILTER_BUF_SIZE;
+      ssize_t n = pread(in_fd, buf, chunk, offset);
+      if (n <= 0 || write_all(out_fd, buf, (size_t)n) != SUCCESS) {
+        free(buf);
+        return ERROR_WRITE_FAILED;
+      }
+      offset += n;
+    }
+    free(buf);
+  }
+  return SUCCESS;
+}
+
+static Status copy_range(int in_fd, int out_fd, off_t offset, off_t end) {
+  TRACE_BEGIN(start);
+  Status status = copy_range_loop(in_fd, out_fd, offset, end);
+  TRACE_END(start, "copy", NULL, end - offset);
+  return status;
+}
+
+// Regular-file input: the audio range is known up front, so it can be moved
+// by the kernel without passing through userspace. The ID3v1 tag is
+// replaced where it stands; other trailing tags (APEv2, Lyrics3) are kept.
+static Status copy_seekable(int in_fd, int out_fd, off_t start, off_t size,
+                            const TagUpdate *update) {
+  TailTags tail;
+  if (probe_tail_tags(in_fd, size, start, &tail) != SUCCESS)
+    tail.v1_index = -1;
+  if (tail.v1_index < 0) {
+    Status status = copy_range(in_fd, out_fd, start, size);
+    if (status != SUCCESS)
+      return status;
+    return write_trailer(out_fd, NULL, update);
+  }
+
+  off_t tag = tail.blocks[tail.v1_index].offset;
+  Status status = copy_range(in_fd, out_fd, start, tag);
+  if (status == SUCCESS)
+    status = write_trailer(out_fd, tail.v1, update);
+  if (status == SUCCESS)
+    status = copy_range(in_fd, out_fd, tag + V1_SIZE, size);
+  return status;
+}
+
+// Pipe input: the end of the stream is unknown until EOF, so the last 128
+// bytes are always held back in case they turn out to be an ID3v1 tag.
+static Status copy_stream(int in_fd, int out_fd, const unsigned char *carry,
+                          size_t carry_len, const TagUpdate *update) {
+  unsigned char *buf = (unsigned char *)malloc(FILTER_BUF_SIZE + V1_SIZE);
+  if (!buf)
+    return ERROR_MEM_ALLOC;
+
+  size_t held = carry_len;
+  memcpy(buf, carry, carry_len);
+  for (;;) {
+    ssize_t r = read(in_fd, buf + held, FILTER_BUF_SIZE + V1_SIZE - held);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      free(buf);
+      return ERROR_INVALID_FORMAT;
+    }
+    if (r == 0)
+      break;
+    held += (size_t)r;
+    if (held > V1_SIZE) {
+      if (write_all(out_fd, buf, held - V1_SIZE) != SUCCESS) {
+        free(buf);
+        return ERROR_WRITE_FAILED;
+      }
+      memmove(buf, buf + held - V1_SIZE, V1_SIZE);
+      held = V1_SIZE;
+    }
+  }
+
+  const unsigned char *tail = NULL;
+  if (held == V1_SIZE && strncmp((char *)buf, "TAG", 3) == 0)
+    tail = buf;
+  else if (write_all(out_fd, buf, held) != SUCCESS) {
+    free(buf);
+    return ERROR_WRITE_FAILED;
+  }
+
+  Status status = write_trailer(out_fd, tail, update);
+  free(buf);
+  return status;
+}
+
+Status filter_id3_tags(FILE *in, FILE *out, const TagUpdate *update) {
+  if (!in || !out || !update)
+    return ERROR_INVALID_FORMAT;
+#ifdef _WIN32
+  _setmode(_fileno(in), _O_BINARY);
+  _setmode(_fileno(out), _O_BINARY);
+#endif
+  // Unbuffered so the descriptor offset matches what the tag parser consumed
+  setvbuf(in, NULL, _IONBF, 0);
+  int in_fd = fileno(in);
+  int out_fd = fileno(out);
+
+  unsigned char header[10];
+  size_t header_len = fread(header, 1, 10, in);
+
+  ID3v2_Content content;
+  memset(&content, 0, sizeof(ID3v2_Content));
+  int has_v2 = header_len == 10 && strncmp((char *)header, "ID3", 3) == 0;
+  if (has_v2 && read_id3v2_stream(in, header, &content) != SUCCESS) {
+    free_id3v2_content(&content);
+    return ERROR_INVALID_FORMAT;
+  }
+
+  Id3v2WritePlan plan;
+  plan_id3v2_tag(&plan, &content, update);
+  Status status = fflush(out) == 0 ? write_id3v2_plan(out_fd, &plan, in_fd)
+                                   : ERROR_WRITE_FAILED;
+  free_id3v2_content(&content);
+  if (status != SUCCESS)
+    return status;
+
+  struct stat st;
+  off_t start = has_v2 ? lseek(in_fd, 0, SEEK_CUR) : 0;
+  if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode) && start >= 0)
+    return copy_seekable(in_fd, out_fd, start, st.st_size, update);
+  return copy_stream(in_fd, out_fd, header, has_v2 ? 0 : header_len, update);
+}
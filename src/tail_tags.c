@@ -0,0 +1,145 @@
+#include "../inc/tail_tags.h"
+#include "../inc/io_budget.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LYRICS3V1_MAX 5100 // Largest Lyrics3 v1 block, markers excluded
+
+typedef struct {
+  const unsigned char *buf;
+  off_t base; // File offset of buf[0]
+  off_t end;  // File offset just past the window
+} TailWindow;
+
+// Pointer to len bytes at file offset off, or NULL if not in the window
+static const unsigned char *tail_at(const TailWindow *w, off_t off,
+                                    off_t len) {
+  if (off < w->base || off + len > w->end)
+    return NULL;
+  return w->buf + (off - w->base);
+}
+
+static uint32_t le32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+// Size of the trailing block ending at pos, 0 if there is none
+static off_t block_before(const TailWindow *w, off_t pos, off_t floor,
+                          int want_v1, TailTagType *type) {
+  off_t room = pos - floor;
+  const unsigned char *p;
+
+  if (want_v1 && room >= 128 && (p = tail_at(w, pos - 128, 3)) &&
+      memcmp(p, "TAG", 3) == 0) {
+    *type = TAIL_ID3V1;
+    return 128;
+  }
+
+  if (room >= 32 && (p = tail_at(w, pos - 32, 32)) &&
+      memcmp(p, "APETAGEX", 8) == 0) {
+    off_t size = le32(p + 12); // Items and footer
+    if (le32(p + 20) & 0x80000000u)
+      size += 32; // Header present
+    if (size >= 32 && size <= room) {
+      *type = TAIL_APEV2;
+      return size;
+    }
+  }
+
+  if (room >= 15 && (p = tail_at(w, pos - 15, 15)) &&
+      memcmp(p + 6, "LYRICS200", 9) == 0) {
+    off_t size = 0;
+    int digits = 1;
+    for (int i = 0; i < 6; i++) {
+      digits &= isdigit(p[i]) != 0;
+      size = size * 10 + (p[i] - '0');
+    }
+    size += 15;
+    const unsigned char *begin = tail_at(w, pos - size, 11);
+    if (digits && size > 26 && size <= room &&
+        (!begin || memcmp(begin, "LYRICSBEGIN", 11) == 0)) {
+      *type = TAIL_LYRICS3;
+      return size;
+    }
+  }
+
+  if (room >= 20 && (p = tail_at(w, pos - 9, 9)) &&
+      memcmp(p, "LYRICSEND", 9) == 0) {
+    off_t lowest = pos - 9 - LYRICS3V1_MAX - 11;
+    for (off_t off = pos - 20; off >= lowest && off >= floor; off--) {
+      const unsigned char *begin = tail_at(w, off, 11);
+      if (!begin)
+        break;
+      if (memcmp(begin, "LYRICSBEGIN", 11) == 0) {
+        *type = TAIL_LYRICS3;
+        return pos - off;
+      }
+    }
+  }
+
+  if (room >= 20 && (p = tail_at(w, pos - 10, 10)) &&
+      memcmp(p, "3DI", 3) == 0 && p[3] == 4 &&
+      ((p[6] | p[7] | p[8] | p[9]) & 0x80) == 0) {
+    off_t size = 20 + ((off_t)p[6] << 21 | (off_t)p[7] << 14 |
+                       (off_t)p[8] << 7 | (off_t)p[9]);
+    const unsigned char *header = tail_at(w, pos - size, 3);
+    if (size <= room && (!header || memcmp(header, "ID3", 3) == 0)) {
+      *type = TAIL_ID3V2;
+      return size;
+    }
+  }
+  return 0;
+}
+
+Status probe_tail_tags(int fd, off_t size, off_t floor, TailTags *tail) {
+  memset(tail, 0, sizeof(TailTags));
+  tail->audio_end = size;
+  tail->v1_index = -1;
+  if (floor < 0 || floor >= size)
+    return SUCCESS;
+
+  TailWindow w;
+  off_t len = size - floor < TAIL_PROBE_SIZE ? size - floor : TAIL_PROBE_SIZE;
+  unsigned char *buf = (unsigned char *)malloc((size_t)len);
+  if (!buf)
+    return ERROR_MEM_ALLOC;
+  w.base = size - len;
+  w.end = size;
+  w.buf = buf;
+  if (pread(fd, buf, (size_t)len, w.base) != (ssize_t)len) {
+    free(buf);
+    return ERROR_INVALID_FORMAT;
+  }
+  io_charge_read((uint64_t)len);
+
+  off_t pos = size;
+  TailTagType type;
+  off_t block;
+  while (tail->count < TAIL_MAX_BLOCKS &&
+         (block = block_before(&w, pos, floor, tail->v1_index < 0, &type)) >
+             0) {
+    pos -= block;
+    if (type == TAIL_ID3V1) {
+      tail->v1_index = tail->count;
+      memcpy(tail->v1, tail_at(&w, pos, 128), 128);
+    }
+    tail->blocks[tail->count].type = type;
+    tail->blocks[tail->count].offset = pos;
+    tail->blocks[tail->count].size = block;
+    tail->count++;
+  }
+  tail->audio_end = pos;
+  free(buf);
+  return SUCCESS;
+}
+
+const TailBlock *find_tail_block(const TailTags *tail, TailTagType type) {
+  for (int i = 0; i < tail->count; i++) {
+    if (tail->blocks[i].type == type)
+      return &tail->blocks[i];
+  }
+  return NULL;
+}
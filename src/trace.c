@@ -0,0 +1,168 @@
+#include "../inc/trace.h"
+
+#ifdef MP3TAG_TRACE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  uint64_t start; // ns since trace_start
+  uint64_t duration;
+  const char *name; // Static string
+  int64_t value;
+  char phase; // 'X' span, 'i' instant
+  char detail[TRACE_DETAIL_SIZE];
+} TraceEvent;
+
+typedef struct TraceRing {
+  TraceEvent *events;
+  uint64_t written; // Events ever recorded; the ring holds the last ones
+  int tid;
+  struct TraceRing *next;
+} TraceRing;
+
+static int recording;
+static uint64_t base_ns;
+static const char *trace_path;
+static TraceRing *rings;
+static int ring_count;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local TraceRing *own_ring;
+
+static uint64_t clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t trace_now(void) { return recording ? clock_ns() : 0; }
+
+// The calling thread's ring, registered on first use
+static TraceRing *thread_ring(void) {
+  if (own_ring)
+    return own_ring;
+  TraceRing *ring = (TraceRing *)calloc(1, sizeof(TraceRing));
+  if (!ring)
+    return NULL;
+  ring->events = (TraceEvent *)malloc(TRACE_RING_EVENTS * sizeof(TraceEvent));
+  if (!ring->events) {
+    free(ring);
+    return NULL;
+  }
+  pthread_mutex_lock(&rings_lock);
+  ring->tid = ++ring_count;
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+  own_ring = ring;
+  return ring;
+}
+
+static void record(char phase, const char *name, uint64_t start,
+                   uint64_t end, const char *detail, int64_t value) {
+  TraceRing *ring = thread_ring();
+  if (!ring)
+    return;
+  TraceEvent *e = &ring->events[ring->written++ % TRACE_RING_EVENTS];
+  e->start = start - base_ns;
+  e->duration = end - start;
+  e->name = name;
+  e->value = value;
+  e->phase = phase;
+  e->detail[0] = '\0';
+  if (detail) {
+    // Keep the end of a long path: the file name is what identifies it
+    size_t len = strlen(detail);
+    if (len >= sizeof(e->detail))
+      detail += len - (sizeof(e->detail) - 1);
+    strcpy(e->detail, detail);
+  }
+}
+
+void trace_span(const char *name, uint64_t start, const char *detail,
+                int64_t value) {
+  if (recording && start)
+    record('X', name, start, clock_ns(), detail, value);
+}
+
+void trace_mark(const char *name, const char *detail, int64_t value) {
+  if (recording) {
+    uint64_t now = clock_ns();
+    record('i', name, now, now, detail, value);
+  }
+}
+
+static void write_json_string(FILE *fp, const char *s) {
+  fputc('"', fp);
+  for (; *s; s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+// Chrome trace-event format: one object per event, times in microseconds
+static void export_trace(void) {
+  recording = 0;
+  FILE *fp = fopen(trace_path, "w");
+  if (!fp) {
+    fprintf(stderr, "Error: Could not write trace '%s'\n", trace_path);
+    return;
+  }
+  uint64_t total = 0, dropped = 0;
+  int first = 1;
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (TraceRing *ring = rings; ring; ring = ring->next) {
+    fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+            first ? "" : ",\n", ring->tid, ring->tid);
+    first = 0;
+    uint64_t begin = 0;
+    if (ring->written > TRACE_RING_EVENTS) {
+      begin = ring->written - TRACE_RING_EVENTS;
+      dropped += begin;
+    }
+    for (uint64_t n = begin; n < ring->written; n++) {
+      const TraceEvent *e = &ring->events[n % TRACE_RING_EVENTS];
+      fprintf(fp, ",\n{\"name\":");
+      write_json_string(fp, e->name);
+      fprintf(fp, ",\"ph\":\"%c\",\"ts\":%.3f,", e->phase, e->start / 1000.0);
+      if (e->phase == 'X')
+        fprintf(fp, "\"dur\":%.3f,", e->duration / 1000.0);
+      else
+        fprintf(fp, "\"s\":\"t\",");
+      fprintf(fp, "\"pid\":1,\"tid\":%d,\"args\":{\"value\":%lld", ring->tid,
+              (long long)e->value);
+      if (e->detail[0]) {
+        fprintf(fp, ",\"detail\":");
+        write_json_string(fp, e->detail);
+      }
+      fprintf(fp, "}}");
+      total++;
+    }
+  }
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+  fprintf(stderr, "Trace: %llu events (%llu overwritten) written to '%s'\n",
+          (unsigned long long)total, (unsigned long long)dropped, trace_path);
+}
+
+Status trace_start(const char *out_path) {
+  trace_path = out_path;
+  base_ns = clock_ns();
+  recording = 1;
+  if (atexit(export_trace) != 0) {
+    recording = 0;
+    return ERROR_MEM_ALLOC;
+  }
+  return SUCCESS;
+}
+
+#endif // MP3TAG_TRACE
@@ -0,0 +1,455 @@
+#include "../inc/track_query.h"
+#include "../inc/catalog.h"
+#include "../inc/track_table.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define QUERY_MAX_CLAUSES 16
+#define GROUP_SHOW_VALUES 8 // Distinct values listed per reported group
+
+typedef enum { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE, OP_MATCH } QueryOp;
+
+typedef struct {
+  int field;
+  QueryOp op;
+  const char *value;
+  double number;
+  int is_number; // value parsed completely as a number
+} Predicate;
+
+static char *trim(char *s) {
+  while (isspace((unsigned char)*s))
+    s++;
+  size_t len = strlen(s);
+  while (len > 0 && isspace((unsigned char)s[len - 1]))
+    s[--len] = '\0';
+  return s;
+}
+
+// "<field> <op> <value>", value optionally quoted
+static int parse_clause(char *clause, Predicate *p) {
+  static const struct {
+    const char *text;
+    QueryOp op;
+  } ops[] = {{"!=", OP_NE}, {"<=", OP_LE}, {">=", OP_GE}, {"=", OP_EQ},
+             {"<", OP_LT},  {">", OP_GT},  {"~", OP_MATCH}};
+
+  char *name = trim(clause);
+  char *name_end = name;
+  while (isalnum((unsigned char)*name_end)) {
+    *name_end = (char)tolower((unsigned char)*name_end);
+    name_end++;
+  }
+  char *op = name_end;
+  while (isspace((unsigned char)*op))
+    op++;
+  size_t i;
+  for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    if (strncmp(op, ops[i].text, strlen(ops[i].text)) == 0)
+      break;
+  }
+  if (i == sizeof(ops) / sizeof(ops[0]))
+    return 0;
+  p->op = ops[i].op;
+  char *value = trim(op + strlen(ops[i].text));
+  *name_end = '\0';
+
+  p->field = track_field_lookup(name);
+  if (p->field < 0)
+    return 0;
+  size_t len = strlen(value);
+  if (len >= 2 && (value[0] == '"' || value[0] == '\'') &&
+      value[len - 1] == value[0]) {
+    value[len - 1] = '\0';
+    value++;
+  }
+  p->value = value;
+  char *end;
+  p->number = strtod(value, &end);
+  p->is_number = *value != '\0' && *end == '\0';
+  // Numeric columns only compare against numbers
+  if (p->field >= FIELD_TEXT_COUNT && (!p->is_number || p->op == OP_MATCH))
+    return 0;
+  return 1;
+}
+
+// Split on the word "and" (any case), except inside a quoted value
+static int parse_where(char *where, Predicate *preds) {
+  int count = 0;
+  char *clause = where;
+  char quote = 0; // Quote character of the open value, if any
+  char prev = 0;  // Last non-space character before s in the clause
+  for (char *s = where;; s++) {
+    if (quote) {
+      if (*s == quote)
+        quote = 0;
+      if (*s != '\0')
+        continue;
+    } else if ((*s == '"' || *s == '\'') && prev && strchr("=<>!~", prev)) {
+      quote = *s; // Right after the operator it opens a quoted value
+      continue;
+    }
+    if (!isspace((unsigned char)*s))
+      prev = *s;
+    int at_and = isspace((unsigned char)s[0]) &&
+                 strncasecmp(s + 1, "and", 3) == 0 &&
+                 isspace((unsigned char)s[4]);
+    if (!at_and && *s != '\0')
+      continue;
+    int last = *s == '\0';
+    *s = '\0';
+    char shown[128];
+    snprintf(shown, sizeof(shown), "%s", trim(clause));
+    if (count == QUERY_MAX_CLAUSES || !parse_clause(clause, &preds[count])) {
+      printf("Error: Invalid --where clause '%s'\n", shown);
+      return -1;
+    }
+    count++;
+    if (last)
+      break;
+    s += 4;
+    clause = s + 1;
+    prev = 0;
+  }
+  return count;
+}
+
+static int contains_nocase(const char *haystack, const char *needle) {
+  size_t n = strlen(needle);
+  for (; *haystack; haystack++) {
+    if (strncasecmp(haystack, needle, n) == 0)
+      return 1;
+  }
+  return n == 0;
+}
+
+static int compare_result(QueryOp op, int cmp) {
+  switch (op) {
+  case OP_EQ:
+    return cmp == 0;
+  case OP_NE:
+    return cmp != 0;
+  case OP_LT:
+    return cmp < 0;
+  case OP_LE:
+    return cmp <= 0;
+  case OP_GT:
+    return cmp > 0;
+  case OP_GE:
+    return cmp >= 0;
+  default:
+    return 0;
+  }
+}
+
+// Predicate on one distinct string. Ordering against a number compares the
+// leading number of the value ("2003", "7/12"); values without one fail.
+static int match_text(const Predicate *p, const char *text) {
+  if (p->op == OP_MATCH)
+    return contains_nocase(text, p->value);
+  if (p->is_number && p->op != OP_EQ && p->op != OP_NE) {
+    char *end;
+    double v = strtod(text, &end);
+    if (end == text)
+      return 0;
+    return compare_result(p->op, (v > p->number) - (v < p->number));
+  }
+  return compare_result(p->op, strcmp(text, p->value));
+}
+
+#define FILTER_COLUMN(col, n, op, v, mask)                                     \
+  do {                                                                         \
+    switch (op) {                                                              \
+    case OP_EQ:                                                                \
+      for (size_t i = 0; i < (n); i++)                                         \
+        (mask)[i] &= (col)[i] == (v);                                          \
+      break;                                                                   \
+    case OP_NE:                                                                \
+      for (size_t i = 0; i < (n); i++)                                         \
+        (mask)[i] &= (col)[i] != (v);                                          \
+      break;                                                                   \
+    case OP_LT:                                                                \
+      for (size_t i = 0; i < (n); i++)                                         \
+        (mask)[i] &= (col)[i] < (v);                                           \
+      break;                                                                   \
+    case OP_LE:                                                                \
+      for (size_t i = 0; i < (n); i++)                                         \
+        (mask)[i] &= (col)[i] <= (v);                                          \
+      break;                                                                   \
+    case OP_GT:                                                                \
+      for (size_t i = 0; i < (n); i++)                                         \
+        (mask)[i] &= (col)[i] > (v);                                           \
+      break;                                                                   \
+    case OP_GE:                                                                \
+      for (size_t i = 0; i < (n); i++)                                         \
+        (mask)[i] &= (col)[i] >= (v);                                          \
+      break;                                                                   \
+    default:                                                                   \
+      break;                                                                   \
+    }                                                                          \
+  } while (0)
+
+// AND one predicate into the selection mask, a whole column at a time. Text
+// predicates are decided once per distinct string, then applied to the codes.
+static Status apply_predicate(const TrackTable *t, const Predicate *p,
+                              uint8_t *mask) {
+  size_t n = t->rows;
+  if (p->field < FIELD_TEXT_COUNT) {
+    const uint32_t *codes = t->text[p->field];
+    uint32_t code;
+    if (p->op == OP_EQ || p->op == OP_NE) {
+      if (!string_pool_find(&t->strings, p->value, &code)) {
+        if (p->op == OP_EQ)
+          memset(mask, 0, n);
+        return SUCCESS;
+      }
+      FILTER_COLUMN(codes, n, p->op, code, mask);
+      return SUCCESS;
+    }
+    uint8_t *hit = (uint8_t *)malloc(t->strings.count);
+    if (!hit)
+      return ERROR_MEM_ALLOC;
+    for (uint32_t c = 0; c < t->strings.count; c++)
+      hit[c] = (uint8_t)match_text(p, string_pool_get(&t->strings, c));
+    for (size_t i = 0; i < n; i++)
+      mask[i] &= hit[codes[i]];
+    free(hit);
+    return SUCCESS;
+  }
+
+  switch (p->field) {
+  case FIELD_TAG:
+    FILTER_COLUMN(t->tag, n, p->op, p->number, mask);
+    break;
+  case FIELD_BITRATE:
+    FILTER_COLUMN(t->bitrate, n, p->op, p->number, mask);
+    break;
+  case FIELD_SAMPLE_RATE:
+    FILTER_COLUMN(t->sample_rate, n, p->op, p->number, mask);
+    break;
+  case FIELD_DURATION:
+    FILTER_COLUMN(t->duration, n, p->op, p->number, mask);
+    break;
+  case FIELD_SIZE:
+    FILTER_COLUMN(t->size, n, p->op, p->number, mask);
+    break;
+  }
+  return SUCCESS;
+}
+
+static void format_time(double seconds, char *buf, size_t size) {
+  long s = (long)(seconds + 0.5);
+  snprintf(buf, size, "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+}
+
+// Grouping key of a row: the string code, or the (whole) number
+static uint64_t row_key(const TrackTable *t, int field, size_t row) {
+  if (field < FIELD_TEXT_COUNT)
+    return t->text[field][row];
+  return (uint64_t)(track_field_number(t, field, row) + 0.5);
+}
+
+static void format_key(const TrackTable *t, int field, uint64_t key,
+                       char *buf, size_t size) {
+  if (field < FIELD_TEXT_COUNT) {
+    const char *s = string_pool_get(&t->strings, (uint32_t)key);
+    snprintf(buf, size, "%s", *s ? s : "(none)");
+  } else {
+    snprintf(buf, size, "%llu", (unsigned long long)key);
+  }
+}
+
+typedef struct {
+  uint64_t key;
+  uint64_t sub; // Key of the --distinct field
+  size_t row;
+} GroupItem;
+
+typedef struct {
+  uint64_t key;
+  size_t first; // Index of the first item
+  size_t count;
+  size_t distinct;
+  double duration;
+} Group;
+
+static int compare_items(const void *a, const void *b) {
+  const GroupItem *x = (const GroupItem *)a;
+  const GroupItem *y = (const GroupItem *)b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  if (x->sub != y->sub)
+    return x->sub < y->sub ? -1 : 1;
+  return x->row < y->row ? -1 : x->row > y->row;
+}
+
+static int compare_groups(const void *a, const void *b) {
+  const Group *x = (const Group *)a;
+  const Group *y = (const Group *)b;
+  if (x->count != y->count)
+    return x->count > y->count ? -1 : 1;
+  return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static Status report_groups(const TrackTable *t, const size_t *rows,
+                            size_t matched, int field, int distinct) {
+  GroupItem *items = (GroupItem *)malloc((matched + 1) * sizeof(GroupItem));
+  Group *groups = (Group *)malloc((matched + 1) * sizeof(Group));
+  if (!items || !groups) {
+    free(items);
+    free(groups);
+    return ERROR_MEM_ALLOC;
+  }
+  for (size_t i = 0; i < matched; i++) {
+    items[i].key = row_key(t, field, rows[i]);
+    items[i].sub = distinct >= 0 ? row_key(t, distinct, rows[i]) : 0;
+    items[i].row = rows[i];
+  }
+  qsort(items, matched, sizeof(GroupItem), compare_items);
+
+  size_t group_count = 0;
+  for (size_t i = 0; i < matched; i++) {
+    if (i == 0 || items[i].key != items[i - 1].key) {
+      Group *g = &groups[group_count++];
+      g->key = items[i].key;
+      g->first = i;
+      g->count = 0;
+      g->distinct = 0;
+      g->duration = 0;
+    }
+    Group *g = &groups[group_count - 1];
+    if (g->count == 0 || items[i].sub != items[i - 1].sub)
+      g->distinct++;
+    g->count++;
+    g->duration += t->duration[items[i].row];
+  }
+  qsort(groups, group_count, sizeof(Group), compare_groups);
+
+  size_t reported = 0;
+  char label[256], when[32];
+  for (size_t g = 0; g < group_count; g++) {
+    if (distinct >= 0 && groups[g].distinct < 2)
+      continue;
+    reported++;
+    format_key(t, field, groups[g].key, label, sizeof(label));
+    format_time(groups[g].duration, when, sizeof(when));
+    printf("%8zu  %10s  %s", groups[g].count, when, label);
+    if (distinct >= 0) {
+      printf("  [%s:", track_field_name(distinct));
+      size_t shown = 0;
+      const GroupItem *it = &items[groups[g].first];
+      for (size_t k = 0; k < groups[g].count; k++) {
+        if (k > 0 && it[k].sub == it[k - 1].sub)
+          continue;
+        if (shown++ == GROUP_SHOW_VALUES) {
+          printf(" ...");
+          break;
+        }
+        format_key(t, distinct, it[k].sub, label, sizeof(label));
+        printf(" %s", label);
+      }
+      printf("]");
+    }
+    printf("\n");
+  }
+  printf("------------------------------------------------------------\n");
+  if (distinct >= 0)
+    printf("Groups with more than one %s: %zu of %zu\n",
+           track_field_name(distinct), reported, group_count);
+  else
+    printf("Groups: %zu  Tracks: %zu\n", group_count, matched);
+  free(items);
+  free(groups);
+  return SUCCESS;
+}
+
+static void report_rows(const TrackTable *t, const size_t *rows,
+                        size_t matched) {
+  const StringPool *pool = &t->strings;
+  double total = 0;
+  char when[32];
+  for (size_t i = 0; i < matched; i++) {
+    size_t r = rows[i];
+    format_time(t->duration[r], when, sizeof(when));
+    printf("%s\t%s\t%s\t%s\t%s\t%u\t%s\n", t->files->paths[r],
+           string_pool_get(pool, t->text[FIELD_ARTIST][r]),
+           string_pool_get(pool, t->text[FIELD_ALBUM][r]),
+           string_pool_get(pool, t->text[FIELD_TITLE][r]),
+           string_pool_get(pool, t->text[FIELD_YEAR][r]), t->bitrate[r], when);
+    total += t->duration[r];
+  }
+  format_time(total, when, sizeof(when));
+  printf("------------------------------------------------------------\n");
+  printf("Matched: %zu of %zu tracks  Total time: %s\n", matched, t->rows,
+         when);
+}
+
+Status query_tracks(const FileList *files, const char *catalog,
+                    const char *where, const char *group_by,
+                    const char *distinct, int jobs) {
+  Predicate preds[QUERY_MAX_CLAUSES];
+  int pred_count = 0;
+  char *where_copy = NULL;
+  if (where) {
+    where_copy = strdup(where);
+    if (!where_copy)
+      return ERROR_MEM_ALLOC;
+    pred_count = parse_where(where_copy, preds);
+    if (pred_count < 0) {
+      free(where_copy);
+      return ERROR_INVALID_FORMAT;
+    }
+  }
+  int group_field = group_by ? track_field_lookup(group_by) : -1;
+  int distinct_field = distinct ? track_field_lookup(distinct) : -1;
+  if ((group_by && group_field < 0) || (distinct && distinct_field < 0)) {
+    printf("Error: Unknown field '%s'\n",
+           group_by && group_field < 0 ? group_by : distinct);
+    free(where_copy);
+    return ERROR_INVALID_FORMAT;
+  }
+
+  TrackTable table;
+  FileList listed; // The catalog's paths
+  file_list_init(&listed);
+  Status status = catalog ? load_catalog_tracks(catalog, &listed, &table)
+                          : track_table_load(&table, files, jobs);
+  if (catalog && status != SUCCESS && status != ERROR_MEM_ALLOC)
+    printf("Error: '%s' is not a readable catalog\n", catalog);
+  uint8_t *mask = NULL;
+  size_t *rows = NULL;
+  if (status == SUCCESS) {
+    mask = (uint8_t *)malloc(table.rows);
+    rows = (size_t *)malloc(table.rows * sizeof(size_t));
+    if (!mask || !rows)
+      status = ERROR_MEM_ALLOC;
+  }
+  if (status == SUCCESS) {
+    memset(mask, 1, table.rows);
+    for (int p = 0; p < pred_count && status == SUCCESS; p++)
+      status = apply_predicate(&table, &preds[p], mask);
+  }
+  if (status == SUCCESS) {
+    size_t matched = 0;
+    for (size_t i = 0; i < table.rows; i++) {
+      rows[matched] = i;
+      matched += mask[i];
+    }
+    if (group_field >= 0)
+      status = report_groups(&table, rows, matched, group_field,
+                             distinct_field);
+    else
+      report_rows(&table, rows, matched);
+  }
+  if (status == ERROR_MEM_ALLOC)
+    printf("Error: Out of memory building the track table.\n");
+  free(mask);
+  free(rows);
+  track_table_free(&table);
+  file_list_free(&listed);
+  free(where_copy);
+  return status;
+}
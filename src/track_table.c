@@ -0,0 +1,161 @@
+#include "../inc/track_table.h"
+#include "../inc/id3_reader.h"
+#include "../inc/id3_v1.h"
+#include "../inc/id3_v2.h"
+#include "../inc/mpeg_reader.h"
+#include "../inc/worker_pool.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *const field_names[FIELD_COUNT] = {
+    "title", "artist", "album",      "year",     "genre", "track",
+    "comment", "tag",  "bitrate", "samplerate", "duration", "size"};
+
+int track_field_lookup(const char *name) {
+  for (int i = 0; i < FIELD_COUNT; i++) {
+    if (strcmp(name, field_names[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+const char *track_field_name(int field) { return field_names[field]; }
+
+double track_field_number(const TrackTable *table, int field, size_t row) {
+  switch (field) {
+  case FIELD_TAG:
+    return table->tag[row];
+  case FIELD_BITRATE:
+    return table->bitrate[row];
+  case FIELD_SAMPLE_RATE:
+    return table->sample_rate[row];
+  case FIELD_DURATION:
+    return table->duration[row];
+  case FIELD_SIZE:
+    return (double)table->size[row];
+  }
+  return 0;
+}
+
+typedef struct {
+  TrackTable *table;
+  pthread_mutex_t lock; // Guards the string pool
+  Status status;
+} LoadContext;
+
+// ID3v1 fields are space padded
+static void trim_v1_field(char *s) {
+  size_t len = strlen(s);
+  while (len > 0 && s[len - 1] == ' ')
+    s[--len] = '\0';
+}
+
+static void load_track(size_t i, void *arg) {
+  LoadContext *ctx = (LoadContext *)arg;
+  TrackTable *t = ctx->table;
+  const char *path = t->files->paths[i];
+
+  // One probe of the trailing tags serves all three readers
+  TailTags probed;
+  const TailTags *tail =
+      probe_file_tail(path, &probed) == SUCCESS ? &probed : NULL;
+  MpegInfo info;
+  memset(&info, 0, sizeof(MpegInfo));
+  read_mpeg_info_tail(path, tail, &info);
+  ID3v2_Content v2;
+  memset(&v2, 0, sizeof(ID3v2_Content));
+  int has_v2 = read_id3v2_tag_tail(path, tail, &v2) == SUCCESS;
+  ID3v1_Tag v1;
+  memset(&v1, 0, sizeof(ID3v1_Tag));
+  int has_v1 = (tail ? read_id3v1_from_tail(tail, &v1)
+                     : read_id3v1_tag(path, &v1)) == SUCCESS;
+
+  char v1_genre[8] = "";
+  if (has_v1) {
+    trim_v1_field(v1.title);
+    trim_v1_field(v1.artist);
+    trim_v1_field(v1.album);
+    trim_v1_field(v1.year);
+    trim_v1_field(v1.comment);
+    if (v1.genre != 255)
+      snprintf(v1_genre, sizeof(v1_genre), "(%d)", v1.genre);
+  }
+  const char *text[FIELD_TEXT_COUNT] = {
+      v2.title ? v2.title : v1.title,
+      v2.artist ? v2.artist : v1.artist,
+      v2.album ? v2.album : v1.album,
+      v2.year ? v2.year : v1.year,
+      v2.genre ? v2.genre : v1_genre,
+      v2.track,
+      v2.comment ? v2.comment : v1.comment};
+
+  pthread_mutex_lock(&ctx->lock);
+  for (int f = 0; f < FIELD_TEXT_COUNT; f++) {
+    if (string_pool_intern(&t->strings, text[f], &t->text[f][i]) != SUCCESS)
+      ctx->status = ERROR_MEM_ALLOC;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  t->tag[i] = has_v2 ? (uint8_t)v2.major_version : has_v1 ? 1 : 0;
+  t->bitrate[i] = (uint16_t)info.bitrate;
+  t->sample_rate[i] = (uint16_t)info.sample_rate;
+  t->duration[i] = (float)info.duration;
+  t->size[i] = info.filesize;
+  if (has_v2)
+    free_id3v2_content(&v2);
+}
+
+Status track_table_init(TrackTable *table, const FileList *files) {
+  memset(table, 0, sizeof(TrackTable));
+  table->files = files;
+  table->rows = files->count;
+  size_t n = files->count;
+  int ok = 1;
+  for (int f = 0; f < FIELD_TEXT_COUNT; f++) {
+    table->text[f] = (uint32_t *)calloc(n, sizeof(uint32_t));
+    ok &= table->text[f] != NULL;
+  }
+  table->tag = (uint8_t *)calloc(n, sizeof(uint8_t));
+  table->bitrate = (uint16_t *)calloc(n, sizeof(uint16_t));
+  table->sample_rate = (uint16_t *)calloc(n, sizeof(uint16_t));
+  table->duration = (float *)calloc(n, sizeof(float));
+  table->size = (int64_t *)calloc(n, sizeof(int64_t));
+  if (string_pool_init(&table->strings) != SUCCESS || !ok || !table->tag ||
+      !table->bitrate || !table->sample_rate || !table->duration ||
+      !table->size) {
+    track_table_free(table);
+    return ERROR_MEM_ALLOC;
+  }
+  return SUCCESS;
+}
+
+Status track_table_load(TrackTable *table, const FileList *files, int jobs) {
+  Status status = track_table_init(table, files);
+  if (status != SUCCESS)
+    return status;
+  size_t n = files->count;
+
+  LoadContext ctx;
+  ctx.table = table;
+  ctx.status = SUCCESS;
+  pthread_mutex_init(&ctx.lock, NULL);
+  run_parallel(n, jobs, load_track, &ctx);
+  pthread_mutex_destroy(&ctx.lock);
+  if (ctx.status != SUCCESS)
+    track_table_free(table);
+  return ctx.status;
+}
+
+void track_table_free(TrackTable *table) {
+  string_pool_free(&table->strings);
+  for (int f = 0; f < FIELD_TEXT_COUNT; f++)
+    free(table->text[f]);
+  free(table->tag);
+  free(table->bitrate);
+  free(table->sample_rate);
+  free(table->duration);
+  free(table->size);
+  memset(table, 0, sizeof(TrackTable));
+}
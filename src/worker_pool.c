@@ -0,0 +1,55 @@
+#include "../inc/worker_pool.h"
+#include "../inc/trace.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef struct {
+  size_t count;
+  size_t next;
+  void (*fn)(size_t i, void *ctx);
+  void *ctx;
+  pthread_mutex_t lock;
+} WorkQueue;
+
+static void *pool_worker(void *arg) {
+  WorkQueue *q = (WorkQueue *)arg;
+  for (;;) {
+    pthread_mutex_lock(&q->lock);
+    size_t i = q->next++;
+    pthread_mutex_unlock(&q->lock);
+    if (i >= q->count)
+      break;
+    TRACE_BEGIN(start);
+    q->fn(i, q->ctx);
+    TRACE_END(start, "task", NULL, i);
+  }
+  return NULL;
+}
+
+void run_parallel(size_t count, int jobs, void (*fn)(size_t i, void *ctx),
+                  void *ctx) {
+  WorkQueue q;
+  q.count = count;
+  q.next = 0;
+  q.fn = fn;
+  q.ctx = ctx;
+  pthread_mutex_init(&q.lock, NULL);
+
+  if (jobs < 1)
+    jobs = 1;
+  if ((size_t)jobs > count)
+    jobs = (int)count;
+  pthread_t *threads = (pthread_t *)malloc(jobs * sizeof(pthread_t));
+  int started = 0;
+  if (threads && jobs > 1) {
+    for (; started < jobs; started++)
+      if (pthread_create(&threads[started], NULL, pool_worker, &q) != 0)
+        break;
+  }
+  if (started == 0)
+    pool_worker(&q);
+  for (int t = 0; t < started; t++)
+    pthread_join(threads[t], NULL);
+  free(threads);
+  pthread_mutex_destroy(&q.lock);
+}
@@ -0,0 +1,171 @@
+#include "../inc/write_cost.h"
+#include "../inc/id3_reader.h"
+#include "../inc/id3_v2.h"
+#include "../inc/tail_tags.h"
+#include "../inc/worker_pool.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef enum {
+  COST_ERROR,
+  COST_NONE,
+  COST_TRUNCATE,
+  COST_REWRITE,
+  COST_GROW,
+  COST_SHRINK
+} CostStrategy;
+
+static const char *strategy_names[] = {"error",        "none",
+                                       "truncate",     "rewrite",
+                                       "rewrite-grow", "rewrite-shrink"};
+
+typedef struct {
+  CostStrategy strategy;
+  off_t old_tag; // Leading (or appended) ID3v2 tag now
+  off_t new_tag; // ...and after the write
+  off_t copied;  // Bytes copied from the original into the new file
+  off_t v1;      // ID3v1 bytes written in place or appended
+  off_t written; // Everything written
+} WriteCost;
+
+typedef struct {
+  const FileList *files;
+  const TagUpdate *update;
+  int delete_tags;
+  WriteCost *costs;
+} CostBatch;
+
+// update_id3_tags(): one rewrite with the new ID3v2 tag, then the ID3v1 tag
+// updated in the new file or appended to it
+static void cost_update(int fd, const char *path, off_t size,
+                        const TagUpdate *update, WriteCost *c) {
+  TailTags tail;
+  if (probe_tail_tags(fd, size, 0, &tail) != SUCCESS)
+    return;
+  c->v1 = 128;
+
+  unsigned char header[10];
+  off_t lead = 0;
+  if (pread(fd, header, 10, 0) == 10)
+    lead = id3v2_tag_length(header);
+  if (lead > size)
+    lead = size;
+  c->old_tag = lead;
+  if (lead == 0) {
+    const TailBlock *appended = find_tail_block(&tail, TAIL_ID3V2);
+    if (appended)
+      c->old_tag = appended->size; // Dropped, superseded by the new tag
+  }
+
+  ID3v2_Content content;
+  memset(&content, 0, sizeof(ID3v2_Content));
+  read_id3v2_tag(path, &content);
+  Id3v2WritePlan plan;
+  plan_id3v2_tag(&plan, &content, update);
+  free_id3v2_content(&content);
+  if (plan.chapters_lost || plan.text_lost) {
+    memset(c, 0, sizeof(WriteCost)); // COST_ERROR: the write would refuse
+    return;
+  }
+
+  c->new_tag = (off_t)plan.total_size;
+  c->copied = size - c->old_tag;
+  c->written = c->v1 + c->new_tag + c->copied;
+  c->strategy = c->new_tag > c->old_tag   ? COST_GROW
+                : c->new_tag < c->old_tag ? COST_SHRINK
+                                          : COST_REWRITE;
+}
+
+// delete_id3_tags(): the audio between the tags, if there are any
+static void cost_delete(int fd, off_t size, WriteCost *c) {
+  off_t start, end;
+  locate_audio_range(fd, size, &start, &end);
+  c->old_tag = start;
+  if (start == 0 && end == size) {
+    c->strategy = COST_NONE;
+    return;
+  }
+  c->copied = end - start;
+  c->written = c->copied;
+  c->strategy = COST_TRUNCATE;
+}
+
+static void cost_one(size_t i, void *ctx) {
+  CostBatch *batch = (CostBatch *)ctx;
+  WriteCost *c = &batch->costs[i];
+  const char *path = batch->files->paths[i];
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    return; // COST_ERROR
+  }
+  if (batch->delete_tags)
+    cost_delete(fd, st.st_size, c);
+  else
+    cost_update(fd, path, st.st_size, batch->update, c);
+  close(fd);
+}
+
+Status plan_tag_writes(const FileList *files, const TagUpdate *update,
+                       int delete_tags, int jobs) {
+  CostBatch batch;
+  batch.files = files;
+  batch.update = update;
+  batch.delete_tags = delete_tags;
+  batch.costs = (WriteCost *)calloc(files->count, sizeof(WriteCost));
+  if (!batch.costs)
+    return ERROR_MEM_ALLOC;
+  // Only the sizes of pictures matter here
+  set_id3v2_picture_loading(0);
+  run_parallel(files->count, jobs, cost_one, &batch);
+  set_id3v2_picture_loading(1);
+
+  size_t count[COST_SHRINK + 1] = {0};
+  size_t heaviest[WRITE_COST_HEAVIEST];
+  int ranked = 0;
+  double written = 0, copied = 0, tags = 0;
+  printf("strategy\told_tag\tnew_tag\twritten\tpath\n");
+  for (size_t i = 0; i < files->count; i++) {
+    const WriteCost *c = &batch.costs[i];
+    count[c->strategy]++;
+    printf("%s\t%lld\t%lld\t%lld\t%s\n", strategy_names[c->strategy],
+           (long long)c->old_tag, (long long)c->new_tag,
+           (long long)c->written, files->paths[i]);
+    written += (double)c->written;
+    copied += (double)c->copied;
+    tags += (double)(c->new_tag + c->v1);
+
+    // Insertion into the short list of the largest jobs
+    int at = ranked < WRITE_COST_HEAVIEST ? ranked++ : WRITE_COST_HEAVIEST;
+    while (at > 0 && batch.costs[heaviest[at - 1]].written < c->written) {
+      if (at < WRITE_COST_HEAVIEST)
+        heaviest[at] = heaviest[at - 1];
+      at--;
+    }
+    if (at < WRITE_COST_HEAVIEST)
+      heaviest[at] = i;
+  }
+
+  const double mb = 1024.0 * 1024;
+  printf("------------------------------------------------------------\n");
+  printf("Files: %zu  Rewrite: %zu (grow %zu, shrink %zu, same size %zu)  "
+         "Truncate: %zu  Unchanged: %zu  Errors: %zu\n",
+         files->count,
+         count[COST_GROW] + count[COST_SHRINK] + count[COST_REWRITE],
+         count[COST_GROW], count[COST_SHRINK], count[COST_REWRITE],
+         count[COST_TRUNCATE], count[COST_NONE], count[COST_ERROR]);
+  printf("Bytes written: %.1f MB (%.1f MB copied from the originals, %.1f MB "
+         "of new tags)\n",
+         written / mb, copied / mb, tags / mb);
+  for (int r = 0; r < ranked && batch.costs[heaviest[r]].written > 0; r++)
+    printf("Heaviest: %.1f MB  %s\n", batch.costs[heaviest[r]].written / mb,
+           files->paths[heaviest[r]]);
+  free(batch.costs);
+  return count[COST_ERROR] ? ERROR_FILE_OPEN : SUCCESS;
+}